@@ -1,79 +1,309 @@
 #include "advertising_queue.h"
 #include "mesh_transport_network_protocol.h"
+#ifdef TEST_FLAG
+#include <string.h>
+#else
 #include "osal.h"
-#define ADVERTISING_QUEUE_MAX_SIZE 5
+#endif
 
+// Size of the (source, sequenceID) index, a power of two of at least twice
+// ADVERTISING_QUEUE_MAX_SIZE
+#if ADVERTISING_QUEUE_MAX_SIZE <= 8
+#define ADVERTISING_QUEUE_INDEX_SIZE 16
+#elif ADVERTISING_QUEUE_MAX_SIZE <= 32
+#define ADVERTISING_QUEUE_INDEX_SIZE 64
+#elif ADVERTISING_QUEUE_MAX_SIZE <= 128
+#define ADVERTISING_QUEUE_INDEX_SIZE 256
+#else
+#define ADVERTISING_QUEUE_INDEX_SIZE 512
+#endif
+#define ADVERTISING_QUEUE_INDEX_MASK (ADVERTISING_QUEUE_INDEX_SIZE - 1)
+#define ADVERTISING_QUEUE_EMPTY 0xFF
+
+#ifdef TEST_FLAG
+__thread uint32 advertisingQueueCopies = 0, advertisingQueueCopiedBytes = 0;
+static void* osal_memcpy(void* destination, const void* source, unsigned int length)
+{
+  advertisingQueueCopies++;
+  advertisingQueueCopiedBytes += length;
+  return memcpy(destination, source, length);
+}
+#endif
+
+// The items never move once enqueued, a heap per class orders their slot
+// numbers. Each slot owns an advertising frame, whose prefix is written once
+// at initialization, so the message is copied exactly once on its way to air.
 static AdvQueueItem advertisingQueue[ADVERTISING_QUEUE_MAX_SIZE];
+static uint8 advertisingFrames[ADVERTISING_QUEUE_MAX_SIZE][ADVERTISING_FRAME_LENGTH];
+// Tie breaker, so that items with the same timestamp keep their order
+static uint16 enqueueOrder[ADVERTISING_QUEUE_MAX_SIZE];
+static uint16 nextEnqueueOrder = 0;
+
+// Min-heaps of slots on advertisingTimeStamp, one per class
+static uint8 heaps[ADVERTISING_CLASSES][ADVERTISING_QUEUE_MAX_SIZE];
+static uint8 heapSizes[ADVERTISING_CLASSES];
+// Class and position in the heap of each slot
+static uint8 slotClass[ADVERTISING_QUEUE_MAX_SIZE];
+static uint8 heapPosition[ADVERTISING_QUEUE_MAX_SIZE];
+// Stack of the free slots, positions from size and up
+static uint8 freeSlots[ADVERTISING_QUEUE_MAX_SIZE];
+// Maps (source, sequenceID) of the queued messages to their slot
+static uint8 keyIndex[ADVERTISING_QUEUE_INDEX_SIZE];
 static uint8 size = 0;
+static uint16 localSource = 0;
+static const uint8 reserved[ADVERTISING_CLASSES] = {
+  ADVERTISING_QUEUE_CONTROL_RESERVED, 
+  ADVERTISING_QUEUE_LOCAL_RESERVED, 
+  ADVERTISING_QUEUE_RELAY_RESERVED
+};
+static const uint8 transmissions[ADVERTISING_CLASSES] = {
+  ADVERTISING_CONTROL_TRANSMISSIONS,
+  ADVERTISING_LOCAL_TRANSMISSIONS,
+  ADVERTISING_RELAY_TRANSMISSIONS
+};
+static const uint16 transmitIntervals[ADVERTISING_CLASSES] = {
+  ADVERTISING_CONTROL_INTERVAL,
+  ADVERTISING_LOCAL_INTERVAL,
+  ADVERTISING_RELAY_INTERVAL
+};
+static uint16 drops[ADVERTISING_CLASSES];
+
+static uint8 isAdmitted(AdvertisingClass advertisingClass);
+static uint8 isBefore(uint8 slot, uint8 otherSlot);
+static void swap(uint8* heap, uint8 position, uint8 otherPosition);
+static void siftUp(uint8* heap, uint8 position);
+static void siftDown(uint8* heap, uint8 heapSize, uint8 position);
+static void removeAt(uint8 slot);
+static uint16 getKeyHash(uint16 source, uint8 sequenceID);
+static uint16 getSlotKeyHash(uint8 slot);
+static void removeFromKeyIndex(uint8 slot);
+
+void initializeAdvertisementQueue(uint8* framePrefix) {
+  size = 0;
+  for(uint8 i = 0; i < ADVERTISING_CLASSES; i++) {
+    heapSizes[i] = 0;
+    drops[i] = 0;
+  }
+  for(uint8 i = 0; i < ADVERTISING_QUEUE_MAX_SIZE; i++) {
+    freeSlots[i] = i;
+    advertisingQueue[i].frame = advertisingFrames[i];
+    advertisingQueue[i].data = &advertisingFrames[i][ADVERTISING_FRAME_PREFIX_LENGTH];
+    for(uint8 u = 0; u < ADVERTISING_FRAME_PREFIX_LENGTH; u++) {
+      advertisingFrames[i][u] = framePrefix[u];
+    }
+  }
+  for(uint16 i = 0; i < ADVERTISING_QUEUE_INDEX_SIZE; i++) {
+    keyIndex[i] = ADVERTISING_QUEUE_EMPTY;
+  }
+}
+
+void setAdvertisementQueueSource(uint16 source) {
+  localSource = source;
+}
 
 uint8 getAdvertisementQueueSize() {
     return size;
 }
+
 uint8 enqueueAdvertisement(uint8 length, uint8* data, uint32 timeStamp) {
-  if(size == ADVERTISING_QUEUE_MAX_SIZE) {
+  AdvertisingClass advertisingClass = getAdvertisingClass(data);
+  if(!isAdmitted(advertisingClass) || length > ADVERTISING_DATA_MAX_LENGTH) {
+    drops[advertisingClass]++;
     return FALSE;
   }
-  
-  
-  uint8 i = 0;
-  if(size > 0) {
-    i = size - 1;
-    for(; i >= 0; i--) {
-      if(advertisingQueue[i].advertisingTimeStamp > timeStamp) {
-          // move up in the queue
-          advertisingQueue[i].length = advertisingQueue[i+1].length;
-          advertisingQueue[i].data = advertisingQueue[i+1].data;
-          advertisingQueue[i].advertisingTimeStamp = advertisingQueue[i+1].advertisingTimeStamp;
-      } else {
-        // The current has a lower timestamp => insert one above
-        i++;
-        break;
-      }
-    }
+
+  // Take the first free slot
+  uint8 slot = freeSlots[size];
+  advertisingQueue[slot].length = length;
+  osal_memcpy(advertisingQueue[slot].data, data, length);
+  advertisingQueue[slot].advertisingTimeStamp = timeStamp;
+  advertisingQueue[slot].transmissions = transmissions[advertisingClass];
+  advertisingQueue[slot].transmitInterval = transmitIntervals[advertisingClass];
+  enqueueOrder[slot] = nextEnqueueOrder++;
+
+  MessageHeader* header = (MessageHeader*) data;
+  uint16 hash = getKeyHash(header->source, header->sequenceID);
+  while(keyIndex[hash] != ADVERTISING_QUEUE_EMPTY) {
+    hash = (hash + 1) & ADVERTISING_QUEUE_INDEX_MASK;
   }
-  
-  advertisingQueue[i].length = length;
-  osal_memcpy(advertisingQueue[i].data, data, length);
-  advertisingQueue[i].advertisingTimeStamp = timeStamp;
+  keyIndex[hash] = slot;
+
   size++;
-  
+  slotClass[slot] = advertisingClass;
+  uint8* heap = heaps[advertisingClass];
+  heap[heapSizes[advertisingClass]] = slot;
+  heapPosition[slot] = heapSizes[advertisingClass]++;
+  siftUp(heap, heapSizes[advertisingClass] - 1);
+
   return TRUE;
 }
 
 AdvQueueItem* getFirstInAdvertisementQueue() {
-  return size > 0? &advertisingQueue[0] : NULL;
-    
+  uint8 first = ADVERTISING_QUEUE_EMPTY;
+  for(uint8 i = 0; i < ADVERTISING_CLASSES; i++) {
+    if(heapSizes[i] > 0 
+        && (first == ADVERTISING_QUEUE_EMPTY || isBefore(heaps[i][0], first))) {
+      first = heaps[i][0];
+    }
+  }
+  return first != ADVERTISING_QUEUE_EMPTY ? &advertisingQueue[first] : NULL;
+}
+
+AdvQueueItem* getNextInAdvertisementQueue(uint32 time) {
+  for(uint8 i = 0; i < ADVERTISING_CLASSES; i++) {
+    if(heapSizes[i] > 0 
+        && (int32)(advertisingQueue[heaps[i][0]].advertisingTimeStamp - time) <= 0) {
+      return &advertisingQueue[heaps[i][0]];
+    }
+  }
+  return getFirstInAdvertisementQueue();
 }
 
 void removeFirstInAdvertisementQueue() {
   if(size == 0) {
     return;
   }
-  
-  size--;
-  for(uint8 i = 0; i < size; i++) {
-      advertisingQueue[size].length = advertisingQueue[size+1].length;
-      advertisingQueue[size].data = advertisingQueue[size+1].data;
-      advertisingQueue[size].advertisingTimeStamp = advertisingQueue[size+1].advertisingTimeStamp;
-  }
-  
+
+  removeFromAdvertisementQueue(getFirstInAdvertisementQueue());
+}
+
+void removeFromAdvertisementQueue(AdvQueueItem* item) {
+  removeAt(item - advertisingQueue);
 }
 
 uint8 dequeueAdvertisement(uint16 source, uint8 sequenceID) {
-  uint8 moveDown = FALSE;
-   for(uint8 i = 0; i < size; i++) {
-     MessageHeader* header = (MessageHeader*) &advertisingQueue[i].data;
-     if(header->source == source && header->sequenceID == sequenceID) {
-      moveDown = TRUE;
-      size--;
-     } 
-     
-     if(moveDown == TRUE) {
-      advertisingQueue[i].length = advertisingQueue[i+1].length;
-      advertisingQueue[i].data = advertisingQueue[i+1].data;
-      advertisingQueue[i].advertisingTimeStamp = advertisingQueue[i+1].advertisingTimeStamp;
-     }
-  } 
-  
-  return moveDown;
-}
\ No newline at end of file
+  uint16 hash = getKeyHash(source, sequenceID);
+  while(keyIndex[hash] != ADVERTISING_QUEUE_EMPTY) {
+    uint8 slot = keyIndex[hash];
+    MessageHeader* header = (MessageHeader*) advertisingQueue[slot].data;
+    if(header->source == source && header->sequenceID == sequenceID) {
+      removeAt(slot);
+      return TRUE;
+    }
+    hash = (hash + 1) & ADVERTISING_QUEUE_INDEX_MASK;
+  }
+
+  return FALSE;
+}
+
+AdvertisingClass getAdvertisingClass(uint8* data) {
+  MessageHeader* header = (MessageHeader*) data;
+  if(header->type == STATEFUL_MESSAGE_ACK || header->type == SEGMENT_ACK) {
+    return ADVERTISING_CLASS_CONTROL;
+  }
+  // Aggregates are only built by this node
+  if(header->source == localSource || header->source == AGGREGATE_SOURCE) {
+    return ADVERTISING_CLASS_LOCAL;
+  }
+  return ADVERTISING_CLASS_RELAY;
+}
+
+uint16 getAdvertisementQueueDrops(AdvertisingClass advertisingClass) {
+  return drops[advertisingClass];
+}
+
+static uint8 isAdmitted(AdvertisingClass advertisingClass) {
+  uint8 kept = 0;
+  for(uint8 i = 0; i < ADVERTISING_CLASSES; i++) {
+    if(i != advertisingClass && heapSizes[i] < reserved[i]) {
+      kept += reserved[i] - heapSizes[i];
+    }
+  }
+  return size + kept < ADVERTISING_QUEUE_MAX_SIZE;
+}
+
+static uint8 isBefore(uint8 slot, uint8 otherSlot) {
+  // Compare the differences, so that the order survives the clock wrapping
+  int32 difference = (int32)(advertisingQueue[slot].advertisingTimeStamp
+                        - advertisingQueue[otherSlot].advertisingTimeStamp);
+  if(difference != 0) {
+    return difference < 0;
+  }
+  return (int16)(enqueueOrder[slot] - enqueueOrder[otherSlot]) < 0;
+}
+
+static void swap(uint8* heap, uint8 position, uint8 otherPosition) {
+  uint8 slot = heap[position];
+  heap[position] = heap[otherPosition];
+  heap[otherPosition] = slot;
+  heapPosition[heap[position]] = position;
+  heapPosition[heap[otherPosition]] = otherPosition;
+}
+
+static void siftUp(uint8* heap, uint8 position) {
+  while(position > 0) {
+    uint8 parent = (position - 1) / 2;
+    if(!isBefore(heap[position], heap[parent])) {
+      break;
+    }
+    swap(heap, position, parent);
+    position = parent;
+  }
+}
+
+static void siftDown(uint8* heap, uint8 heapSize, uint8 position) {
+  while(TRUE) {
+    uint8 first = position;
+    uint8 child = 2 * position + 1;
+    if(child < heapSize && isBefore(heap[child], heap[first])) {
+      first = child;
+    }
+    child++;
+    if(child < heapSize && isBefore(heap[child], heap[first])) {
+      first = child;
+    }
+    if(first == position) {
+      break;
+    }
+    swap(heap, position, first);
+    position = first;
+  }
+}
+
+static void removeAt(uint8 slot) {
+  removeFromKeyIndex(slot);
+
+  // Move the last item of the heap into the gap
+  uint8* heap = heaps[slotClass[slot]];
+  uint8 heapSize = --heapSizes[slotClass[slot]];
+  uint8 position = heapPosition[slot];
+  if(position != heapSize) {
+    swap(heap, position, heapSize);
+    siftDown(heap, heapSize, position);
+    siftUp(heap, position);
+  }
+  size--;
+  freeSlots[size] = slot;
+}
+
+static uint16 getKeyHash(uint16 source, uint8 sequenceID) {
+  uint16 hash = source ^ (uint16)(sequenceID * 0x9E37u);
+  hash ^= hash >> 7;
+  return hash & ADVERTISING_QUEUE_INDEX_MASK;
+}
+
+static uint16 getSlotKeyHash(uint8 slot) {
+  MessageHeader* header = (MessageHeader*) advertisingQueue[slot].data;
+  return getKeyHash(header->source, header->sequenceID);
+}
+
+static void removeFromKeyIndex(uint8 slot) {
+  uint16 hash = getSlotKeyHash(slot);
+  while(keyIndex[hash] != slot) {
+    hash = (hash + 1) & ADVERTISING_QUEUE_INDEX_MASK;
+  }
+
+  // Shift the rest of the probe sequence back into the hole
+  uint16 hole = hash;
+  uint16 next = (hash + 1) & ADVERTISING_QUEUE_INDEX_MASK;
+  while(keyIndex[next] != ADVERTISING_QUEUE_EMPTY) {
+    uint16 home = getSlotKeyHash(keyIndex[next]);
+    if(((next - home) & ADVERTISING_QUEUE_INDEX_MASK)
+        >= ((next - hole) & ADVERTISING_QUEUE_INDEX_MASK)) {
+      keyIndex[hole] = keyIndex[next];
+      hole = next;
+    }
+    next = (next + 1) & ADVERTISING_QUEUE_INDEX_MASK;
+  }
+  keyIndex[hole] = ADVERTISING_QUEUE_EMPTY;
+}
@@ -1,18 +1,111 @@
 #ifndef ADVERTISING_QUEUE_H
 #define ADVERTISING_QUEUE_H
+#ifdef TEST_FLAG
+#include "mesh_transport_network_protocol.h"
+#else
 #include "comdef.h"
-typedef struct  
+#endif
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+// Max number of queued advertisements, at most 254
+#ifndef ADVERTISING_QUEUE_MAX_SIZE
+#define ADVERTISING_QUEUE_MAX_SIZE 16
+#endif
+// Advertising data is at most 31 bytes, starting with a fixed prefix which is
+// followed by the mesh message
+#define ADVERTISING_FRAME_LENGTH 31
+#define ADVERTISING_FRAME_PREFIX_LENGTH 4
+#define ADVERTISING_DATA_MAX_LENGTH (ADVERTISING_FRAME_LENGTH - ADVERTISING_FRAME_PREFIX_LENGTH)
+
+// Slots kept for each class. A class may only take a slot when enough are 
+// left for what the other classes have reserved and not used.
+#ifndef ADVERTISING_QUEUE_CONTROL_RESERVED
+#define ADVERTISING_QUEUE_CONTROL_RESERVED 2
+#endif
+#ifndef ADVERTISING_QUEUE_LOCAL_RESERVED
+#define ADVERTISING_QUEUE_LOCAL_RESERVED 4
+#endif
+#ifndef ADVERTISING_QUEUE_RELAY_RESERVED
+#define ADVERTISING_QUEUE_RELAY_RESERVED 0
+#endif
+
+// Advertising events each class is sent in, and the advertising interval
+// between them in units of 0.625 ms, at least 32. ACKs and messages of this
+// node have no other node to repeat them, relays are repeated by the 
+// neighbours as well.
+#ifndef ADVERTISING_CONTROL_TRANSMISSIONS
+#define ADVERTISING_CONTROL_TRANSMISSIONS 3
+#endif
+#ifndef ADVERTISING_LOCAL_TRANSMISSIONS
+#define ADVERTISING_LOCAL_TRANSMISSIONS 3
+#endif
+#ifndef ADVERTISING_RELAY_TRANSMISSIONS
+#define ADVERTISING_RELAY_TRANSMISSIONS 2
+#endif
+#ifndef ADVERTISING_CONTROL_INTERVAL
+#define ADVERTISING_CONTROL_INTERVAL 48
+#endif
+#ifndef ADVERTISING_LOCAL_INTERVAL
+#define ADVERTISING_LOCAL_INTERVAL 48
+#endif
+#ifndef ADVERTISING_RELAY_INTERVAL
+#define ADVERTISING_RELAY_INTERVAL 70
+#endif
+
+// Of the advertisements that are due, those of the first class go first
+typedef enum
+{
+  // ACKs, whichever node they are from
+  ADVERTISING_CLASS_CONTROL = 0,
+  // Messages of this node
+  ADVERTISING_CLASS_LOCAL,
+  // Messages relayed for other nodes
+  ADVERTISING_CLASS_RELAY
+} AdvertisingClass;
+#define ADVERTISING_CLASSES 3
+
+typedef struct
 {
+    // Length of the mesh message
     uint8 length;
+    // The mesh message, located within frame
     uint8* data;
+    // Complete advertising data, ADVERTISING_FRAME_PREFIX_LENGTH + length bytes
+    uint8* frame;
     uint32 advertisingTimeStamp;
+    // Advertising events to send the message in, and their interval in 
+    // units of 0.625 ms, as set for its class
+    uint8 transmissions;
+    uint16 transmitInterval;
 } AdvQueueItem;
 
+#ifdef TEST_FLAG
+// Number of copies and bytes copied into the queue, per thread
+extern __thread uint32 advertisingQueueCopies, advertisingQueueCopiedBytes;
+#endif
+
+void initializeAdvertisementQueue(uint8* framePrefix);
+// Messages from this source are local, all others but ACKs are relays
+void setAdvertisementQueueSource(uint16 source);
 uint8 getAdvertisementQueueSize();
 uint8 enqueueAdvertisement(uint8 length, uint8* data, uint32 timeStamp);
+// The item due first, whatever its class
 AdvQueueItem* getFirstInAdvertisementQueue();
+// The first due item of the highest class with one due at time, or the 
+// item due first if none is
+AdvQueueItem* getNextInAdvertisementQueue(uint32 time);
 void removeFirstInAdvertisementQueue();
+void removeFromAdvertisementQueue(AdvQueueItem* item);
 uint8 dequeueAdvertisement(uint16 source, uint8 sequenceID);
+AdvertisingClass getAdvertisingClass(uint8* data);
+// Advertisements of the class not queued since initialization
+uint16 getAdvertisementQueueDrops(AdvertisingClass advertisingClass);
 
+#ifdef	__cplusplus
+}
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -59,6 +59,8 @@ SOFTWARE.
 #include "relay_switch_application.h"
 #include "dimmer_application.h"
 #include "advertising_queue.h"
+#include "scan_scheduler.h"
+#include "scan_filter.h"
 #include "node_information_application.h"
 /*********************************************************************
 * MACROS
@@ -74,7 +76,7 @@ SOFTWARE.
 //#define DEBUG_PRINT
 
 #define MESH_IDENTIFIER         0xBC
-#define MESH_MESSAGE_FLAG_OFFSET        4
+#define MESH_MESSAGE_FLAG_OFFSET        ADVERTISING_FRAME_PREFIX_LENGTH
 #define NODE_NAME_MAX_SIZE      20
 #define NETWORK_NAME_MAX_SIZE   20
   
@@ -90,15 +92,24 @@ SOFTWARE.
 #define DEFAULT_NETWORK_NAME            "BT Mesh Network"
 #define DEFAULT_NETWORK_ID              999
 
-// How often to perform periodic event
+// Delay before the first periodic event, later ones follow the protocol timers
 #define SBP_PERIODIC_EVT_PERIOD                   2500
 
 // What is the advertising interval when device is discoverable (units of 625us, 160=100ms)
 #define DEFAULT_ADVERTISING_INTERVAL 70
 #define DEFAULT_ADVERTISING_IN_CONNECTION_INTERVAL 165
 
-#define FORWARDING_INTERVAL 90
-#define FORWARDING_IN_CONNECTION_INTERVAL 200
+// Advertising events are delayed at random by up to ADVERTISING_DELAY_MAX ms,
+// and last at most ADVERTISING_EVENT_TIME ms on the three channels
+#define ADVERTISING_DELAY_MAX 10
+#define ADVERTISING_EVENT_TIME 3
+// Queued messages due within this many ms of the first one are sent in the
+// same advertisement when they fit
+#define AGGREGATION_WINDOW 20
+// Messages an advertisement can carry, the shortest taking a length byte and
+// a broadcast header without the network identifier
+#define FORWARDED_MESSAGES_MAX ((MESSAGE_LENGTH_MAX - AGGREGATE_HEADER_SIZE) \
+                                / (1 + BROADCAST_HEADER_SIZE - sizeof(uint16)))
 
 // General discoverable mode advertises indefinitely
 #define DEFAULT_DISCOVERABLE_MODE             GAP_ADTYPE_FLAGS_GENERAL
@@ -129,7 +140,8 @@ SOFTWARE.
 #define MAX_RX_LEN                            30
 #define SBP_RX_TIME_OUT                       5
 
-#define DEFAULT_SCAN_DURATION                 100
+// Time observing stops for when advertising starts
+#define OBSERVING_RESTART_DELAY               15
 
 // Discovey mode (limited, general, all)
 #define DEFAULT_DISCOVERY_MODE                DEVDISC_MODE_ALL
@@ -140,9 +152,6 @@ SOFTWARE.
 // TRUE to use white list during discovery
 #define DEFAULT_DISCOVERY_WHITE_LIST          FALSE
 
-// Maximum number of scan responses
-#define DEFAULT_MAX_SCAN_RES                  15
-
 #define DEFAULT                               1
 #define FORWARD                               2
 
@@ -172,6 +181,11 @@ SOFTWARE.
 static uint8 biscuit_TaskID;   // Task ID for internal task/event processing
 static gaprole_States_t gapProfileState = GAPROLE_INIT;
 static uint8 isObserving = FALSE;
+static ScanScheduler scanScheduler;
+static ScanFilter scanFilter;
+// Stateful messages from the client that weren't sent, the pending ACK 
+// table being full
+static uint16 rejectedStatefulMessages = 0;
 static uint8 isAdvertisingPeriodically = TRUE;
 static Application applications[APPLICATIONS_LENGTH];
 
@@ -213,6 +227,28 @@ static uint8 advertData[31] =
 };
 
 
+// Prefix of forwarded advertisements, followed by the mesh message
+static uint8 forwardingFramePrefix[MESH_MESSAGE_FLAG_OFFSET] =
+{
+  0x02,   // length of this data
+  GAP_ADTYPE_FLAGS,
+  DEFAULT_DISCOVERABLE_MODE | GAP_ADTYPE_FLAGS_BREDR_NOT_SUPPORTED,
+  27
+};
+
+// A due frame waits for the stack to end advertising the one before. It is
+// built only then, so that its messages can be cancelled until they go on 
+// air.
+static uint8 isRestartingForwarding = FALSE;
+// The messages in the frame on air, as an aggregate holds several, and the
+// advertising events it has left. Cancelled ones get AGGREGATE_SOURCE.
+static uint16 forwardingSources[FORWARDED_MESSAGES_MAX];
+static uint8 forwardingSequenceIDs[FORWARDED_MESSAGES_MAX];
+static uint8 forwardedMessages = 0;
+static uint8 forwardedMessagesLeft = 0;
+static uint8 transmissionsLeft = 0;
+static uint16 transmitPeriod;
+
 // GAP GATT Attributes
 static uint8 attDeviceName[GAP_DEVICE_NAME_LEN] = "EHMARINE";
 uint8 isForwarding = FALSE;
@@ -224,8 +260,10 @@ uint8 count = 0;
 static void biscuit_ProcessOSALMsg( osal_event_hdr_t *pMsg );
 static void peripheralStateNotificationCB( gaprole_States_t newState );
 static void performPeriodicTask( void );
+static void schedulePeriodicTask( void );
 static void meshServiceChangeCB( uint8 paramID );
 static void simpleBLEObserverEventCB( observerRoleEvent_t *pEvent );
+static void simpleBLEScanReportCB( uint8 *pData, uint8 dataLen );
 static void advertiseCallback(uint8* data, uint8 length, uint16 delay);
 static void messageCallback(uint16 source, uint8* data, uint8 length);
 static void dataHandler( uint8 port, uint8 events );
@@ -233,6 +271,14 @@ static void processClientMessage(uint8* data, uint8 length);
 static void applicationClientResponseCallback(uint8* data, uint8 length);
 static void UARTWriteWrapper(uint8* data, uint8 length);
 static void processQueue();
+static void startObserving();
+static void pauseObserving();
+static void restartForwarding();
+static void forwardNextFrame();
+static void addForwardedMessage(uint8* data);
+static uint8 cancelForwardedMessage(uint16 source, uint8 sequenceId);
+static void startForwarding(uint8* frame, uint8 length, uint8 transmissions, 
+                            uint16 transmitInterval);
 static void cancelAdvertisementCallback(uint16 source, uint8 sequenceId);
 /*********************************************************************
 * PROFILE CALLBACKS
@@ -243,7 +289,8 @@ static gapRolesCBs_t biscuit_PeripheralCBs =
 {
   peripheralStateNotificationCB,  // Profile State Change Callbacks
   NULL,                            // When a valid RSSI is read from controller (not used by application)
-  simpleBLEObserverEventCB
+  simpleBLEObserverEventCB,
+  simpleBLEScanReportCB            // Every advertising report, with no cap on the number per discovery
 };
 
 // GAP Bond Manager Callbacks
@@ -316,6 +363,8 @@ void Biscuit_Init( uint8 task_id )
   
   GGS_SetParameter( GGS_DEVICE_NAME_ATT, GAP_DEVICE_NAME_LEN, attDeviceName );
   
+  initializeAdvertisementQueue(forwardingFramePrefix);
+  
 #ifdef BURN_DEFAULTS
   uint8 networkName[20] = DEFAULT_NETWORK_NAME;
   uint8 nodeName[20] = DEFAULT_NODE_NAME;
@@ -335,17 +384,13 @@ void Biscuit_Init( uint8 task_id )
                                    &messageCallback, &osal_GetSystemClock, 
                                    &osal_rand,
                                    &cancelAdvertisementCallback);
+  setAdvertisementQueueSource(nodeID);
+  initializeScanFilter(&scanFilter, forwardingFramePrefix, networkID);
 #endif
   
   GAPRole_SetParameter(GAPROLE_ADVERT_DATA, sizeof(advertData), advertData);
   
   
-  // Setup observer related GAP profile properties
-  {
-    uint8 scanRes = DEFAULT_MAX_SCAN_RES;
-    GAPRole_SetParameter(GAPOBSERVERROLE_MAX_SCAN_RES, sizeof( uint8 ), &scanRes);
-  }
-  
   // Set advertising interval
   {
     uint16 interval = DEFAULT_ADVERTISING_INTERVAL;
@@ -359,10 +404,14 @@ void Biscuit_Init( uint8 task_id )
   }
   
   {
-    GAP_SetParamValue( TGAP_GEN_DISC_SCAN, DEFAULT_SCAN_DURATION );
-    GAP_SetParamValue( TGAP_LIM_DISC_SCAN, DEFAULT_SCAN_DURATION );
-    GAP_SetParamValue( TGAP_GEN_DISC_SCAN_WIND, 30);
-    GAP_SetParamValue( TGAP_GEN_DISC_SCAN_INT,  35);
+    // Every advertising report is wanted, not just the first one of each 
+    // device in a discovery, so discoveries need not be short
+    GAP_SetParamValue( TGAP_FILTER_ADV_REPORTS, FALSE );
+    GAP_SetParamValue( TGAP_GEN_DISC_SCAN, SCAN_DURATION );
+    GAP_SetParamValue( TGAP_LIM_DISC_SCAN, SCAN_DURATION );
+    initializeScanScheduler(&scanScheduler, osal_GetSystemClock());
+    GAP_SetParamValue( TGAP_GEN_DISC_SCAN_WIND, getScanWindow(&scanScheduler));
+    GAP_SetParamValue( TGAP_GEN_DISC_SCAN_INT, getScanInterval(&scanScheduler));
   }
   
   // Setup the GAP Bond Manager
@@ -514,14 +563,9 @@ uint16 Biscuit_ProcessEvent( uint8 task_id, uint16 events )
   
   if ( events & SBP_PERIODIC_EVT )
   {
-    // Restart timer
-    if ( SBP_PERIODIC_EVT_PERIOD )
-    {
-      osal_start_timerEx( biscuit_TaskID, SBP_PERIODIC_EVT, SBP_PERIODIC_EVT_PERIOD );
-    }
-    
-    // Perform periodic application task
+    // Perform periodic application task, then wait for the next timer
     performPeriodicTask();
+    schedulePeriodicTask();
     
     return (events ^ SBP_PERIODIC_EVT);
   }
@@ -530,9 +574,7 @@ uint16 Biscuit_ProcessEvent( uint8 task_id, uint16 events )
   {
     if(isObserving == 0){
       // Start observing again
-      GAPObserverRole_StartDiscovery( DEFAULT_DISCOVERY_MODE,
-                                     DEFAULT_DISCOVERY_ACTIVE_SCAN,
-                                     DEFAULT_DISCOVERY_WHITE_LIST ); 
+      startObserving();
     }    
     isObserving = 1;
   }
@@ -542,6 +584,8 @@ uint16 Biscuit_ProcessEvent( uint8 task_id, uint16 events )
     if(isForwarding == FALSE){
       // Set back the default advertising data and advertising period
       GAPRole_SetParameter(GAPROLE_ADVERT_DATA, sizeof(advertData), advertData);
+      GAP_SetParamValue( TGAP_GEN_DISC_ADV_INT_MIN, DEFAULT_ADVERTISING_INTERVAL );
+      GAP_SetParamValue( TGAP_GEN_DISC_ADV_INT_MAX, DEFAULT_ADVERTISING_INTERVAL );
       
       // Turn on advertisements
       uint8 dummy = TRUE;
@@ -566,13 +610,24 @@ uint16 Biscuit_ProcessEvent( uint8 task_id, uint16 events )
   
   if (events & SBP_FORWARDING_DONE_EVENT) 
   {
-    isForwarding = FALSE;
-    GAPRole_SetParameter( GAPROLE_ADVERT_ENABLED, sizeof( uint8 ), &isForwarding); 
-    if(getAdvertisementQueueSize() > 0) {
-      // Continue to proccess queue
-      processQueue();
+    if(transmissionsLeft > 1) {
+      // Another advertising event of the frame is over
+      transmissionsLeft--;
+      osal_start_timerEx(biscuit_TaskID, SBP_FORWARDING_DONE_EVENT, transmitPeriod);
+    } else {
+      transmissionsLeft = 0;
+      isForwarding = FALSE;
+      GAPRole_SetParameter( GAPROLE_ADVERT_ENABLED, sizeof( uint8 ), &isForwarding); 
+      if(getAdvertisementQueueSize() > 0 
+         && getFirstInAdvertisementQueue()->advertisingTimeStamp <= osal_GetSystemClock()) {
+        // The next frame goes on air as soon as the stack has ended 
+        // advertising, see peripheralStateNotificationCB
+        isRestartingForwarding = TRUE;
+      } else if(getAdvertisementQueueSize() > 0) {
+        // Continue to proccess queue
+        processQueue();
+      }
     }
-    
   }
   
   if(events & SBP_START_FORWARDING_EVENT) 
@@ -582,26 +637,19 @@ uint16 Biscuit_ProcessEvent( uint8 task_id, uint16 events )
       // If advertisement has been canceled, but event hasn't
       return 0;
     }
-    AdvQueueItem* firstInQueue = getFirstInAdvertisementQueue();
-    // If there is no mesg in queue advertise directly
-    isObserving = FALSE;
-    GAPObserverRole_StopDiscovery();
-    // Start delayed observing
-    osal_start_timerEx(biscuit_TaskID, SBP_START_OBSERVING, 15);
     
-    // Set advertising data for the first queue item
-    uint8 data[32] = {0x02, GAP_ADTYPE_FLAGS, DEFAULT_DISCOVERABLE_MODE | GAP_ADTYPE_FLAGS_BREDR_NOT_SUPPORTED, 27};
-    osal_memcpy(&data[4], firstInQueue->data, firstInQueue->length);
-    GAPRole_SetParameter( GAPROLE_ADVERT_DATA, firstInQueue->length+MESH_MESSAGE_FLAG_OFFSET, data);
+    if(isForwarding == TRUE || isRestartingForwarding == TRUE) {
+      // Sent once the frame on air is done, see SBP_FORWARDING_DONE_EVENT
+      return 0;
+    }
     
-    // Start forwarding
-    uint8 dummy = TRUE;
-    GAPRole_SetParameter( GAPROLE_ADVERT_ENABLED, sizeof( uint8 ), &dummy );
-    isForwarding = TRUE;
+    pauseObserving();
+    forwardNextFrame();
     
-    osal_start_timerEx(biscuit_TaskID, SBP_FORWARDING_DONE_EVENT, 
-                       isAdvertisingPeriodically == FALSE ? FORWARDING_IN_CONNECTION_INTERVAL : FORWARDING_INTERVAL);
-    removeFirstInAdvertisementQueue();
+    if(getAdvertisementQueueSize() > 0) {
+      // Build the next frame when due
+      processQueue();
+    }
   }
 
   // Discard unknown events
@@ -655,6 +703,7 @@ static void peripheralStateNotificationCB( gaprole_States_t newState )
     
   case GAPROLE_CONNECTED:
     { 
+      restartForwarding();
       if(isAdvertisingPeriodically == TRUE) {
         P0_7 = 0; // Turn on blue led to indicate connection
         // If we're advertising periodically, turn it off while in connection
@@ -680,6 +729,7 @@ static void peripheralStateNotificationCB( gaprole_States_t newState )
 #ifdef DEBUG_PRINT
       debugPrintLine("GAPROLE_WAITING"); 
 #endif
+      restartForwarding();
       if(isAdvertisingPeriodically == FALSE) {
         P0_7 = 1; // Turn off blue led to indicate connection
         // Restart periodic advertisement after disconnection
@@ -696,6 +746,8 @@ static void peripheralStateNotificationCB( gaprole_States_t newState )
 #ifdef DEBUG_PRINT
       debugPrintLine("GAPROLE_WAITING_AFTER_TIMEOUT");
 #endif
+      // Advertising may end here as well, forwarding would stall otherwise
+      restartForwarding();
     }
     break;
     
@@ -730,37 +782,53 @@ static void simpleBLEObserverEventCB( observerRoleEvent_t *pEvent )
     }
     break;
     
-  case GAP_DEVICE_INFO_EVENT:
-    {
-      uint8* data = pEvent->deviceInfo.pEvtData;
-      uint8  dataLen = pEvent->deviceInfo.dataLen;
-      processIncomingMessage(&data[MESH_MESSAGE_FLAG_OFFSET], dataLen-MESH_MESSAGE_FLAG_OFFSET);
-    }
-    break;
-    
   case GAP_DEVICE_DISCOVERY_EVENT:
     {
       if(isObserving == 1){
-        GAPObserverRole_StartDiscovery( DEFAULT_DISCOVERY_MODE,
-                                       DEFAULT_DISCOVERY_ACTIVE_SCAN,
-                                       DEFAULT_DISCOVERY_WHITE_LIST );
+        // Go on right away, so that little is missed in between
+        stopScan(&scanScheduler, osal_GetSystemClock());
+        startObserving();
       }
     }
     break;
   }
 }
 
+/*********************************************************************
+* @fn      simpleBLEScanReportCB
+*
+* @brief   Advertising report callback function. The observer streams,
+*          so this gets every report without it being kept in a
+*          discovery result table.
+*
+* @param   pData - advertising data
+* @param   dataLen - length of the data
+*
+* @return  none
+*/
+
+static void simpleBLEScanReportCB( uint8 *pData, uint8 dataLen )
+{
+  // Other devices and networks around shouldn't cost a parse, nor make
+  // scanning busier
+  if(filterScanReport(&scanFilter, pData, dataLen) != SCAN_FILTER_ACCEPTED) {
+    return;
+  }
+  // Traffic picking up raises the duty cycle when the next discovery starts,
+  // within SCAN_DURATION. Restarting now would leave a gap in scanning.
+  countScanPacket(&scanScheduler);
+  processIncomingMessage(&pData[MESH_MESSAGE_FLAG_OFFSET], dataLen-MESH_MESSAGE_FLAG_OFFSET);
+  schedulePeriodicTask();
+}
+
 
 
 /*********************************************************************
 * @fn      performPeriodicTask
 *
 * @brief   Perform a periodic application task. This function gets
-*          called every five seconds as a result of the SBP_PERIODIC_EVT
-*          OSAL event. In this example, the value of the third
-*          characteristic in the SimpleGATTProfile service is retrieved
-*          from the profile, and then copied into the value of the
-*          the fourth characteristic.
+*          called as a result of the SBP_PERIODIC_EVT OSAL event and
+*          runs the protocol timers that are due.
 *
 * @param   none
 *
@@ -773,6 +841,37 @@ static void performPeriodicTask( void )
 
 }
 
+/*********************************************************************
+* @fn      schedulePeriodicTask
+*
+* @brief   Set SBP_PERIODIC_EVT to fire at the earliest protocol timer
+*          deadline, or stop it when no timer is running.
+*
+* @param   none
+*
+* @return  none
+*/
+static void schedulePeriodicTask( void )
+{
+  uint32 deadline;
+  if ( getNextDeadline( &deadline ) )
+  {
+    uint32 now = osal_GetSystemClock();
+    if ( (int32) (deadline - now) <= 0 )
+    {
+      osal_set_event( biscuit_TaskID, SBP_PERIODIC_EVT );
+    }
+    else
+    {
+      osal_start_timerEx( biscuit_TaskID, SBP_PERIODIC_EVT, deadline - now );
+    }
+  }
+  else
+  {
+    osal_stop_timerEx( biscuit_TaskID, SBP_PERIODIC_EVT );
+  }
+}
+
 /*********************************************************************
 * @fn      meshServiceChangeCB
 *
@@ -940,10 +1039,154 @@ static void processClientMessage(uint8* data, uint8 length)
       }
     case STATEFUL_MESSAGE:
       {
-        sendStatefulMessage(dest, message, length);
+        if(sendStatefulMessage(dest, message, length) == PENDING_ACK_REJECTED 
+           && rejectedStatefulMessages < 0xFFFF) {
+          rejectedStatefulMessages++;
+        }
         break;
       }
     }		
+    schedulePeriodicTask();
+}
+
+// Puts the next due queue item on air, with the messages that are about 
+// due as well as long as they fit. They are aggregated in place, in the 
+// frame of the first one, which is sent as often and as fast as the most 
+// demanding of them asks for. Taken items leave the queue before their 
+// headers are changed, their slots are only reused by the next enqueue,
+// after the stack has copied the frame.
+static void forwardNextFrame()
+{
+  AdvQueueItem* first = getNextInAdvertisementQueue(osal_GetSystemClock());
+  uint32 departure = first->advertisingTimeStamp + AGGREGATION_WINDOW;
+  uint8* frame = first->frame;
+  uint8 length = first->length;
+  uint8 transmissions = first->transmissions;
+  uint16 transmitInterval = first->transmitInterval;
+  forwardedMessages = 0;
+  addForwardedMessage(first->data);
+  removeFromAdvertisementQueue(first);
+  while(getAdvertisementQueueSize() > 0 && forwardedMessages < FORWARDED_MESSAGES_MAX) {
+    AdvQueueItem* next = getNextInAdvertisementQueue(departure);
+    uint8 aggregateLength;
+    if(next->advertisingTimeStamp > departure) {
+      break;
+    }
+    aggregateLength = aggregateMessage(&frame[MESH_MESSAGE_FLAG_OFFSET],
+                                       length, next->data, next->length);
+    if(aggregateLength == 0) {
+      break;
+    }
+    length = aggregateLength;
+    if(next->transmissions > transmissions) {
+      transmissions = next->transmissions;
+    }
+    if(next->transmitInterval < transmitInterval) {
+      transmitInterval = next->transmitInterval;
+    }
+    addForwardedMessage(next->data);
+    removeFromAdvertisementQueue(next);
+  }
+  forwardedMessagesLeft = forwardedMessages;
+  startForwarding(frame, length + MESH_MESSAGE_FLAG_OFFSET, transmissions, 
+                  transmitInterval);
+}
+
+// Notes a message going into the frame, from its header before aggregation
+static void addForwardedMessage(uint8* data)
+{
+  MessageHeader* header = (MessageHeader*) data;
+  forwardingSources[forwardedMessages] = header->source;
+  forwardingSequenceIDs[forwardedMessages] = header->sequenceID;
+  forwardedMessages++;
+}
+
+// TRUE if the message is in the frame on air and was the last one there 
+// that still needed its transmissions
+static uint8 cancelForwardedMessage(uint16 source, uint8 sequenceId)
+{
+  for(uint8 i = 0; i < forwardedMessages; i++) {
+    if(forwardingSources[i] == source && forwardingSequenceIDs[i] == sequenceId) {
+      forwardingSources[i] = AGGREGATE_SOURCE;
+      forwardedMessagesLeft--;
+      return forwardedMessagesLeft == 0;
+    }
+  }
+  return FALSE;
+}
+
+// Puts frame on air for transmissions advertising events, counted down by 
+// SBP_FORWARDING_DONE_EVENT
+static void startForwarding(uint8* frame, uint8 length, uint8 transmissions, 
+                            uint16 transmitInterval)
+{
+  uint8 dummy = TRUE;
+  
+  if(isAdvertisingPeriodically == TRUE) {
+    GAP_SetParamValue( TGAP_GEN_DISC_ADV_INT_MIN, transmitInterval );
+    GAP_SetParamValue( TGAP_GEN_DISC_ADV_INT_MAX, transmitInterval );
+  } else {
+    // Leave the connection its share of the radio
+    if(transmitInterval < DEFAULT_ADVERTISING_IN_CONNECTION_INTERVAL) {
+      transmitInterval = DEFAULT_ADVERTISING_IN_CONNECTION_INTERVAL;
+    }
+    GAP_SetParamValue( TGAP_CONN_ADV_INT_MIN, transmitInterval );
+    GAP_SetParamValue( TGAP_CONN_ADV_INT_MAX, transmitInterval );
+  }
+  GAPRole_SetParameter( GAPROLE_ADVERT_DATA, length, frame);
+  transmissionsLeft = transmissions;
+  // The interval is in units of 625 us, the period in ms
+  transmitPeriod = (uint16) (((uint32) transmitInterval * 5) / 8) + ADVERTISING_DELAY_MAX;
+  
+  // Start forwarding
+  GAPRole_SetParameter( GAPROLE_ADVERT_ENABLED, sizeof( uint8 ), &dummy );
+  isForwarding = TRUE;
+  // The first advertising event goes out as advertising is enabled
+  osal_start_timerEx(biscuit_TaskID, SBP_FORWARDING_DONE_EVENT, ADVERTISING_EVENT_TIME);
+}
+
+// Starts a discovery with the scan window and interval of the scheduler
+static void startObserving()
+{
+  startScan(&scanScheduler, osal_GetSystemClock(), getAdvertisementQueueSize());
+  GAP_SetParamValue( TGAP_GEN_DISC_SCAN_WIND, getScanWindow(&scanScheduler));
+  GAP_SetParamValue( TGAP_GEN_DISC_SCAN_INT, getScanInterval(&scanScheduler));
+  GAPObserverRole_StartDiscovery( DEFAULT_DISCOVERY_MODE,
+                                 DEFAULT_DISCOVERY_ACTIVE_SCAN,
+                                 DEFAULT_DISCOVERY_WHITE_LIST );
+}
+
+// Stops observing, and starts it again after OBSERVING_RESTART_DELAY
+static void pauseObserving()
+{
+  isObserving = FALSE;
+  GAPObserverRole_StopDiscovery();
+  stopScan(&scanScheduler, osal_GetSystemClock());
+  osal_start_timerEx(biscuit_TaskID, SBP_START_OBSERVING, OBSERVING_RESTART_DELAY);
+}
+
+ScanScheduler* Biscuit_GetScanScheduler( void )
+{
+  return &scanScheduler;
+}
+
+ScanFilter* Biscuit_GetScanFilter( void )
+{
+  return &scanFilter;
+}
+
+uint16 Biscuit_GetRejectedStatefulMessages( void )
+{
+  return rejectedStatefulMessages;
+}
+
+// Advertising has ended, send the next frame if one is waiting for it
+static void restartForwarding()
+{
+  if(isRestartingForwarding == TRUE) {
+    isRestartingForwarding = FALSE;
+    osal_set_event(biscuit_TaskID, SBP_START_FORWARDING_EVENT);
+  }
 }
 
 static void processQueue() {
@@ -965,11 +1208,15 @@ static void advertiseCallback(uint8* data, uint8 length, uint16 delay)
   uint8 queueSize = getAdvertisementQueueSize();
   uint32 currentTime = osal_GetSystemClock();
   
-  uint32 firstAdvertisingTime = getFirstInAdvertisementQueue()->advertisingTimeStamp;
+  uint32 firstAdvertisingTime = queueSize > 0 ? 
+    getFirstInAdvertisementQueue()->advertisingTimeStamp : 0;
   
-  enqueueAdvertisement(length, data, currentTime+delay);
+  if(enqueueAdvertisement(length, data, currentTime+delay) == FALSE) {
+    // Counted by the queue, see getAdvertisementQueueDrops()
+    return;
+  }
   
-  if (!isForwarding){
+  if(isRestartingForwarding == FALSE) {
     if(queueSize > 0 && getFirstInAdvertisementQueue()->advertisingTimeStamp < firstAdvertisingTime || queueSize == 0) {
       // new first element. Stop timer and start it with the new first advertising timestamp
       osal_stop_timerEx(biscuit_TaskID, SBP_START_FORWARDING_EVENT);
@@ -991,6 +1238,11 @@ static void cancelAdvertisementCallback(uint16 source, uint8 sequenceId)
          // Restart forwarding with new first in queye
          processQueue();
        }
+  } else if(transmissionsLeft > 0 && cancelForwardedMessage(source, sequenceId)) {
+    // None of the messages on air needs more transmissions
+    transmissionsLeft = 0;
+    osal_stop_timerEx(biscuit_TaskID, SBP_FORWARDING_DONE_EVENT);
+    osal_set_event(biscuit_TaskID, SBP_FORWARDING_DONE_EVENT);
   }
 }
 
@@ -33,6 +33,8 @@ extern "C"
 /*********************************************************************
  * INCLUDES
  */
+#include "scan_scheduler.h"
+#include "scan_filter.h"
 
 /*********************************************************************
  * CONSTANTS
@@ -68,6 +70,21 @@ extern void Biscuit_Init( uint8 task_id );
  */
 extern uint16 Biscuit_ProcessEvent( uint8 task_id, uint16 events );
 
+/*
+ * Scanning of the node, for its duty cycle and packet counters
+ */
+extern ScanScheduler* Biscuit_GetScanScheduler( void );
+
+/*
+ * Filter of the advertising reports, for the counts of rejected ones
+ */
+extern ScanFilter* Biscuit_GetScanFilter( void );
+
+/*
+ * Stateful messages from the client that were rejected, see PendingACKPolicy
+ */
+extern uint16 Biscuit_GetRejectedStatefulMessages( void );
+
 /*********************************************************************
 *********************************************************************/
 
@@ -1,53 +1,237 @@
 #include "mesh_transport_network_protocol.h"
-#define PROCESSED_MESSAGE_LENGTH 100
 #define REMOVE_PROCESSED_MESSAGE_AFTER 3000
-#define PENDING_ACK_MAX 5
+// How much longer records may be kept, so that expiring ones are cleared 
+// together instead of waking up for each
+#define PROCESSED_MESSAGE_TIMER_SLACK 500
+// Resend timeout until a round trip time has been measured
 #define PENDING_ACK_RESEND_TIMEOUT 5000
+#define RESEND_TIMEOUT_MIN 1000
+#define RESEND_TIMEOUT_MAX 30000
 #define RESEND_ACK_TIMES 3
-#define GROUP_MEMBERSHIP_MAX 40
+// How long an ACK waits for more messages from the same peer
+#define ACK_DELAY 100
+#define ACK_LENGTH 2
 #define HEADER_SIZE sizeof(MessageHeader)
 #define BACKOFF_INTERVAL 40
+// Adaptive relay suppression. Relays wait a random time within a listen 
+// period of RELAY_LISTEN_SLOTS backoff intervals, and are cancelled when 
+// enough copies are heard meanwhile. How many depends on the average number
+// of copies heard per message, and never grows with it: up to 
+// RELAY_SPARSE_COPIES a node only holds back when it hears more copies than
+// it usually can, above RELAY_DENSE_COPIES three copies suffice.
+#define RELAY_LISTEN_SLOTS 4
+#define RELAY_SPARSE_COPIES 4
+#define RELAY_DENSE_COPIES 8
+// The average is kept with 4 fractional bits
+#define RELAY_DENSITY_SHIFT 4
+#define RELAY_DENSITY_INITIAL (4 << RELAY_DENSITY_SHIFT)
+// Routes not confirmed by a message from the destination for this long are
+// forgotten
+#define ROUTE_TIMEOUT 30000
+// Extra hops given to routed unicasts, letting nodes one hop off the 
+// shortest path relay as well
+#ifndef ROUTE_TTL_SLACK
+#define ROUTE_TTL_SLACK 1
+#endif
 
+// Segments of a message not completed within this time are dropped
+#define REASSEMBLY_TIMEOUT 10000
+#define SEGMENT_HEADER_SIZE sizeof(SegmentHeader)
+
+#ifndef TEST_FLAG
 #include "print_uart.h"
 #include "OSAL.h"
+#else
+#include <string.h>
+__thread uint32 meshProtocolCopies = 0, meshProtocolCopiedBytes = 0;
+static void* osal_memcpy(void* destination, const void* source, unsigned int length)
+{
+    meshProtocolCopies++;
+    meshProtocolCopiedBytes += length;
+    return memcpy(destination, source, length);
+}
+#endif
+
 /* Private varialbles */
-static uint16 networkIdentifier; 
-static uint16 id;
-static advertiseDataFunction advertise;
-static cancelAdvertisementDataFunction cancelAdvertisement;
-static onMessageRecieved forwardMessageToApp;
-static getSystemTimestampFunction getSystemTimestamp;
-static randomFunction getRandom;
+// The instance behind the functions without the Ctx suffix
+static MeshContext defaultContext;
 
-static uint8 proccessedMessageStartIndex = 0, processedMessageEndIndex = 0;
-static ProccessedMessageInformation proccessedMessages[PROCESSED_MESSAGE_LENGTH];
-static uint8 countThreshold;
-static uint8 currentSequenceId = 0;
+/* Private functions */
+static void constructDataMessage(MeshContext* ctx, uint8* data, MessageType type, uint16 destination, uint8* message, uint8 length, uint8 ttl);
+static uint8 isMemberOfGroup(MeshContext* ctx, uint16 group);
+static uint8 isProccesedMessage(MeshContext* ctx, MessageHeader* messageHeader);
+static void insertProccesedMessage(MeshContext* ctx, MessageHeader* messageHeader);
+static uint16 getProcessedMessageHash(uint16 source, uint8 sequenceID);
+static uint16 getIndexedProcessedMessageHash(MeshContext* ctx, ProcessedMessageIndex position);
+static void insertProcessedMessageInIndex(MeshContext* ctx, uint16 hash, ProcessedMessageIndex position);
+static void removeProcessedMessageFromIndex(MeshContext* ctx, ProcessedMessageIndex position);
+#ifdef PROCESSED_MESSAGE_WINDOW
+static SourceSequenceWindow* getSourceSequenceWindow(MeshContext* ctx, uint16 source);
+static void removeSourceSequenceWindow(MeshContext* ctx, ProcessedMessageIndex position);
+#else
+static ProccessedMessageInformation* getProccesedMessage(MeshContext* ctx, MessageHeader* messageHeader);
+static void removeOldestProcessedMessage(MeshContext* ctx);
+#endif
+static PendingACK* allocatePendingACK(MeshContext* ctx, uint8 priority, 
+        PendingACKAdmission* admission);
+static void insertPendingACK(MeshContext* ctx, PendingACK* pendingACK, 
+        uint8* message, uint8 length);
+static uint8 getPendingACKBucket(MeshContext* ctx, uint16 destination, uint8 sequenceId);
+static void linkPendingACK(MeshContext* ctx, PendingACK* pendingACK);
+static void unlinkPendingACK(MeshContext* ctx, PendingACK* pendingACK);
+static PendingACK* findPendingACK(MeshContext* ctx, uint16 destination, uint8 sequenceId);
+static void removePendingACK(MeshContext* ctx, uint8* message, uint8 length);
+static void deferACK(MeshContext* ctx, MessageHeader* header);
+static DeferredACK* getDeferredACK(MeshContext* ctx, uint16 destination);
+static void constructACK(MeshContext* ctx, uint8* data, DeferredACK* ack);
+static void advertiseUnicast(MeshContext* ctx, uint8* data, uint8 length);
+static uint8 isMemberOfGroup(MeshContext* ctx, uint16 group);
+static uint8 findGroup(MeshContext* ctx, uint16 group, uint8* position);
+static void clearProcessedMessages(MeshContext* ctx);
+static void resendNonACKedMessage(MeshContext* ctx, PendingACK* pendingACK);
+static void updateRTT(MeshContext* ctx, uint32 rtt);
+static void startResendTimer(MeshContext* ctx, PendingACK* pendingACK);
+static void reportDelivery(MeshContext* ctx, PendingACK* pendingACK, uint8 delivered);
+static uint8 sendStatefulMessageHelper(MeshContext* ctx, uint16 destination, uint8* data, 
+        uint8* message, uint8 length, uint8 ttl);
+static void relayMessage(MeshContext* ctx, uint8* message, uint8 length);
+static void learnRoute(MeshContext* ctx, MessageHeader* header);
+static RouteInformation* getRoute(MeshContext* ctx, uint16 destination);
+static uint8 getUnicastTTL(MeshContext* ctx, uint16 destination);
+static uint8 isOnRoute(MeshContext* ctx, MessageHeader* header);
+static void processAggregate(MeshContext* ctx, uint8* aggregate, uint8 length);
+static void processSegment(MeshContext* ctx, uint8* message, uint8 length);
+static ReassemblyBuffer* getReassemblyBuffer(MeshContext* ctx, uint16 source, 
+        SegmentHeader* segment);
+static void sendSegment(MeshContext* ctx, uint16 destination, uint8* message, 
+        uint8 length, SegmentHeader segment, uint8 ttl);
+static void sendSegmentACK(MeshContext* ctx, ReassemblyBuffer* buffer);
+static void processSegmentACK(MeshContext* ctx, uint8* message, uint8 length);
+static void sendSegmentWindow(MeshContext* ctx);
+static void resendSegments(MeshContext* ctx, uint8 ttl);
+static void resendSegmentedMessage(MeshContext* ctx);
+static void endSegmentedTransfer(MeshContext* ctx, uint8 delivered);
+static void startTimer(MeshContext* ctx, MeshTimer* timer, MeshTimerType type, 
+        uint32 deadline);
+static void stopTimer(MeshContext* ctx, MeshTimer* timer);
+static void unlinkTimer(MeshTimer* timer);
+static void placeTimer(MeshContext* ctx, MeshTimer* timer);
+static void runTimers(MeshContext* ctx);
+static void cascadeTimers(MeshContext* ctx, uint8 level);
+static void runTimer(MeshContext* ctx, MeshTimer* timer);
+static uint16 getBackoffTime(MeshContext* ctx);
+static uint8 getRelayThreshold(MeshContext* ctx);
+static void updateRelayDensity(MeshContext* ctx, uint8 timesReceived);
 
-static PendingACK pendingACKS[PENDING_ACK_MAX];
-static uint8 lastPendingACKIndex = 0;
-static uint8 pendingACKMessages[PENDING_ACK_MAX][23];
+void initializeMeshConnectionProtocol(uint16 networkId, 
+	uint16 deviceIdentifier, 
+	advertiseDataFunction dataFunction, 
+	onMessageRecieved messageCallback,
+        getSystemTimestampFunction timestampFunction,
+        randomFunction randFun,
+    cancelAdvertisementDataFunction cancelDataFunction) 
+{
+    initializeMeshConnectionProtocolCtx(&defaultContext, networkId, 
+            deviceIdentifier, dataFunction, messageCallback, 
+            timestampFunction, randFun, cancelDataFunction);
+}
 
-static uint16 groupMemberships[GROUP_MEMBERSHIP_MAX];
-static uint8 groupMemberIndex = 0;
+void processIncomingMessage(uint8* message, uint8 length) 
+{
+    processIncomingMessageCtx(&defaultContext, message, length);
+}
 
+void broadcastMessage(uint8* message, uint8 length)
+{
+    broadcastMessageCtx(&defaultContext, message, length);
+}
 
+void broadcastGroupMessage(uint16 groupDestination, uint8* message, uint8 length)
+{
+    broadcastGroupMessageCtx(&defaultContext, groupDestination, message, length);
+}
 
-/* Private functions */
-static void constructDataMessage(uint8* data, MessageType type, uint16 destination, uint8* message, uint8 length);
-static uint8 isMemberOfGroup(uint16 group);
-static ProccessedMessageInformation* getProccesedMessage(MessageHeader* messageHeader);
-static void insertProccesedMessage(MessageHeader* messageHeader);
-static void insertPendingACK(uint8* message);
-static void removePendingACK(uint8* message);
-static uint8 isMemberOfGroup(uint16 group);
-static void clearProcessedMessages();
-static void resendNonACKedMessages();
-static void sendStatefulMessageHelper(uint16 destination, uint8* data, 
-        uint8* message, uint8 length);
-static uint16 getBackoffTime();
+PendingACKAdmission sendStatefulMessage(uint16 destination, uint8* message, 
+        uint8 length)
+{
+    return sendStatefulMessageCtx(&defaultContext, destination, message, length);
+}
 
-void initializeMeshConnectionProtocol(uint16 networkId, 
+PendingACKAdmission sendPrioritizedStatefulMessage(uint16 destination, 
+        uint8* message, uint8 length, uint8 priority, uint8* sequenceID)
+{
+    return sendPrioritizedStatefulMessageCtx(&defaultContext, destination, 
+            message, length, priority, sequenceID);
+}
+
+void sendStatelessMessage(uint16 destination, uint8* message, uint8 length)
+{
+    sendStatelessMessageCtx(&defaultContext, destination, message, length);
+}
+
+uint8 sendSegmentedMessage(uint16 destination, uint8* message, uint8 length, 
+        uint8 acknowledged)
+{
+    return sendSegmentedMessageCtx(&defaultContext, destination, message, 
+            length, acknowledged);
+}
+
+void destructMeshConnectionProtocol()
+{
+    destructMeshConnectionProtocolCtx(&defaultContext);
+}
+
+uint8 joinGroup(uint16 groupId) 
+{
+    return joinGroupCtx(&defaultContext, groupId);
+}
+
+uint8 leaveGroup(uint16 groupId)
+{
+    return leaveGroupCtx(&defaultContext, groupId);
+}
+
+void periodicTask() 
+{
+    periodicTaskCtx(&defaultContext);
+}
+
+uint8 getNextDeadline(uint32* deadline)
+{
+    return getNextDeadlineCtx(&defaultContext, deadline);
+}
+
+void setRelaySuppression(RelaySuppressionMode mode, uint8 countThreshold)
+{
+    setRelaySuppressionCtx(&defaultContext, mode, countThreshold);
+}
+
+void setMessageTTL(uint8 ttl)
+{
+    setMessageTTLCtx(&defaultContext, ttl);
+}
+
+void setUnicastRouting(uint8 enabled)
+{
+    setUnicastRoutingCtx(&defaultContext, enabled);
+}
+
+void setDeliveryReport(onDeliveryReport callback)
+{
+    setDeliveryReportCtx(&defaultContext, callback);
+}
+
+void setPendingACKBuffer(PendingACK* buffer, uint8 capacity)
+{
+    setPendingACKBufferCtx(&defaultContext, buffer, capacity);
+}
+
+void setPendingACKPolicy(PendingACKPolicy policy)
+{
+    setPendingACKPolicyCtx(&defaultContext, policy);
+}
+
+void initializeMeshConnectionProtocolCtx(MeshContext* ctx, uint16 networkId, 
 	uint16 deviceIdentifier, 
 	advertiseDataFunction dataFunction, 
 	onMessageRecieved messageCallback,
@@ -56,44 +240,97 @@ void initializeMeshConnectionProtocol(uint16 networkId,
     cancelAdvertisementDataFunction cancelDataFunction) 
 {
   
-    networkIdentifier = networkId; 
-	id = deviceIdentifier;
-	advertise = dataFunction;
-	forwardMessageToApp = messageCallback;
-    getSystemTimestamp = timestampFunction;
-    cancelAdvertisement = cancelDataFunction;
-    getRandom = randFun;
+    ctx->networkIdentifier = networkId; 
+	ctx->id = deviceIdentifier;
+	ctx->advertise = dataFunction;
+	ctx->forwardMessageToApp = messageCallback;
+    ctx->getSystemTimestamp = timestampFunction;
+    ctx->cancelAdvertisement = cancelDataFunction;
+    ctx->getRandom = randFun;
     
-    countThreshold = 4; // TODO : As input parameter
+    ctx->countThreshold = 4;
+#ifdef ADAPTIVE_RELAY_SUPPRESSION
+    ctx->relaySuppression = RELAY_SUPPRESSION_ADAPTIVE;
+#else
+    ctx->relaySuppression = RELAY_SUPPRESSION_FIXED;
+#endif
+    ctx->relayDensity = RELAY_DENSITY_INITIAL;
+    ctx->backoffInterval = BACKOFF_INTERVAL;
     
-    lastPendingACKIndex = 0;
-    groupMemberIndex = 0;
-    proccessedMessageStartIndex = 0;
-    processedMessageEndIndex = 0;
-    for(uint8 i = 0; i < PENDING_ACK_MAX; i++) 
+    // No timer is running yet
+    for(uint8 level = 0; level < TIMER_WHEEL_LEVELS; level++) 
     {
-        pendingACKS[i].destination = 0;
+        for(uint8 i = 0; i < TIMER_WHEEL_SLOTS; i++) 
+        {
+            ctx->timerSlots[level][i] = NULL;
+        }
     }
+    ctx->runningTimers = 0;
+    ctx->timerTick = ctx->getSystemTimestamp() >> TIMER_TICK_SHIFT;
+    ctx->processedMessageTimer.previous = NULL;
+    ctx->segmentedTransfer.timer.previous = NULL;
+    
+    ctx->currentSequenceId = 0;
+    ctx->messageTTL = MESSAGE_TTL_DEFAULT;
+    ctx->unicastRouting = TRUE;
+    for(uint8 i = 0; i < DEFERRED_ACK_MAX; i++) 
+    {
+        ctx->deferredACKs[i].destination = 0;
+    }
+    ctx->currentTransferId = 0;
+    ctx->segmentedTransfer.destination = 0;
+    for(uint8 i = 0; i < REASSEMBLY_BUFFER_MAX; i++) 
+    {
+        ctx->reassemblyBuffers[i].source = 0;
+        ctx->reassemblyBuffers[i].timer.previous = NULL;
+    }
+    for(uint8 i = 0; i < ROUTE_TABLE_MAX; i++) 
+    {
+        ctx->routes[i].destination = 0;
+    }
+    ctx->pendingACKPolicy = PENDING_ACK_EVICT_OLDEST;
+    ctx->smoothedRTT = 0;
+    ctx->rttVariation = 0;
+    ctx->resendTimeout = PENDING_ACK_RESEND_TIMEOUT;
+    ctx->deliveryReport = NULL;
+    ctx->groupMemberIndex = 0;
+#ifdef PROCESSED_MESSAGE_WINDOW
+    ctx->processedSourceCount = 0;
+#else
+    ctx->proccessedMessageStartIndex = 0;
+    ctx->processedMessageEndIndex = 0;
+#endif
+    for(uint16 i = 0; i < PROCESSED_MESSAGE_HASH_SIZE; i++) 
+    {
+        ctx->processedMessageIndex[i] = PROCESSED_MESSAGE_EMPTY;
+    }
+    ctx->pendingACKCapacity = 0;
+    setPendingACKBufferCtx(ctx, ctx->defaultPendingACKs, PENDING_ACK_MAX);
 }
 
-void processIncomingMessage(uint8* message, uint8 length) 
+void processIncomingMessageCtx(MeshContext* ctx, uint8* message, uint8 length) 
 {
-    uint8 newMessage [10]= {0};
     // If invalid message
-    if(length < 6) return;
+    if(length < BROADCAST_HEADER_SIZE) return;
 
     MessageHeader* header = (MessageHeader*) message;
     // Check if the message is addressed to this network
-    if(networkIdentifier != header->networkIdentifier) 
+    if(ctx->networkIdentifier != header->networkIdentifier) 
     return;
+    
+    if(header->source == AGGREGATE_SOURCE) {
+        processAggregate(ctx, message, length);
+        return;
+    }
+    // Only broadcasts go without a destination and initial TTL
+    if(header->type != BROADCAST && length < HEADER_SIZE) {
+        return;
+    }
 
-    ProccessedMessageInformation* processedMessage = getProccesedMessage(header);    
-    if(processedMessage != NULL) { 
-        processedMessage->timesReceived++;
-        if(processedMessage->timesReceived >= countThreshold) {
-            // Cancel the advertising if still in queue
-            cancelAdvertisement(processedMessage->source, processedMessage->sequenceID);
-        }
+    // Every copy counts, the first one to arrive might not have taken the
+    // shortest path
+    learnRoute(ctx, header);
+    if(isProccesedMessage(ctx, header)) { 
         return;
     }
 
@@ -101,321 +338,1450 @@ void processIncomingMessage(uint8* message, uint8 length)
     if(header->type == BROADCAST) 
     {
       // Forward message to the rest of the network
-      advertise(message, length, getBackoffTime());
+      relayMessage(ctx, message, length);
       // Forward to application
-      forwardMessageToApp(header->source, &message[6], length - 6);
+      ctx->forwardMessageToApp(header->source, &message[BROADCAST_HEADER_SIZE], 
+              length - BROADCAST_HEADER_SIZE);
     } 
-    else if (header->type == GROUP_BROADCAST && isMemberOfGroup(header->destination)) 
+    else if (header->type == GROUP_BROADCAST && isMemberOfGroup(ctx, header->destination)) 
     {
-      advertise(message, length, getBackoffTime());
-      forwardMessageToApp(header->source, &message[HEADER_SIZE], length - HEADER_SIZE);
+      relayMessage(ctx, message, length);
+      ctx->forwardMessageToApp(header->source, &message[HEADER_SIZE], length - HEADER_SIZE);
     } 
-    else if(header->destination == id) 
+    else if(header->destination == ctx->id) 
     {
             switch (header->type) 
             {
                     case STATELESS_MESSAGE:
-                            forwardMessageToApp(header->source, &message[HEADER_SIZE], length - HEADER_SIZE);
+                            ctx->forwardMessageToApp(header->source, &message[HEADER_SIZE], length - HEADER_SIZE);
                             break;
                     case STATEFUL_MESSAGE:
-                            forwardMessageToApp(header->source, &message[HEADER_SIZE], length - HEADER_SIZE);
-                            // Send ACK
-                            uint8 sequenceIDToACK = header->sequenceID;
-                            constructDataMessage(newMessage, STATEFUL_MESSAGE_ACK, header->source, &sequenceIDToACK, 1);
-                            advertise(newMessage, HEADER_SIZE + 1, 0);
+                            ctx->forwardMessageToApp(header->source, &message[HEADER_SIZE], length - HEADER_SIZE);
+                            deferACK(ctx, header);
                             break;
                     case STATEFUL_MESSAGE_ACK:
-                            removePendingACK(message);
+                            removePendingACK(ctx, message, length);
+                            break;
+                    case SEGMENTED_MESSAGE:
+                            processSegment(ctx, message, length);
+                            break;
+                    case SEGMENT_ACK:
+                            processSegmentACK(ctx, message, length);
                             break;
         default:
             // Invalid message type
             return;
             }
-    } else{
+    } else if(isOnRoute(ctx, header)) {
       // Forward message to the rest of the network
-      advertise(message, length, getBackoffTime()); 
+      relayMessage(ctx, message, length);
     }
     
     // Save message as processed
-    insertProccesedMessage(header);
+    insertProccesedMessage(ctx, header);
 }
 
-void broadcastMessage(uint8* message, uint8 length)
+void broadcastMessageCtx(MeshContext* ctx, uint8* message, uint8 length)
 {
     uint8 data[32];
     MessageHeader* header = (MessageHeader*) data;
     
-    header->networkIdentifier = networkIdentifier;
+    header->networkIdentifier = ctx->networkIdentifier;
     header->type = BROADCAST;
-    header->length = length;
-    header->sequenceID = currentSequenceId++;
-    header->source = id;
+    header->ttl = ctx->messageTTL;
+    header->initialTTL = ctx->messageTTL;
+    header->sequenceID = ctx->currentSequenceId++;
+    header->source = ctx->id;
     
-    for(char i = 6; i < 6 + length; i++) {
-        data[i] = message[i-6];
-    }
+    osal_memcpy(&data[BROADCAST_HEADER_SIZE], message, length);
     
-    advertise(data, length + 6, 0);
-    forwardMessageToApp(header->source, message, length);
+    ctx->advertise(data, length + BROADCAST_HEADER_SIZE, 0);
+    ctx->forwardMessageToApp(header->source, message, length);
 }
 
-void broadcastGroupMessage(uint16 groupDestination, uint8* message, uint8 length)
+void broadcastGroupMessageCtx(MeshContext* ctx, uint16 groupDestination, uint8* message, uint8 length)
 {
     uint8 data[32];
 	
-    constructDataMessage(data, GROUP_BROADCAST, groupDestination, message, length);
-    advertise(data, length + HEADER_SIZE, 0);
-	if(isMemberOfGroup(groupDestination)){
-		forwardMessageToApp(id, message, length);
+    constructDataMessage(ctx, data, GROUP_BROADCAST, groupDestination, message, length, ctx->messageTTL);
+    ctx->advertise(data, length + HEADER_SIZE, 0);
+	if(isMemberOfGroup(ctx, groupDestination)){
+		ctx->forwardMessageToApp(ctx->id, message, length);
 	}
 }
 
-void sendStatefulMessage(uint16 destination, uint8* message, uint8 length)
+PendingACKAdmission sendStatefulMessageCtx(MeshContext* ctx, 
+        uint16 destination, uint8* message, uint8 length)
+{
+    return sendPrioritizedStatefulMessageCtx(ctx, destination, message, 
+            length, 0, NULL);
+}
+
+PendingACKAdmission sendPrioritizedStatefulMessageCtx(MeshContext* ctx, 
+        uint16 destination, uint8* message, uint8 length, uint8 priority, 
+        uint8* sequenceID)
 {
     uint8 data[32];
-    if(destination==id){
-		forwardMessageToApp(id, message, length);
-		return;
+    PendingACKAdmission admission = PENDING_ACK_ADMITTED;
+    if(destination==ctx->id){
+		ctx->forwardMessageToApp(ctx->id, message, length);
+        if(sequenceID != NULL) {
+            *sequenceID = ctx->currentSequenceId;
+        }
+        if(ctx->deliveryReport != NULL) {
+            ctx->deliveryReport(destination, ctx->currentSequenceId, TRUE);
+        }
+		return admission;
 	}
-	sendStatefulMessageHelper(destination, data, message, length);
-    // Beware destination will be not correct when casting from raw data to 
-    // header, but id doesn't matter in this case
-    insertPendingACK(data);
-	
+    PendingACK* pendingACK = allocatePendingACK(ctx, priority, &admission);
+    if(pendingACK == NULL) {
+        return PENDING_ACK_REJECTED;
+    }
+	uint8 sentSequenceID = sendStatefulMessageHelper(ctx, destination, data, 
+            message, length, getUnicastTTL(ctx, destination));
+    pendingACK->priority = priority;
+    insertPendingACK(ctx, pendingACK, data, length);
+    if(sequenceID != NULL) {
+        *sequenceID = sentSequenceID;
+    }
+    return admission;
 }
 
-void sendStatelessMessage(uint16 destination, uint8* message, uint8 length)
+void sendStatelessMessageCtx(MeshContext* ctx, uint16 destination, uint8* message, uint8 length)
 {
     uint8 data[32];
-	if(destination==id){
-		forwardMessageToApp(id, message, length);
+	if(destination==ctx->id){
+		ctx->forwardMessageToApp(ctx->id, message, length);
 		return;
 	}
-    constructDataMessage(data, STATELESS_MESSAGE, destination, message, length);
-    advertise(data, length + HEADER_SIZE, 0);
+    constructDataMessage(ctx, data, STATELESS_MESSAGE, destination, message, length, 
+            getUnicastTTL(ctx, destination));
+    advertiseUnicast(ctx, data, length + HEADER_SIZE);
 }
 
-void destructMeshConnectionProtocol()
+uint8 sendSegmentedMessageCtx(MeshContext* ctx, uint16 destination, 
+        uint8* message, uint8 length, uint8 acknowledged)
 {
+    SegmentedTransfer* transfer = &ctx->segmentedTransfer;
+    if(length > SEGMENTED_MESSAGE_LENGTH_MAX || transfer->destination != 0) {
+        return FALSE;
+    }
+    if(destination == ctx->id) {
+        ctx->forwardMessageToApp(ctx->id, message, length);
+        return TRUE;
+    }
+    
+    // Kept for the later windows and the resends
+    uint8 lastSegmentIndex = length == 0 ? 0 : (length - 1) / SEGMENT_PAYLOAD_LENGTH;
+    transfer->destination = destination;
+    transfer->transferID = ctx->currentTransferId++;
+    transfer->length = length;
+    transfer->acknowledged = acknowledged ? 1 : 0;
+    transfer->ttl = getUnicastTTL(ctx, destination);
+    transfer->unsentSegments = (uint16) ((1 << (lastSegmentIndex + 1)) - 1);
+    transfer->acknowledgedSegments = 0;
+    transfer->resentCount = 0;
+    osal_memcpy(transfer->data, message, length);
+    sendSegmentWindow(ctx);
+    return TRUE;
 }
 
-uint8 joinGroup(uint16 groupId) 
+uint8 aggregateMessage(uint8* aggregate, uint8 aggregateLength, 
+        uint8* message, uint8 length)
 {
-    if(groupMemberIndex < GROUP_MEMBERSHIP_MAX) 
-    {
-        groupMemberships[groupMemberIndex++] = groupId;
-        return TRUE;
+    MessageHeader* header = (MessageHeader*) aggregate;
+    uint8 newLength = aggregateLength + 1 + length - sizeof(uint16);
+    if(header->source != AGGREGATE_SOURCE) {
+        newLength += AGGREGATE_HEADER_SIZE + 1 - sizeof(uint16);
+    }
+    if(length < BROADCAST_HEADER_SIZE || newLength > MESSAGE_LENGTH_MAX 
+        || header->networkIdentifier != ((MessageHeader*) message)->networkIdentifier) {
+        return 0;
     }
     
-    return FALSE;
+    if(header->source != AGGREGATE_SOURCE) 
+    {
+        // Make room for the aggregate header and the length of the first 
+        // message, which keeps all but its network identifier
+        for(uint8 i = aggregateLength; i > sizeof(uint16); i--) {
+            aggregate[i + 2] = aggregate[i - 1];
+        }
+        aggregate[AGGREGATE_HEADER_SIZE] = aggregateLength - sizeof(uint16);
+        header->source = AGGREGATE_SOURCE;
+        aggregateLength += AGGREGATE_HEADER_SIZE + 1 - sizeof(uint16);
+    }
+    aggregate[aggregateLength] = length - sizeof(uint16);
+    osal_memcpy(&aggregate[aggregateLength + 1], &message[sizeof(uint16)], 
+            length - sizeof(uint16));
+    return newLength;
 }
 
-uint8 leaveGroup(uint16 groupId)
+// Processes every message of the aggregate as if received on its own
+static void processAggregate(MeshContext* ctx, uint8* aggregate, uint8 length)
 {
-	for(uint8 i = 0; i < groupMemberIndex; i++){
-		if(groupMemberships[i] == groupId){
-			for(uint8 j=i ; j < groupMemberIndex; j++){
-				groupMemberships[j] = groupMemberships[j+1];
-			}
-			groupMemberIndex--;
-			return TRUE;
-		}
-	}
-	return FALSE;
+    uint8 message[MESSAGE_LENGTH_MAX];
+    uint8 i = AGGREGATE_HEADER_SIZE;
+    while(i < length) 
+    {
+        uint8 messageLength = aggregate[i] + sizeof(uint16);
+        if(messageLength < BROADCAST_HEADER_SIZE || i + 1 + aggregate[i] > length) {
+            return;
+        }
+        osal_memcpy(message, aggregate, sizeof(uint16));
+        osal_memcpy(&message[sizeof(uint16)], &aggregate[i + 1], aggregate[i]);
+        // Aggregates are not nested
+        if(((MessageHeader*) message)->source != AGGREGATE_SOURCE) {
+            processIncomingMessageCtx(ctx, message, messageLength);
+        }
+        i += 1 + aggregate[i];
+    }
 }
 
-void periodicTask() 
+void destructMeshConnectionProtocolCtx(MeshContext* ctx)
 {
-    // Clear processed messages which are older than 
-    // now + REMOVE_PROCESSED_MESSAGE_AFTER
-    clearProcessedMessages();
-    
-    // Go through and resend stateful messages which haven't been ACK'ed
-    resendNonACKedMessages();
+    // Nothing to release, all state lives in the context itself
+    (void) ctx;
 }
 
-ProccessedMessageInformation* getProccesedMessage(MessageHeader* messageHeader) 
+uint8 joinGroupCtx(MeshContext* ctx, uint16 groupId) 
 {
-    uint8 searchTo = processedMessageEndIndex + 1;
-    if(proccessedMessageStartIndex > processedMessageEndIndex) 
+    uint8 position;
+    if(findGroup(ctx, groupId, &position) 
+        || ctx->groupMemberIndex == GROUP_MEMBERSHIP_MAX) 
     {
-        searchTo = PROCESSED_MESSAGE_LENGTH;
+        return FALSE;
+    }
+    
+    // Keep the memberships sorted
+    for(uint8 i = ctx->groupMemberIndex; i > position; i--) {
+        ctx->groupMemberships[i] = ctx->groupMemberships[i-1];
+    }
+    ctx->groupMemberships[position] = groupId;
+    ctx->groupMemberIndex++;
+    return TRUE;
+}
+
+uint8 leaveGroupCtx(MeshContext* ctx, uint16 groupId)
+{
+    uint8 position;
+    if(!findGroup(ctx, groupId, &position)) {
+        return FALSE;
     }
     
-    for(uint8 i = proccessedMessageStartIndex; i < searchTo; i++) 
+    ctx->groupMemberIndex--;
+    for(uint8 i = position; i < ctx->groupMemberIndex; i++) {
+        ctx->groupMemberships[i] = ctx->groupMemberships[i+1];
+    }
+    return TRUE;
+}
+
+void setRelaySuppressionCtx(MeshContext* ctx, RelaySuppressionMode mode, 
+        uint8 countThreshold)
+{
+    ctx->relaySuppression = mode;
+    ctx->countThreshold = countThreshold;
+    ctx->relayDensity = RELAY_DENSITY_INITIAL;
+}
+
+void setMessageTTLCtx(MeshContext* ctx, uint8 ttl)
+{
+    if(ttl == 0) {
+        ttl = 1;
+    } else if(ttl > MESSAGE_TTL_MAX) {
+        ttl = MESSAGE_TTL_MAX;
+    }
+    ctx->messageTTL = ttl;
+}
+
+void setUnicastRoutingCtx(MeshContext* ctx, uint8 enabled)
+{
+    ctx->unicastRouting = enabled;
+}
+
+void setDeliveryReportCtx(MeshContext* ctx, onDeliveryReport callback)
+{
+    ctx->deliveryReport = callback;
+}
+
+void setPendingACKBufferCtx(MeshContext* ctx, PendingACK* buffer, uint8 capacity)
+{
+    if(capacity > PENDING_ACK_CAPACITY_MAX) {
+        capacity = PENDING_ACK_CAPACITY_MAX;
+    }
+    for(uint8 i = 0; i < ctx->pendingACKCapacity; i++) 
     {
-        if(messageHeader->source == proccessedMessages[i].source
-            && messageHeader->sequenceID == proccessedMessages[i].sequenceID) {
-            return &proccessedMessages[i];
+        stopTimer(ctx, &ctx->pendingACKS[i].timer);
+    }
+    ctx->pendingACKS = buffer;
+    ctx->pendingACKCapacity = capacity;
+    // All entries free and all buckets empty
+    ctx->freePendingACK = capacity > 0 ? 0 : PENDING_ACK_NONE;
+    for(uint8 i = 0; i < capacity; i++) 
+    {
+        buffer[i].destination = 0;
+        buffer[i].timer.previous = NULL;
+        buffer[i].bucket = PENDING_ACK_NONE;
+        buffer[i].next = i + 1 < capacity ? i + 1 : PENDING_ACK_NONE;
+    }
+}
+
+void setPendingACKPolicyCtx(MeshContext* ctx, PendingACKPolicy policy)
+{
+    ctx->pendingACKPolicy = policy;
+}
+
+void periodicTaskCtx(MeshContext* ctx) 
+{
+    runTimers(ctx);
+}
+
+uint8 getNextDeadlineCtx(MeshContext* ctx, uint32* deadline)
+{
+    if(ctx->runningTimers == 0) {
+        return FALSE;
+    }
+    uint8 found = FALSE;
+    for(uint8 level = 0; level < TIMER_WHEEL_LEVELS; level++) 
+    {
+        // The first slot to be run holds the earliest timers of the level.
+        // That is the current one on the first level, and the next one on 
+        // the others, whose current slot has been cascaded already.
+        uint32 position = ctx->timerTick >> (TIMER_WHEEL_SLOT_BITS * level);
+        for(uint8 i = level == 0 ? 0 : 1; i <= TIMER_WHEEL_SLOTS; i++) 
+        {
+            MeshTimer* timer = ctx->timerSlots[level][(position + i) & (TIMER_WHEEL_SLOTS - 1)];
+            if(timer == NULL) {
+                continue;
+            }
+            for(; timer != NULL; timer = timer->next) 
+            {
+                if(!found || (int32) (timer->deadline - *deadline) < 0) {
+                    *deadline = timer->deadline;
+                    found = TRUE;
+                }
+            }
+            break;
+        }
+    }
+    return found;
+}
+
+#ifdef PROCESSED_MESSAGE_WINDOW
+static uint8 isProccesedMessage(MeshContext* ctx, MessageHeader* messageHeader)
+{
+    SourceSequenceWindow* sourceWindow = getSourceSequenceWindow(ctx, messageHeader->source);
+    if(sourceWindow == NULL) {
+        return FALSE;
+    }
+    
+    // How far behind the highest sequence ID this message is, modulo 256
+    uint8 age = sourceWindow->highestSequenceID - messageHeader->sequenceID;
+    if(age == 0) {
+        sourceWindow->timesReceived++;
+        if(sourceWindow->timesReceived >= getRelayThreshold(ctx)) {
+            // Cancel the advertising if still in queue
+            ctx->cancelAdvertisement(messageHeader->source, messageHeader->sequenceID);
+        }
+        return TRUE;
+    } else if(age >= 128) {
+        // Newer than anything seen from the source
+        return FALSE;
+    } else if(age < PROCESSED_SOURCE_WINDOW_SIZE) {
+        return (sourceWindow->window & ((uint32)1 << age)) != 0;
+    }
+    
+    // Older than the window, treat it as already processed
+    return TRUE;
+}
+
+void insertProccesedMessage(MeshContext* ctx, MessageHeader* messageHeader) 
+{
+    SourceSequenceWindow* sourceWindow = getSourceSequenceWindow(ctx, messageHeader->source);
+    
+    if(sourceWindow == NULL) {
+        if(ctx->processedSourceCount == PROCESSED_SOURCE_MAX) {
+            // Make room by forgetting the source heard from least recently
+            ProcessedMessageIndex oldest = 0;
+            for(ProcessedMessageIndex i = 1; i < ctx->processedSourceCount; i++) {
+                if(ctx->processedSources[i].time < ctx->processedSources[oldest].time) {
+                    oldest = i;
+                }
+            }
+            removeSourceSequenceWindow(ctx, oldest);
+        }
+        
+        sourceWindow = &ctx->processedSources[ctx->processedSourceCount];
+        sourceWindow->source = messageHeader->source;
+        sourceWindow->highestSequenceID = messageHeader->sequenceID;
+        sourceWindow->timesReceived = 1;
+        sourceWindow->window = 1;
+        insertProcessedMessageInIndex(ctx, 
+                getProcessedMessageHash(messageHeader->source, 0), 
+                ctx->processedSourceCount);
+        ctx->processedSourceCount++;
+    } else {
+        uint8 shift = messageHeader->sequenceID - sourceWindow->highestSequenceID;
+        if(shift < 128) {
+            // Slide the window up to the new highest sequence ID
+            sourceWindow->window = shift < PROCESSED_SOURCE_WINDOW_SIZE ? 
+                sourceWindow->window << shift : 0;
+            sourceWindow->window |= 1;
+            sourceWindow->highestSequenceID = messageHeader->sequenceID;
+            updateRelayDensity(ctx, sourceWindow->timesReceived);
+            sourceWindow->timesReceived = 1;
+        } else if((uint8)(0 - shift) < PROCESSED_SOURCE_WINDOW_SIZE) {
+            sourceWindow->window |= (uint32)1 << (uint8)(0 - shift);
         }
     }
     
-    if(searchTo == PROCESSED_MESSAGE_LENGTH) 
+    sourceWindow->time = ctx->getSystemTimestamp();
+    if(ctx->processedMessageTimer.previous == NULL) {
+        startTimer(ctx, &ctx->processedMessageTimer, TIMER_PROCESSED_MESSAGES, 
+                sourceWindow->time + REMOVE_PROCESSED_MESSAGE_AFTER 
+                    + PROCESSED_MESSAGE_TIMER_SLACK + 1);
+    }
+}
+
+static SourceSequenceWindow* getSourceSequenceWindow(MeshContext* ctx, uint16 source)
+{
+    uint16 hash = getProcessedMessageHash(source, 0);
+    
+    // Linear probing, the first free slot ends the search
+    while(ctx->processedMessageIndex[hash] != PROCESSED_MESSAGE_EMPTY) 
     {
-        for(uint8 i = 0; i < processedMessageEndIndex; i++) 
+        SourceSequenceWindow* sourceWindow = 
+                &ctx->processedSources[ctx->processedMessageIndex[hash]];
+        if(sourceWindow->source == source) {
+            return sourceWindow;
+        }
+        hash = (hash + 1) & PROCESSED_MESSAGE_HASH_MASK;
+    }
+    
+    return NULL;
+}
+
+static void removeSourceSequenceWindow(MeshContext* ctx, ProcessedMessageIndex position)
+{
+    ProcessedMessageIndex last = ctx->processedSourceCount - 1;
+    removeProcessedMessageFromIndex(ctx, position);
+    
+    if(position != last) {
+        // Keep the records packed by moving the last one into the gap
+        uint16 hash = getIndexedProcessedMessageHash(ctx, last);
+        while(ctx->processedMessageIndex[hash] != last) 
         {
-            if(messageHeader->source == proccessedMessages[i].source
-                && messageHeader->sequenceID == proccessedMessages[i].sequenceID) {
-                return &proccessedMessages[i];
-            }
+            hash = (hash + 1) & PROCESSED_MESSAGE_HASH_MASK;
         }
+        ctx->processedMessageIndex[hash] = position;
+        ctx->processedSources[position] = ctx->processedSources[last];
+    }
+    ctx->processedSourceCount--;
+}
+
+static uint16 getIndexedProcessedMessageHash(MeshContext* ctx, ProcessedMessageIndex position)
+{
+    return getProcessedMessageHash(ctx->processedSources[position].source, 0);
+}
+#else
+static uint8 isProccesedMessage(MeshContext* ctx, MessageHeader* messageHeader)
+{
+    ProccessedMessageInformation* processedMessage = getProccesedMessage(ctx, messageHeader);    
+    if(processedMessage == NULL) {
+        return FALSE;
+    }
+    
+    processedMessage->timesReceived++;
+    if(processedMessage->timesReceived >= getRelayThreshold(ctx)) {
+        // Cancel the advertising if still in queue
+        ctx->cancelAdvertisement(processedMessage->source, processedMessage->sequenceID);
+    }
+    return TRUE;
+}
+
+ProccessedMessageInformation* getProccesedMessage(MeshContext* ctx, MessageHeader* messageHeader) 
+{
+    uint16 hash = getProcessedMessageHash(messageHeader->source, 
+            messageHeader->sequenceID);
+    
+    // Linear probing, the first free slot ends the search
+    while(ctx->processedMessageIndex[hash] != PROCESSED_MESSAGE_EMPTY) 
+    {
+        ProccessedMessageInformation* entry = 
+                &ctx->proccessedMessages[ctx->processedMessageIndex[hash]];
+        if(messageHeader->source == entry->source
+            && messageHeader->sequenceID == entry->sequenceID) {
+            return entry;
+        }
+        hash = (hash + 1) & PROCESSED_MESSAGE_HASH_MASK;
     }
     
     return NULL;
 }
 
-void insertProccesedMessage(MessageHeader* messageHeader) 
+void insertProccesedMessage(MeshContext* ctx, MessageHeader* messageHeader) 
 {   
-    proccessedMessages[processedMessageEndIndex].sequenceID = messageHeader->sequenceID;
-    proccessedMessages[processedMessageEndIndex].source = messageHeader->source;
-    proccessedMessages[processedMessageEndIndex].time = getSystemTimestamp();
-    proccessedMessages[processedMessageEndIndex].timesReceived = 1;
+    ProcessedMessageIndex position = ctx->processedMessageEndIndex;
     
-    processedMessageEndIndex++;
+    ctx->processedMessageEndIndex++;
     
-    if(processedMessageEndIndex == PROCESSED_MESSAGE_LENGTH) {
+    if(ctx->processedMessageEndIndex == PROCESSED_MESSAGE_LENGTH) {
       // If the end index is the length of the array, the next free index
         // will be 0, since we then overwrite the oldest values
-      processedMessageEndIndex = 0;
+      ctx->processedMessageEndIndex = 0;
+    }
+    
+    if(ctx->processedMessageEndIndex == ctx->proccessedMessageStartIndex) {
+        removeOldestProcessedMessage(ctx);
     }
     
-    if(processedMessageEndIndex == proccessedMessageStartIndex) {
-        proccessedMessageStartIndex++;
-        if(proccessedMessageStartIndex == PROCESSED_MESSAGE_LENGTH) {
-          proccessedMessageStartIndex = 0;
+    ctx->proccessedMessages[position].sequenceID = messageHeader->sequenceID;
+    ctx->proccessedMessages[position].source = messageHeader->source;
+    ctx->proccessedMessages[position].time = ctx->getSystemTimestamp();
+    ctx->proccessedMessages[position].timesReceived = 1;
+    
+    insertProcessedMessageInIndex(ctx, getIndexedProcessedMessageHash(ctx, position), 
+            position);
+    if(ctx->processedMessageTimer.previous == NULL) {
+        startTimer(ctx, &ctx->processedMessageTimer, TIMER_PROCESSED_MESSAGES, 
+                ctx->proccessedMessages[position].time + REMOVE_PROCESSED_MESSAGE_AFTER 
+                    + PROCESSED_MESSAGE_TIMER_SLACK + 1);
+    }
+}
+
+static void removeOldestProcessedMessage(MeshContext* ctx)
+{
+    updateRelayDensity(ctx, 
+            ctx->proccessedMessages[ctx->proccessedMessageStartIndex].timesReceived);
+    removeProcessedMessageFromIndex(ctx, ctx->proccessedMessageStartIndex);
+    ctx->proccessedMessageStartIndex++;
+    if(ctx->proccessedMessageStartIndex == PROCESSED_MESSAGE_LENGTH) {
+        ctx->proccessedMessageStartIndex = 0;
+    }
+}
+
+static uint16 getIndexedProcessedMessageHash(MeshContext* ctx, ProcessedMessageIndex position)
+{
+    return getProcessedMessageHash(ctx->proccessedMessages[position].source, 
+            ctx->proccessedMessages[position].sequenceID);
+}
+#endif
+
+static uint16 getProcessedMessageHash(uint16 source, uint8 sequenceID)
+{
+    // The multiplier is odd, so consecutive sequence IDs from one source 
+    // always land in distinct slots
+    uint16 hash = source ^ (uint16)(sequenceID * 0x9E37u);
+    hash ^= hash >> 7;
+    return hash & PROCESSED_MESSAGE_HASH_MASK;
+}
+
+static void insertProcessedMessageInIndex(MeshContext* ctx, uint16 hash, ProcessedMessageIndex position)
+{
+    while(ctx->processedMessageIndex[hash] != PROCESSED_MESSAGE_EMPTY) 
+    {
+        hash = (hash + 1) & PROCESSED_MESSAGE_HASH_MASK;
+    }
+    ctx->processedMessageIndex[hash] = position;
+}
+
+static void removeProcessedMessageFromIndex(MeshContext* ctx, ProcessedMessageIndex position)
+{
+    uint16 hash = getIndexedProcessedMessageHash(ctx, position);
+    while(ctx->processedMessageIndex[hash] != position) 
+    {
+        if(ctx->processedMessageIndex[hash] == PROCESSED_MESSAGE_EMPTY) 
+        {
+            // Not indexed
+            return;
+        }
+        hash = (hash + 1) & PROCESSED_MESSAGE_HASH_MASK;
+    }
+    
+    // Shift the rest of the probe sequence back into the hole, so that no
+    // tombstones are needed
+    uint16 hole = hash;
+    uint16 next = (hash + 1) & PROCESSED_MESSAGE_HASH_MASK;
+    while(ctx->processedMessageIndex[next] != PROCESSED_MESSAGE_EMPTY) 
+    {
+        uint16 home = getIndexedProcessedMessageHash(ctx, ctx->processedMessageIndex[next]);
+        // Move the entry unless its home slot lies cyclically in (hole, next]
+        if(((next - home) & PROCESSED_MESSAGE_HASH_MASK) 
+                >= ((next - hole) & PROCESSED_MESSAGE_HASH_MASK)) 
+        {
+            ctx->processedMessageIndex[hole] = ctx->processedMessageIndex[next];
+            hole = next;
         }
+        next = (next + 1) & PROCESSED_MESSAGE_HASH_MASK;
     }
+    ctx->processedMessageIndex[hole] = PROCESSED_MESSAGE_EMPTY;
 }
 
-void constructDataMessage(uint8* data, MessageType type, uint16 destination, uint8* message, uint8 length) 
+void constructDataMessage(MeshContext* ctx, uint8* data, MessageType type, uint16 destination, uint8* message, uint8 length, uint8 ttl) 
 {
     MessageHeader* header = (MessageHeader*) data;
-    header->networkIdentifier = networkIdentifier;
+    header->networkIdentifier = ctx->networkIdentifier;
     header->type = type;
-    header->length = length;
-    header->sequenceID = currentSequenceId++;
-    header->source = id;
+    header->ttl = ttl;
+    header->initialTTL = ttl;
+    header->sequenceID = ctx->currentSequenceId++;
+    header->source = ctx->id;
     header->destination = destination;
     
-    for(uint8 i = HEADER_SIZE; i < HEADER_SIZE + length; i++) {
-        data[i] = message[i-HEADER_SIZE];
-    }
+    osal_memcpy(&data[HEADER_SIZE], message, length);
 }
 
-static void resendNonACKedMessages()
+static void resendNonACKedMessage(MeshContext* ctx, PendingACK* pendingACK)
 {
-    uint32 timestamp = getSystemTimestamp() - PENDING_ACK_RESEND_TIMEOUT;
     uint8 data[32];
-    for(uint8 i = 0; i < PENDING_ACK_MAX; i++)
+    if(pendingACK->resentCount == RESEND_ACK_TIMES) {
+        // Resent enough times, remove from pending ACKs
+        reportDelivery(ctx, pendingACK, FALSE);
+        return;
+    }
+    uint8 sequenceID = sendStatefulMessageHelper(ctx, pendingACK->destination, 
+            data, pendingACK->message, pendingACK->length,
+            pendingACK->ttl);
+    pendingACK->time = ctx->getSystemTimestamp();
+    // Set the sequence id to that of the new message, which moves 
+    // it to another bucket
+    unlinkPendingACK(ctx, pendingACK);
+    pendingACK->sequenceId = sequenceID;
+    linkPendingACK(ctx, pendingACK);
+    pendingACK->resentCount++;
+    // Back off, so that senders stalled by the same disturbance 
+    // don't keep retrying together
+    pendingACK->timeout = pendingACK->timeout > RESEND_TIMEOUT_MAX / 2 
+            ? RESEND_TIMEOUT_MAX : 2 * pendingACK->timeout;
+    // New messages wait as long, until an ACK measures the round trip 
+    // again (RFC 6298 5.5). Without that a node whose resends fire on 
+    // time keeps resending into the congestion it is causing, as the 
+    // resent messages give no measurements.
+    if(ctx->resendTimeout < pendingACK->timeout) {
+        ctx->resendTimeout = pendingACK->timeout;
+    }
+    startResendTimer(ctx, pendingACK);
+}
+
+// RFC 6298: SRTT and RTTVAR follow the samples with gains 1/8 and 1/4, and 
+// the timeout is SRTT + 4 * RTTVAR
+static void updateRTT(MeshContext* ctx, uint32 rtt)
+{
+    if(rtt > RESEND_TIMEOUT_MAX) {
+        rtt = RESEND_TIMEOUT_MAX;
+    }
+    if(ctx->smoothedRTT == 0) {
+        ctx->smoothedRTT = rtt > 0 ? rtt : 1;
+        ctx->rttVariation = rtt / 2;
+    } else {
+        uint16 deviation = rtt > ctx->smoothedRTT 
+                ? rtt - ctx->smoothedRTT : ctx->smoothedRTT - rtt;
+        ctx->rttVariation = (3 * (uint32) ctx->rttVariation + deviation) / 4;
+        ctx->smoothedRTT = (7 * (uint32) ctx->smoothedRTT + rtt) / 8;
+    }
+    uint32 timeout = ctx->smoothedRTT + 4 * (uint32) ctx->rttVariation;
+    if(timeout < RESEND_TIMEOUT_MIN) {
+        timeout = RESEND_TIMEOUT_MIN;
+    } else if(timeout > RESEND_TIMEOUT_MAX) {
+        timeout = RESEND_TIMEOUT_MAX;
+    }
+    ctx->resendTimeout = timeout;
+}
+
+// The timeout plus up to a quarter of it, at random
+static void startResendTimer(MeshContext* ctx, PendingACK* pendingACK)
+{
+    startTimer(ctx, &pendingACK->timer, TIMER_PENDING_ACK, 
+            pendingACK->time + pendingACK->timeout
+                + ctx->getRandom() % (pendingACK->timeout / 4 + 1));
+}
+
+static void reportDelivery(MeshContext* ctx, PendingACK* pendingACK, uint8 delivered)
+{
+    uint16 destination = pendingACK->destination;
+    // Free the entry first, so that the callback may send again
+    stopTimer(ctx, &pendingACK->timer);
+    unlinkPendingACK(ctx, pendingACK);
+    pendingACK->destination = 0;
+    pendingACK->next = ctx->freePendingACK;
+    ctx->freePendingACK = pendingACK - ctx->pendingACKS;
+    if(ctx->deliveryReport != NULL) {
+        ctx->deliveryReport(destination, pendingACK->firstSequenceId, delivered);
+    }
+}
+
+// Returns the sequence ID of the message. An ACK going along with it takes 
+// the next one, so it isn't always the last one given out.
+static uint8 sendStatefulMessageHelper(MeshContext* ctx, uint16 destination, uint8* data, uint8* message, uint8 length, uint8 ttl) 
+{
+    constructDataMessage(ctx, data, STATEFUL_MESSAGE, destination, message, length, ttl);
+    advertiseUnicast(ctx, data, length + HEADER_SIZE);
+    return ((MessageHeader*) data)->sequenceID;
+}
+
+// Forwards a received message with one hop less, unless it has none left.
+// The hop is only taken off for the copy advertise() queues, the caller's 
+// buffer is left as it came in.
+static void relayMessage(MeshContext* ctx, uint8* message, uint8 length)
+{
+    MessageHeader* header = (MessageHeader*) message;
+    if(header->ttl <= 1) {
+        return;
+    }
+    header->ttl--;
+    ctx->advertise(message, length, getBackoffTime(ctx));
+    header->ttl++;
+}
+
+void clearProcessedMessages(MeshContext* ctx)
+{
+    uint32 timestamp = ctx->getSystemTimestamp();
+#ifdef PROCESSED_MESSAGE_WINDOW
+    // Forget sources that have been silent for a while, so that a restarted 
+    // node doesn't get its new sequence IDs rejected as old
+    ProcessedMessageIndex i = 0;
+    uint32 oldest = timestamp;
+    while(i < ctx->processedSourceCount) 
+    {
+        if(timestamp - ctx->processedSources[i].time > REMOVE_PROCESSED_MESSAGE_AFTER) {
+            removeSourceSequenceWindow(ctx, i);
+        } else {
+            if((int32) (ctx->processedSources[i].time - oldest) < 0) {
+                oldest = ctx->processedSources[i].time;
+            }
+            i++;
+        }
+    }
+    if(ctx->processedSourceCount > 0) {
+        startTimer(ctx, &ctx->processedMessageTimer, TIMER_PROCESSED_MESSAGES, 
+                oldest + REMOVE_PROCESSED_MESSAGE_AFTER 
+                    + PROCESSED_MESSAGE_TIMER_SLACK + 1);
+    }
+#else
+    // Messages are inserted in time order, so the expired ones are always
+    // at the start of the ring
+    while(ctx->proccessedMessageStartIndex != ctx->processedMessageEndIndex 
+        && timestamp - ctx->proccessedMessages[ctx->proccessedMessageStartIndex].time 
+            > REMOVE_PROCESSED_MESSAGE_AFTER) 
+    {
+        removeOldestProcessedMessage(ctx);
+    }
+    if(ctx->proccessedMessageStartIndex != ctx->processedMessageEndIndex) {
+        startTimer(ctx, &ctx->processedMessageTimer, TIMER_PROCESSED_MESSAGES, 
+                ctx->proccessedMessages[ctx->proccessedMessageStartIndex].time 
+                    + REMOVE_PROCESSED_MESSAGE_AFTER 
+                    + PROCESSED_MESSAGE_TIMER_SLACK + 1);
+    }
+#endif
+}
+
+// A free entry, making room according to the policy if there is none. The
+// delivery report of an evicted message may send another one into the 
+// freed entry, then the next victim makes room, up to once per entry.
+static PendingACK* allocatePendingACK(MeshContext* ctx, uint8 priority, 
+        PendingACKAdmission* admission)
+{
+    uint8 evictions = 0;
+    while(ctx->freePendingACK == PENDING_ACK_NONE) 
     {
-        if(pendingACKS[i].destination != 0 && pendingACKS[i].time < timestamp) 
+        if(ctx->pendingACKPolicy == PENDING_ACK_REJECT 
+            || evictions == ctx->pendingACKCapacity) {
+            return NULL;
+        }
+        PendingACK* victim = &ctx->pendingACKS[0];
+        for(uint8 i = 1; i < ctx->pendingACKCapacity; i++) 
         {
-          if(pendingACKS[i].resentCount == RESEND_ACK_TIMES) {
-            // Resent enough times, remove from pending ACKs
-            pendingACKS[i].destination = 0;
-          } else {
-            // Resend unACK'ed messages
-            sendStatefulMessageHelper(pendingACKS[i].destination, 
-                    data, pendingACKS[i].message, pendingACKS[i].length);
-            pendingACKS[i].time = getSystemTimestamp();
-            // Set the sequence id to that of the new message
-            pendingACKS[i].sequenceId = currentSequenceId - 1;
-            pendingACKS[i].resentCount++;
-          }
+            PendingACK* candidate = &ctx->pendingACKS[i];
+            if(ctx->pendingACKPolicy == PENDING_ACK_EVICT_LOWEST_PRIORITY 
+                && candidate->priority != victim->priority) 
+            {
+                if(candidate->priority < victim->priority) {
+                    victim = candidate;
+                }
+            } else if((int32) (candidate->sentTime - victim->sentTime) < 0) {
+                victim = candidate;
+            }
+        }
+        if(ctx->pendingACKPolicy == PENDING_ACK_EVICT_LOWEST_PRIORITY 
+            && victim->priority > priority) {
+            return NULL;
+        }
+        reportDelivery(ctx, victim, FALSE);
+        evictions++;
+        *admission = PENDING_ACK_ADMITTED_EVICTED;
+    }
+    PendingACK* pendingACK = &ctx->pendingACKS[ctx->freePendingACK];
+    ctx->freePendingACK = pendingACK->next;
+    return pendingACK;
+}
+
+static void insertPendingACK(MeshContext* ctx, PendingACK* pendingACK, 
+        uint8* message, uint8 length) 
+{
+    MessageHeader* messageHeader = (MessageHeader*) message;
+    if(length > sizeof(pendingACK->message)) {
+        length = sizeof(pendingACK->message);
+    }
+    pendingACK->sequenceId = messageHeader->sequenceID;
+    pendingACK->destination = messageHeader->destination;
+    pendingACK->time = ctx->getSystemTimestamp();
+    pendingACK->sentTime = pendingACK->time;
+    pendingACK->length = length;
+    // Resends are flooded, in case the route is gone
+    pendingACK->ttl = ctx->messageTTL;
+    pendingACK->resentCount = 0;
+    pendingACK->firstSequenceId = messageHeader->sequenceID;
+    pendingACK->timeout = ctx->resendTimeout;
+    startResendTimer(ctx, pendingACK);
+    osal_memcpy(pendingACK->message, &message[HEADER_SIZE], length);
+    linkPendingACK(ctx, pendingACK);
+}
+
+static uint8 getPendingACKBucket(MeshContext* ctx, uint16 destination, uint8 sequenceId)
+{
+    return (uint16) (destination * 31 + sequenceId) % ctx->pendingACKCapacity;
+}
+
+static void linkPendingACK(MeshContext* ctx, PendingACK* pendingACK)
+{
+    PendingACK* bucket = &ctx->pendingACKS[getPendingACKBucket(ctx, 
+            pendingACK->destination, pendingACK->sequenceId)];
+    pendingACK->next = bucket->bucket;
+    bucket->bucket = pendingACK - ctx->pendingACKS;
+}
+
+static void unlinkPendingACK(MeshContext* ctx, PendingACK* pendingACK)
+{
+    uint8 index = pendingACK - ctx->pendingACKS;
+    uint8* link = &ctx->pendingACKS[getPendingACKBucket(ctx, 
+            pendingACK->destination, pendingACK->sequenceId)].bucket;
+    while(*link != PENDING_ACK_NONE) 
+    {
+        if(*link == index) {
+            *link = pendingACK->next;
+            return;
         }
+        link = &ctx->pendingACKS[*link].next;
     }
 }
 
-static void sendStatefulMessageHelper(uint16 destination, uint8* data, uint8* message, uint8 length) 
+static PendingACK* findPendingACK(MeshContext* ctx, uint16 destination, uint8 sequenceId)
 {
-    constructDataMessage(data, STATEFUL_MESSAGE, destination, message, length);
-    advertise(data, length + HEADER_SIZE, 0);
+    if(ctx->pendingACKCapacity == 0) {
+        return NULL;
+    }
+    uint8 i = ctx->pendingACKS[getPendingACKBucket(ctx, destination, sequenceId)].bucket;
+    while(i != PENDING_ACK_NONE) 
+    {
+        PendingACK* pendingACK = &ctx->pendingACKS[i];
+        if(pendingACK->destination == destination 
+            && pendingACK->sequenceId == sequenceId) {
+            return pendingACK;
+        }
+        i = pendingACK->next;
+    }
+    return NULL;
 }
 
-void clearProcessedMessages()
+// Clears every pending ACK the ACK covers
+static void removePendingACK(MeshContext* ctx, uint8* message, uint8 length) 
 {
-    uint32 timestamp = getSystemTimestamp();
-    uint8 searchTo = processedMessageEndIndex;
-    if(proccessedMessageStartIndex > processedMessageEndIndex) 
+    MessageHeader* messageHeader = (MessageHeader*) message;
+    if(length <= HEADER_SIZE) {
+        return;
+    }
+    uint8 previous = length > HEADER_SIZE + 1 ? message[HEADER_SIZE + 1] : 0;
+    for(uint8 age = 0; age <= 8; age++) 
     {
-        searchTo = PROCESSED_MESSAGE_LENGTH;
+        if(age > 0 && !(previous & (1 << (age - 1)))) {
+            continue;
+        }
+        PendingACK* pendingACK = findPendingACK(ctx, messageHeader->source, 
+                message[HEADER_SIZE] - age);
+        if(pendingACK == NULL) {
+            continue;
+        }
+        if(age == 0 && pendingACK->resentCount == 0) {
+            // Only a message sent once tells the round trip time, as the 
+            // ACK of a resent one might be for any of its transmissions
+            updateRTT(ctx, ctx->getSystemTimestamp() - pendingACK->time);
+        }
+        reportDelivery(ctx, pendingACK, TRUE);
     }
-    timestamp -= REMOVE_PROCESSED_MESSAGE_AFTER;
-    
-    for(uint8 i = proccessedMessageStartIndex; i < searchTo; i++) 
+}
+
+// Queues an ACK for the message, replacing the queued ACK to the same peer
+// if it can cover both
+static void deferACK(MeshContext* ctx, MessageHeader* header)
+{
+    uint8 data[HEADER_SIZE + ACK_LENGTH];
+    uint32 timestamp = ctx->getSystemTimestamp();
+    DeferredACK* ack = getDeferredACK(ctx, header->source);
+    uint8 merged = FALSE;
+    if(ack != NULL) 
     {
-        if(proccessedMessages[i].time < timestamp) {
-           proccessedMessageStartIndex++;
+        uint8 age = ack->sequenceID - header->sequenceID;
+        if(age == 0) {
+            // Already covered
+            return;
+        } else if(age <= 8) {
+            ack->previous |= 1 << (age - 1);
+            merged = TRUE;
+        } else if(age >= 248) {
+            // Newer, by at most 8
+            uint8 shift = header->sequenceID - ack->sequenceID;
+            ack->previous = shift == 8 ? 0x80 : (ack->previous << shift) | (1 << (shift - 1));
+            ack->sequenceID = header->sequenceID;
+            merged = TRUE;
         }
     }
-    
-    if(searchTo == PROCESSED_MESSAGE_LENGTH) 
+    if(merged) 
+    {
+        ctx->cancelAdvertisement(ctx->id, ack->queuedSequenceID);
+    } 
+    else 
     {
-        for(uint8 i = 0; i < processedMessageEndIndex; i++) 
+        // A new ACK, in a free entry or the one due first, which is queued
+        // already and can be left alone
+        ack = &ctx->deferredACKs[0];
+        for(uint8 i = 0; i < DEFERRED_ACK_MAX; i++) 
         {
-            if(proccessedMessages[i].time < timestamp) {
-                proccessedMessageStartIndex++;
-             }
+            DeferredACK* candidate = &ctx->deferredACKs[i];
+            if(candidate->destination == 0 
+                || (int32) (candidate->deadline - timestamp) <= 0) {
+                ack = candidate;
+                break;
+            } else if((int32) (candidate->deadline - ack->deadline) < 0) {
+                ack = candidate;
+            }
         }
+        ack->destination = header->source;
+        ack->sequenceID = header->sequenceID;
+        ack->previous = 0;
+        ack->deadline = timestamp + ACK_DELAY;
     }
+    constructACK(ctx, data, ack);
+    ctx->advertise(data, HEADER_SIZE + ACK_LENGTH, ack->deadline - timestamp);
 }
 
-static void insertPendingACK(uint8* message) 
+// The ACK to the destination that hasn't left yet, if any
+static DeferredACK* getDeferredACK(MeshContext* ctx, uint16 destination)
 {
-    MessageHeader* messageHeader = (MessageHeader*) message;
-    uint8 i = 0;
-    for(; i < PENDING_ACK_MAX; i++) 
+    uint32 timestamp = ctx->getSystemTimestamp();
+    for(uint8 i = 0; i < DEFERRED_ACK_MAX; i++) 
     {
-        if(pendingACKS[i].destination == 0) 
+        if(ctx->deferredACKs[i].destination == destination
+            && (int32) (ctx->deferredACKs[i].deadline - timestamp) > 0) {
+            return &ctx->deferredACKs[i];
+        }
+    }
+    return NULL;
+}
+
+static void constructACK(MeshContext* ctx, uint8* data, DeferredACK* ack)
+{
+    uint8 payload[ACK_LENGTH];
+    payload[0] = ack->sequenceID;
+    payload[1] = ack->previous;
+    constructDataMessage(ctx, data, STATEFUL_MESSAGE_ACK, ack->destination, 
+            payload, ACK_LENGTH, getUnicastTTL(ctx, ack->destination));
+    ack->queuedSequenceID = ((MessageHeader*) data)->sequenceID;
+}
+
+// Advertises a message of this node, taking along the ACK waiting for its
+// destination when both fit in one advertisement
+static void advertiseUnicast(MeshContext* ctx, uint8* data, uint8 length)
+{
+    DeferredACK* ack = getDeferredACK(ctx, ((MessageHeader*) data)->destination);
+    // In an aggregate both messages lose their network identifier and get 
+    // a length byte
+    uint8 aggregateLength = AGGREGATE_HEADER_SIZE 
+            + 1 + length - sizeof(uint16) 
+            + 1 + HEADER_SIZE + ACK_LENGTH - sizeof(uint16);
+    if(ack != NULL && aggregateLength <= MESSAGE_LENGTH_MAX) 
+    {
+        uint8 aggregate[MESSAGE_LENGTH_MAX];
+        uint8 ackData[HEADER_SIZE + ACK_LENGTH];
+        ctx->cancelAdvertisement(ctx->id, ack->queuedSequenceID);
+        constructACK(ctx, ackData, ack);
+        osal_memcpy(aggregate, data, length);
+        length = aggregateMessage(aggregate, length, ackData, HEADER_SIZE + ACK_LENGTH);
+        ack->destination = 0;
+        ctx->advertise(aggregate, length, 0);
+        return;
+    }
+    ctx->advertise(data, length, 0);
+}
+
+static void processSegment(MeshContext* ctx, uint8* message, uint8 length)
+{
+    MessageHeader* header = (MessageHeader*) message;
+    SegmentHeader* segment = (SegmentHeader*) &message[HEADER_SIZE];
+    if(length < HEADER_SIZE + SEGMENT_HEADER_SIZE) {
+        return;
+    }
+    uint8 segmentLength = length - HEADER_SIZE - SEGMENT_HEADER_SIZE;
+    if(segment->lastSegmentIndex >= SEGMENT_COUNT_MAX
+        || segment->segmentIndex > segment->lastSegmentIndex
+        || segmentLength > SEGMENT_PAYLOAD_LENGTH
+        || (segment->segmentIndex < segment->lastSegmentIndex 
+            && segmentLength != SEGMENT_PAYLOAD_LENGTH)) {
+        return;
+    }
+    
+    ReassemblyBuffer* buffer = getReassemblyBuffer(ctx, header->source, segment);
+    if(buffer == NULL) {
+        // All buffers are busy, the sender will have to resend
+        return;
+    }
+    uint16 bit = 1 << segment->segmentIndex;
+    if(!(buffer->receivedSegments & bit)) 
+    {
+        osal_memcpy(&buffer->data[segment->segmentIndex * SEGMENT_PAYLOAD_LENGTH],
+                &message[HEADER_SIZE + SEGMENT_HEADER_SIZE], segmentLength);
+        buffer->receivedSegments |= bit;
+        if(segment->segmentIndex == segment->lastSegmentIndex) {
+            buffer->length = segment->segmentIndex * SEGMENT_PAYLOAD_LENGTH + segmentLength;
+        }
+    }
+    buffer->time = ctx->getSystemTimestamp();
+    startTimer(ctx, &buffer->timer, TIMER_REASSEMBLY, 
+            buffer->time + REASSEMBLY_TIMEOUT + 1);
+    
+    uint8 complete = buffer->receivedSegments 
+            == (uint16) ((1 << (buffer->lastSegmentIndex + 1)) - 1);
+    if(complete && !buffer->delivered) 
+    {
+        buffer->delivered = TRUE;
+        ctx->forwardMessageToApp(buffer->source, buffer->data, buffer->length);
+    }
+    // The last segment ends every round of the sender. A resent segment of
+    // a completed message means that the ACK got lost.
+    if(segment->acknowledged 
+        && (complete || segment->segmentIndex == segment->lastSegmentIndex)) {
+        sendSegmentACK(ctx, buffer);
+    }
+}
+
+// The buffer of the message the segment belongs to. A new message takes a 
+// free buffer, or one of a message that is done or has timed out.
+static ReassemblyBuffer* getReassemblyBuffer(MeshContext* ctx, uint16 source, 
+        SegmentHeader* segment)
+{
+    ReassemblyBuffer* buffer = NULL;
+    for(uint8 i = 0; i < REASSEMBLY_BUFFER_MAX; i++) 
+    {
+        ReassemblyBuffer* candidate = &ctx->reassemblyBuffers[i];
+        if(candidate->source == source) 
         {
+            if(candidate->transferID == segment->transferID) {
+                return candidate;
+            }
+            // The source has moved on to a new message
+            buffer = candidate;
             break;
+        } 
+        else if(buffer == NULL && (candidate->source == 0 || candidate->delivered
+            || ctx->getSystemTimestamp() - candidate->time > REASSEMBLY_TIMEOUT)) 
+        {
+            buffer = candidate;
         }
     }
-    
-    if(i == PENDING_ACK_MAX) 
+    if(buffer != NULL) 
     {
-        // If the array is full, increment the last pending ACK index,
-        // to overwrite the PendingAck which is the oldest
-        i = lastPendingACKIndex = (lastPendingACKIndex + 1) % PENDING_ACK_MAX;
+        buffer->source = source;
+        buffer->transferID = segment->transferID;
+        buffer->lastSegmentIndex = segment->lastSegmentIndex;
+        buffer->receivedSegments = 0;
+        buffer->delivered = FALSE;
+    }
+    return buffer;
+}
+
+static void sendSegment(MeshContext* ctx, uint16 destination, uint8* message, 
+        uint8 length, SegmentHeader segment, uint8 ttl)
+{
+    uint8 data[32];
+    uint8 offset = segment.segmentIndex * SEGMENT_PAYLOAD_LENGTH;
+    uint8 segmentLength = length - offset;
+    if(segmentLength > SEGMENT_PAYLOAD_LENGTH) {
+        segmentLength = SEGMENT_PAYLOAD_LENGTH;
+    }
+    constructDataMessage(ctx, data, SEGMENTED_MESSAGE, destination, 
+            (uint8*) &segment, SEGMENT_HEADER_SIZE, ttl);
+    osal_memcpy(&data[HEADER_SIZE + SEGMENT_HEADER_SIZE], &message[offset], 
+            segmentLength);
+    advertiseUnicast(ctx, data, HEADER_SIZE + SEGMENT_HEADER_SIZE + segmentLength);
+}
+
+// Acknowledges every segment received so far
+static void sendSegmentACK(MeshContext* ctx, ReassemblyBuffer* buffer)
+{
+    uint8 data[HEADER_SIZE + 3];
+    uint8 ack[3];
+    ack[0] = buffer->transferID;
+    ack[1] = buffer->receivedSegments & 0xFF;
+    ack[2] = buffer->receivedSegments >> 8;
+    constructDataMessage(ctx, data, SEGMENT_ACK, buffer->source, ack, 3, 
+            getUnicastTTL(ctx, buffer->source));
+    advertiseUnicast(ctx, data, HEADER_SIZE + 3);
+}
+
+static void processSegmentACK(MeshContext* ctx, uint8* message, uint8 length)
+{
+    MessageHeader* header = (MessageHeader*) message;
+    SegmentedTransfer* transfer = &ctx->segmentedTransfer;
+    if(length < HEADER_SIZE + 3 || transfer->destination != header->source
+        || !transfer->acknowledged || transfer->transferID != message[HEADER_SIZE]) {
+        return;
+    }
+    uint16 acknowledgedSegments = message[HEADER_SIZE + 1] 
+            | (message[HEADER_SIZE + 2] << 8);
+    // A duplicate or stale ACK, which a resend wouldn't help
+    if((acknowledgedSegments & ~transfer->acknowledgedSegments) == 0) {
+        return;
+    }
+    transfer->acknowledgedSegments |= acknowledgedSegments;
+    uint8 lastSegmentIndex = transfer->length == 0 ? 0 
+            : (transfer->length - 1) / SEGMENT_PAYLOAD_LENGTH;
+    if(transfer->acknowledgedSegments 
+        == (uint16) ((1 << (lastSegmentIndex + 1)) - 1)) {
+        endSegmentedTransfer(ctx, TRUE);
     } else {
-        lastPendingACKIndex = i;
+        resendSegments(ctx, getUnicastTTL(ctx, transfer->destination));
     }
-    pendingACKS[i].sequenceId = messageHeader->sequenceID;
-    pendingACKS[i].destination = messageHeader->destination;
-    pendingACKS[i].time = getSystemTimestamp();
-    pendingACKS[i].length = messageHeader->length;
-    pendingACKS[i].message = pendingACKMessages[i];
-    pendingACKS[i].resentCount = 0;
-    // TODO : Replace by memcpy
-    for(uint8 u = 0; u < messageHeader->length; u++) 
+}
+
+// Sends the next SEGMENT_WINDOW segments of the round. The ACK is waited 
+// for from the end of the round, an unacknowledged message is done then.
+static void sendSegmentWindow(MeshContext* ctx)
+{
+    SegmentedTransfer* transfer = &ctx->segmentedTransfer;
+    SegmentHeader segment;
+    segment.transferID = transfer->transferID;
+    segment.acknowledged = transfer->acknowledged;
+    segment.lastSegmentIndex = transfer->length == 0 ? 0 
+            : (transfer->length - 1) / SEGMENT_PAYLOAD_LENGTH;
+    uint8 sent = 0;
+    for(uint8 i = 0; i <= segment.lastSegmentIndex && sent < SEGMENT_WINDOW; i++) 
     {
-        pendingACKMessages[i][u] = message[u+HEADER_SIZE];
+        if(transfer->unsentSegments & (1 << i)) 
+        {
+            segment.segmentIndex = i;
+            sendSegment(ctx, transfer->destination, transfer->data, 
+                    transfer->length, segment, transfer->ttl);
+            transfer->unsentSegments &= ~(1 << i);
+            sent++;
+        }
+    }
+    transfer->time = ctx->getSystemTimestamp();
+    if(transfer->unsentSegments != 0) {
+        startTimer(ctx, &transfer->timer, TIMER_SEGMENTED_TRANSFER, 
+                transfer->time + SEGMENT_WINDOW_INTERVAL);
+    } else if(transfer->acknowledged) {
+        startTimer(ctx, &transfer->timer, TIMER_SEGMENTED_TRANSFER, 
+                transfer->time + PENDING_ACK_RESEND_TIMEOUT + 1);
+    } else {
+        transfer->destination = 0;
+        stopTimer(ctx, &transfer->timer);
     }
 }
 
-static void removePendingACK(uint8* message) 
+// Resends the segments not acknowledged, and the last one in any case, to
+// get a new ACK. Rounds started by an ACK count as well, so that a segment
+// that never gets through doesn't keep the transfer going.
+static void resendSegments(MeshContext* ctx, uint8 ttl)
 {
-    MessageHeader* messageHeader = (MessageHeader*) message;
-    for(uint8 i = 0; i < PENDING_ACK_MAX; i++) 
+    SegmentedTransfer* transfer = &ctx->segmentedTransfer;
+    if(transfer->resentCount == RESEND_ACK_TIMES) {
+        endSegmentedTransfer(ctx, FALSE);
+        return;
+    }
+    transfer->resentCount++;
+    uint8 lastSegmentIndex = transfer->length == 0 ? 0 
+            : (transfer->length - 1) / SEGMENT_PAYLOAD_LENGTH;
+    transfer->unsentSegments = ~transfer->acknowledgedSegments 
+            & (uint16) ((1 << (lastSegmentIndex + 1)) - 1);
+    transfer->unsentSegments |= 1 << lastSegmentIndex;
+    transfer->ttl = ttl;
+    sendSegmentWindow(ctx);
+}
+
+static void resendSegmentedMessage(MeshContext* ctx)
+{
+    // Flooded, in case the route is gone
+    resendSegments(ctx, ctx->messageTTL);
+}
+
+static void endSegmentedTransfer(MeshContext* ctx, uint8 delivered)
+{
+    SegmentedTransfer* transfer = &ctx->segmentedTransfer;
+    uint16 destination = transfer->destination;
+    transfer->destination = 0;
+    stopTimer(ctx, &transfer->timer);
+    if(ctx->deliveryReport != NULL) {
+        ctx->deliveryReport(destination, transfer->transferID, delivered);
+    }
+}
+
+// Starts the timer, or moves it if running
+static void startTimer(MeshContext* ctx, MeshTimer* timer, MeshTimerType type, 
+        uint32 deadline)
+{
+    stopTimer(ctx, timer);
+    if(ctx->runningTimers == 0) {
+        // Nothing to run meanwhile, so the wheel can skip ahead
+        ctx->timerTick = ctx->getSystemTimestamp() >> TIMER_TICK_SHIFT;
+    }
+    timer->type = type;
+    timer->deadline = deadline;
+    ctx->runningTimers++;
+    placeTimer(ctx, timer);
+}
+
+static void stopTimer(MeshContext* ctx, MeshTimer* timer)
+{
+    if(timer->previous == NULL) {
+        return;
+    }
+    unlinkTimer(timer);
+    ctx->runningTimers--;
+}
+
+static void unlinkTimer(MeshTimer* timer)
+{
+    *timer->previous = timer->next;
+    if(timer->next != NULL) {
+        timer->next->previous = timer->previous;
+    }
+    timer->previous = NULL;
+}
+
+// Puts the timer in the slot of the lowest level that reaches its deadline
+static void placeTimer(MeshContext* ctx, MeshTimer* timer)
+{
+    uint32 tick = timer->deadline >> TIMER_TICK_SHIFT;
+    uint8 level = 0;
+    if((int32) (tick - ctx->timerTick) < 0) {
+        // Overdue, run with the current tick
+        tick = ctx->timerTick;
+    } else if(tick - ctx->timerTick 
+        >= ((uint32) 1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS))) {
+        // Beyond the wheel, cascaded down and placed again later
+        tick = ctx->timerTick 
+                + ((uint32) 1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+        level = TIMER_WHEEL_LEVELS - 1;
+    } else {
+        while(tick - ctx->timerTick 
+            >= ((uint32) 1 << (TIMER_WHEEL_SLOT_BITS * (level + 1)))) 
+        {
+            level++;
+        }
+    }
+    MeshTimer** slot = &ctx->timerSlots[level]
+            [(tick >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+    timer->next = *slot;
+    if(*slot != NULL) {
+        (*slot)->previous = &timer->next;
+    }
+    timer->previous = slot;
+    *slot = timer;
+}
+
+// Runs the timers of every tick before the current one, and those of the 
+// current one that are due
+static void runTimers(MeshContext* ctx)
+{
+    uint32 timestamp = ctx->getSystemTimestamp();
+    uint32 tick = timestamp >> TIMER_TICK_SHIFT;
+    while(ctx->runningTimers > 0) 
+    {
+        uint8 tickDone = (int32) (tick - ctx->timerTick) > 0;
+        MeshTimer** slot = &ctx->timerSlots[0][ctx->timerTick & (TIMER_WHEEL_SLOTS - 1)];
+        MeshTimer* timer = *slot;
+        while(timer != NULL) 
+        {
+            if(tickDone || (int32) (timer->deadline - timestamp) <= 0) {
+                // It counts as running until handled, so that starting it 
+                // again doesn't skip the wheel ahead of the tick being run. 
+                // Running it may change the slot, so start over.
+                unlinkTimer(timer);
+                runTimer(ctx, timer);
+                ctx->runningTimers--;
+                timer = *slot;
+            } else {
+                timer = timer->next;
+            }
+        }
+        if(!tickDone) {
+            return;
+        }
+        ctx->timerTick++;
+        // Starting a new turn of a level brings the timers of the next slot 
+        // of the level above down
+        for(uint8 level = 1; level < TIMER_WHEEL_LEVELS 
+            && (ctx->timerTick & (((uint32) 1 << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) == 0; 
+            level++) 
+        {
+            cascadeTimers(ctx, level);
+        }
+    }
+    ctx->timerTick = tick;
+}
+
+static void cascadeTimers(MeshContext* ctx, uint8 level)
+{
+    MeshTimer** slot = &ctx->timerSlots[level]
+            [(ctx->timerTick >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+    MeshTimer* timer = *slot;
+    *slot = NULL;
+    while(timer != NULL) 
+    {
+        MeshTimer* next = timer->next;
+        placeTimer(ctx, timer);
+        timer = next;
+    }
+}
+
+// Timers are the first member of their owner
+static void runTimer(MeshContext* ctx, MeshTimer* timer)
+{
+    switch(timer->type)
+    {
+        case TIMER_PENDING_ACK:
+            resendNonACKedMessage(ctx, (PendingACK*) timer);
+            break;
+        case TIMER_PROCESSED_MESSAGES:
+            clearProcessedMessages(ctx);
+            break;
+        case TIMER_REASSEMBLY:
+            ((ReassemblyBuffer*) timer)->source = 0;
+            break;
+        case TIMER_SEGMENTED_TRANSFER:
+            if(ctx->segmentedTransfer.unsentSegments != 0) {
+                sendSegmentWindow(ctx);
+            } else {
+                resendSegmentedMessage(ctx);
+            }
+            break;
+    }
+}
+
+static uint8 isMemberOfGroup(MeshContext* ctx, uint16 group) 
+{
+    uint8 position;
+    return findGroup(ctx, group, &position);
+}
+
+// Binary search of the sorted memberships. Sets position to where the group
+// is, or should be inserted if not a member.
+static uint8 findGroup(MeshContext* ctx, uint16 group, uint8* position) 
+{
+    uint8 low = 0, high = ctx->groupMemberIndex;
+    while(low < high) 
     {
-        if(messageHeader->source == pendingACKS[i].destination
-            && message[HEADER_SIZE] == pendingACKS[i].sequenceId) {
-            pendingACKS[i].destination = 0;
+        uint8 middle = (low + high) / 2;
+        if(ctx->groupMemberships[middle] < group) {
+            low = middle + 1;
+        } else {
+            high = middle;
         }
     }
+    *position = low;
+    return low < ctx->groupMemberIndex && ctx->groupMemberships[low] == group;
+}
+
+// The TTL a message was sent with and the TTL left tell how many hops away
+// its source is, routed or not
+static void learnRoute(MeshContext* ctx, MessageHeader* header)
+{
+    if(header->source == ctx->id || header->ttl > header->initialTTL) {
+        return;
+    }
+    uint8 hops = header->initialTTL - header->ttl + 1;
+    uint32 timestamp = ctx->getSystemTimestamp();
+    RouteInformation* route = getRoute(ctx, header->source);
+    if(route == NULL) 
+    {
+        // Take a free entry, or else the one confirmed longest ago
+        route = &ctx->routes[0];
+        for(uint8 i = 0; i < ROUTE_TABLE_MAX && route->destination != 0; i++) 
+        {
+            if(ctx->routes[i].destination == 0 
+                || timestamp - ctx->routes[i].time > timestamp - route->time) {
+                route = &ctx->routes[i];
+            }
+        }
+    } 
+    else if(hops > route->hops && timestamp - route->time <= ROUTE_TIMEOUT) 
+    {
+        // A copy that took a detour
+        return;
+    }
+    route->destination = header->source;
+    route->hops = hops;
+    route->time = timestamp;
 }
 
-static uint8 isMemberOfGroup(uint16 group) 
+static RouteInformation* getRoute(MeshContext* ctx, uint16 destination)
 {
-    for(uint8 i = 0; i < groupMemberIndex; i++)
+    for(uint8 i = 0; i < ROUTE_TABLE_MAX; i++) 
     {
-        if(groupMemberships[i] == group)
-            return TRUE;
+        if(ctx->routes[i].destination == destination) {
+            return &ctx->routes[i];
+        }
+    }
+    return NULL;
+}
+
+static uint8 getUnicastTTL(MeshContext* ctx, uint16 destination)
+{
+    RouteInformation* route = getRoute(ctx, destination);
+    if(!ctx->unicastRouting || route == NULL
+        || ctx->getSystemTimestamp() - route->time > ROUTE_TIMEOUT
+        || route->hops + ROUTE_TTL_SLACK >= ctx->messageTTL) {
+        return ctx->messageTTL;
     }
-    return FALSE;
+    return route->hops + ROUTE_TTL_SLACK;
+}
+
+// Whether to relay a unicast for another node. A message sent with a TTL 
+// fitting the distance to its destination only has enough hops left when 
+// this node is on a path of that length. Without a route it is flooded.
+static uint8 isOnRoute(MeshContext* ctx, MessageHeader* header)
+{
+    RouteInformation* route = getRoute(ctx, header->destination);
+    if(!ctx->unicastRouting || route == NULL 
+        || ctx->getSystemTimestamp() - route->time > ROUTE_TIMEOUT) {
+        return TRUE;
+    }
+    return route->hops < header->ttl;
+}
+
+static uint16 getBackoffTime(MeshContext* ctx) {
+  if(ctx->relaySuppression == RELAY_SUPPRESSION_ADAPTIVE) {
+    return ctx->getRandom() % (RELAY_LISTEN_SLOTS * ctx->backoffInterval);
+  }
+  return (ctx->getRandom() % 5) * ctx->backoffInterval;
+}
+
+// Number of receptions of a message at which its relay is cancelled
+static uint8 getRelayThreshold(MeshContext* ctx) {
+  if(ctx->relaySuppression == RELAY_SUPPRESSION_FIXED) {
+    return ctx->countThreshold;
+  }
+  uint8 copies = ctx->relayDensity >> RELAY_DENSITY_SHIFT;
+  if(copies <= RELAY_SPARSE_COPIES) {
+    // Every relay may be needed to reach past the few neighbours
+    return RELAY_SPARSE_COPIES + 2;
+  }
+  return copies <= RELAY_DENSE_COPIES ? 4 : 3;
 }
 
-static uint16 getBackoffTime() {
-  return (getRandom() % 5) * BACKOFF_INTERVAL;
+// Running average of the receptions per message, with weight 1/8 for the
+// newest message
+static void updateRelayDensity(MeshContext* ctx, uint8 timesReceived) {
+  uint16 sample = (uint16)timesReceived << RELAY_DENSITY_SHIFT;
+  ctx->relayDensity = ctx->relayDensity - (ctx->relayDensity >> 3) 
+          + (sample >> 3);
 }
 
@@ -7,11 +7,20 @@ extern "C" {
 
 //#define TEST_FLAG
 
+// Uncomment to detect duplicates with a sliding sequence window per source,
+// instead of keeping one record per processed message
+//#define PROCESSED_MESSAGE_WINDOW
+
+// Uncomment to start with adaptive rather than fixed relay suppression
+//#define ADAPTIVE_RELAY_SUPPRESSION
+
 #ifdef TEST_FLAG
     #include <time.h>
     typedef unsigned char uint8;
     typedef unsigned short uint16;
     typedef unsigned long uint32;
+    typedef signed short int16;
+    typedef signed long int32;
     typedef uint32 uint24;
     #define TRUE 1
     #define FALSE 0
@@ -19,6 +28,93 @@ extern "C" {
     #include "comdef.h"
 #endif
 
+#ifndef PROCESSED_MESSAGE_LENGTH
+#define PROCESSED_MESSAGE_LENGTH 100
+#endif
+#ifndef PROCESSED_SOURCE_MAX
+#define PROCESSED_SOURCE_MAX 64
+#endif
+#define PROCESSED_SOURCE_WINDOW_SIZE 32
+// Size of the pending ACK table unless setPendingACKBuffer provides one
+#ifndef PENDING_ACK_MAX
+#define PENDING_ACK_MAX 8
+#endif
+// Largest pending ACK table, as entries are linked by 8-bit indices
+#define PENDING_ACK_CAPACITY_MAX 254
+#define PENDING_ACK_NONE 0xFF
+// Protocol timers run on a hierarchical timer wheel of TIMER_WHEEL_LEVELS 
+// levels of TIMER_WHEEL_SLOTS slots. A slot of the first level is one tick
+// of 1 << TIMER_TICK_SHIFT ms, and a slot of the next level spans a whole 
+// turn of the previous one. Timers beyond the last level wait in its last 
+// slot.
+#ifndef TIMER_TICK_SHIFT
+#define TIMER_TICK_SHIFT 4
+#endif
+#define TIMER_WHEEL_SLOT_BITS 4
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS 3
+// Peers with an ACK waiting to be sent
+#define DEFERRED_ACK_MAX 4
+#define GROUP_MEMBERSHIP_MAX 40
+#ifndef ROUTE_TABLE_MAX
+#define ROUTE_TABLE_MAX 32
+#endif
+// A message, header included, has to fit in an advertisement after the 
+// 4-byte frame prefix
+#define MESSAGE_LENGTH_MAX 27
+// An advertisement can carry several messages. It then starts with the 
+// network identifier and AGGREGATE_SOURCE, followed by the messages without
+// their network identifier, each prefixed with its length.
+#define AGGREGATE_SOURCE 0
+#define AGGREGATE_HEADER_SIZE 4
+// Longer messages are sent in up to SEGMENT_COUNT_MAX segments, at most 16.
+// 13 segments carry 208 bytes, enough for a 200-byte configuration.
+#define SEGMENT_COUNT_MAX 13
+#define SEGMENT_PAYLOAD_LENGTH (MESSAGE_LENGTH_MAX - sizeof(MessageHeader) - sizeof(SegmentHeader))
+#define SEGMENTED_MESSAGE_LENGTH_MAX (SEGMENT_COUNT_MAX * SEGMENT_PAYLOAD_LENGTH)
+// Segments are handed to the advertiser SEGMENT_WINDOW at a time, every 
+// SEGMENT_WINDOW_INTERVAL ms, so that a window fits in the queue slots kept
+// for messages of this node and is on air before the next one comes
+#ifndef SEGMENT_WINDOW
+#define SEGMENT_WINDOW 4
+#endif
+#ifndef SEGMENT_WINDOW_INTERVAL
+#define SEGMENT_WINDOW_INTERVAL 400
+#endif
+// Segmented messages being received at the same time
+#ifndef REASSEMBLY_BUFFER_MAX
+#define REASSEMBLY_BUFFER_MAX 2
+#endif
+// Hops a message may take. The TTL field has 5 bits.
+#define MESSAGE_TTL_MAX 31
+#ifndef MESSAGE_TTL_DEFAULT
+#define MESSAGE_TTL_DEFAULT MESSAGE_TTL_MAX
+#endif
+
+#ifdef PROCESSED_MESSAGE_WINDOW
+#define PROCESSED_MESSAGE_CAPACITY PROCESSED_SOURCE_MAX
+#else
+#define PROCESSED_MESSAGE_CAPACITY PROCESSED_MESSAGE_LENGTH
+#endif
+
+// Size of the open-addressed index over the processed message records. It 
+// must be a power of two and at least twice PROCESSED_MESSAGE_CAPACITY to
+// keep probes short.
+#if PROCESSED_MESSAGE_CAPACITY <= 64
+#define PROCESSED_MESSAGE_HASH_SIZE 128
+#elif PROCESSED_MESSAGE_CAPACITY <= 128
+#define PROCESSED_MESSAGE_HASH_SIZE 256
+#elif PROCESSED_MESSAGE_CAPACITY <= 512
+#define PROCESSED_MESSAGE_HASH_SIZE 1024
+#elif PROCESSED_MESSAGE_CAPACITY <= 2048
+#define PROCESSED_MESSAGE_HASH_SIZE 4096
+#elif PROCESSED_MESSAGE_CAPACITY <= 8192
+#define PROCESSED_MESSAGE_HASH_SIZE 16384
+#else
+#define PROCESSED_MESSAGE_HASH_SIZE 32768
+#endif
+#define PROCESSED_MESSAGE_HASH_MASK (PROCESSED_MESSAGE_HASH_SIZE - 1)
+
 
 typedef enum
 {
@@ -26,25 +122,83 @@ typedef enum
   GROUP_BROADCAST,
   STATELESS_MESSAGE,
   STATEFUL_MESSAGE,
-  STATEFUL_MESSAGE_ACK
+  STATEFUL_MESSAGE_ACK,
+  SEGMENTED_MESSAGE,
+  SEGMENT_ACK
 
 } MessageType;
 
+typedef enum
+{
+  // Cancel a queued relay after countThreshold receptions
+  RELAY_SUPPRESSION_FIXED = 0,
+  // Counter-based flooding with a random listen period, and a threshold 
+  // following the number of copies heard per message
+  RELAY_SUPPRESSION_ADAPTIVE
+} RelaySuppressionMode;
+
+// What a stateful message does when the pending ACK table is full
+typedef enum
+{
+  // Not sent
+  PENDING_ACK_REJECT = 0,
+  PENDING_ACK_EVICT_OLDEST,
+  // Oldest of the lowest priority. Not sent if all have a higher priority
+  PENDING_ACK_EVICT_LOWEST_PRIORITY
+} PendingACKPolicy;
+
+typedef enum
+{
+  PENDING_ACK_ADMITTED = 0,
+  // Sent, in place of another message, which is reported as failed
+  PENDING_ACK_ADMITTED_EVICTED,
+  PENDING_ACK_REJECTED
+} PendingACKAdmission;
+
 typedef void (*advertiseDataFunction)(uint8* data, uint8 length, uint16 delay);
 typedef void (*cancelAdvertisementDataFunction)(uint16 source, uint8 sequenceID);
 typedef void (*onMessageRecieved)(uint16 source, uint8* message, uint8 length);
 typedef uint32 (*getSystemTimestampFunction) ();
 typedef uint16 (*randomFunction)();
+// Called once per stateful message, with the sequence ID 
+// sendPrioritizedStatefulMessage wrote out, when it has been ACK'ed or given 
+// up. Also called once per 
+// acknowledged segmented message, with its transfer ID.
+typedef void (*onDeliveryReport)(uint16 destination, uint8 sequenceID, 
+        uint8 delivered);
 
+// Laid out as sent, also on hosts that would align the destination
+#pragma pack(push, 1)
 typedef struct  
 {
     uint16 networkIdentifier;
     uint16 source;
-    uint8 length : 5;
+    // Hops left. Relays decrement it and don't forward a message that 
+    // reaches 0. The payload length follows from the advertisement length.
+    uint8 ttl : 5;
     MessageType type : 3;
     uint8 sequenceID;
+    // TTL the source sent the message with, which tells the hops it took
+    uint8 initialTTL;
+    // Left out by broadcasts
     uint16 destination;
 } MessageHeader;
+#pragma pack(pop)
+
+// Header of a BROADCAST, without the destination. Shorter messages are 
+// dropped.
+#define BROADCAST_HEADER_SIZE 7
+
+// Follows the header of a SEGMENTED_MESSAGE. All segments but the last
+// carry SEGMENT_PAYLOAD_LENGTH bytes.
+typedef struct 
+{
+    uint8 transferID : 7;
+    // The receiver answers with a SEGMENT_ACK
+    uint8 acknowledged : 1;
+    uint8 segmentIndex : 4;
+    uint8 lastSegmentIndex : 4;
+} SegmentHeader;
 
 typedef struct 
 {
@@ -56,14 +210,204 @@ typedef struct
 
 typedef struct 
 {
+    uint16 source;
+    uint8 highestSequenceID;
+    // Number of times highestSequenceID has been received
+    uint8 timesReceived;
+    // Bit n is set if highestSequenceID - n has been processed
+    uint32 window;
+    uint32 time;
+} SourceSequenceWindow;
+
+typedef enum
+{
+  TIMER_PENDING_ACK = 0,
+  TIMER_PROCESSED_MESSAGES,
+  TIMER_REASSEMBLY,
+  TIMER_SEGMENTED_TRANSFER
+} MeshTimerType;
+
+// Embedded in what it times, as the first member, so that an expired timer
+// leads back to its owner
+typedef struct MeshTimer
+{
+    struct MeshTimer* next;
+    // The pointer to this timer in its slot list, NULL if not running
+    struct MeshTimer** previous;
+    uint32 deadline;
+    MeshTimerType type;
+} MeshTimer;
+
+typedef struct 
+{
+    // Resend timer, running while the entry is in use
+    MeshTimer timer;
+    // 0 if free
     uint16 destination;
     uint8 sequenceId;
     uint8 length;
+    uint8 ttl;
+    uint8 priority;
+    // Next entry in the same hash bucket, or in the free list
+    uint8 next;
+    // First entry of the hash bucket with the index of this entry
+    uint8 bucket;
+    // Of the first transmission, for eviction and the delivery report
+    uint32 sentTime;
+    uint8 firstSequenceId;
+    // Of the last transmission. The next one is due after the backed off 
+    // timeout and some jitter
     uint32 time;
-    uint8* message;
+    uint16 timeout;
     uint8 resentCount;
+    uint8 message[MESSAGE_LENGTH_MAX - sizeof(MessageHeader)];
 } PendingACK;
 
+// Distance to a node, learned from the TTL of its messages
+typedef struct 
+{
+    uint16 destination;
+    uint8 hops;
+    uint32 time;
+} RouteInformation;
+
+typedef struct 
+{
+    // Drops the message when no segment has arrived for a while
+    MeshTimer timer;
+    // 0 if free
+    uint16 source;
+    uint8 transferID;
+    uint8 lastSegmentIndex;
+    // Bit n is set when segment n has been received
+    uint16 receivedSegments;
+    uint8 length;
+    uint8 delivered;
+    uint32 time;
+    uint8 data[SEGMENTED_MESSAGE_LENGTH_MAX];
+} ReassemblyBuffer;
+
+// A segmented message being sent, or waiting for its block ACK when 
+// acknowledged
+typedef struct 
+{
+    // Sends the next window, or resends when the ACK is overdue
+    MeshTimer timer;
+    // 0 if none
+    uint16 destination;
+    uint8 transferID;
+    uint8 length;
+    uint8 acknowledged;
+    uint8 ttl;
+    // Bit n is set when segment n of this round is still to be sent
+    uint16 unsentSegments;
+    // Bit n is set when segment n has been acknowledged
+    uint16 acknowledgedSegments;
+    uint32 time;
+    uint8 resentCount;
+    uint8 data[SEGMENTED_MESSAGE_LENGTH_MAX];
+} SegmentedTransfer;
+
+// ACKs are held back for a while, to cover more messages from the same peer
+// or to go along with a message to it. The payload of an ACK is sequenceID,
+// followed by previous. 
+typedef struct 
+{
+    // 0 if free
+    uint16 destination;
+    uint8 sequenceID;
+    // Bit n is set if sequenceID - 1 - n is acknowledged as well
+    uint8 previous;
+    // Of the queued ACK, to cancel it
+    uint8 queuedSequenceID;
+    uint32 deadline;
+} DeferredACK;
+
+#if PROCESSED_MESSAGE_CAPACITY < 255
+typedef uint8 ProcessedMessageIndex;
+#define PROCESSED_MESSAGE_EMPTY 0xFF
+#else
+typedef uint16 ProcessedMessageIndex;
+#define PROCESSED_MESSAGE_EMPTY 0xFFFF
+#endif
+
+// All state of one protocol instance. The functions without the Ctx suffix
+// operate on a single default instance, which is what the firmware uses.
+// Several instances can live side by side, e.g. to simulate a network.
+typedef struct
+{
+    uint16 networkIdentifier; 
+    uint16 id;
+    advertiseDataFunction advertise;
+    cancelAdvertisementDataFunction cancelAdvertisement;
+    onMessageRecieved forwardMessageToApp;
+    getSystemTimestampFunction getSystemTimestamp;
+    randomFunction getRandom;
+    
+#ifdef PROCESSED_MESSAGE_WINDOW
+    SourceSequenceWindow processedSources[PROCESSED_SOURCE_MAX];
+    ProcessedMessageIndex processedSourceCount;
+#else
+    ProcessedMessageIndex proccessedMessageStartIndex, processedMessageEndIndex;
+    ProccessedMessageInformation proccessedMessages[PROCESSED_MESSAGE_LENGTH];
+#endif
+    // Maps (source, sequenceID), or only the source when using sequence 
+    // windows, to a processed message record. PROCESSED_MESSAGE_EMPTY marks
+    // a free slot
+    ProcessedMessageIndex processedMessageIndex[PROCESSED_MESSAGE_HASH_SIZE];
+    // Due when the least recently updated record expires
+    MeshTimer processedMessageTimer;
+    RelaySuppressionMode relaySuppression;
+    uint8 countThreshold;
+    // Average receptions per message, with 4 fractional bits
+    uint16 relayDensity;
+    // Relays are delayed by a random multiple of this many ms, 
+    // BACKOFF_INTERVAL unless changed after initialization
+    uint16 backoffInterval;
+    uint8 currentSequenceId;
+    // TTL of the messages sent from now on
+    uint8 messageTTL;
+    // When set, unicasts to a known node only get as much TTL as its 
+    // distance needs, and are only relayed by nodes closer to it
+    uint8 unicastRouting;
+    RouteInformation routes[ROUTE_TABLE_MAX];
+    
+    // Hashed by destination and sequence ID
+    PendingACK* pendingACKS;
+    uint8 pendingACKCapacity;
+    uint8 freePendingACK;
+    PendingACKPolicy pendingACKPolicy;
+    PendingACK defaultPendingACKs[PENDING_ACK_MAX];
+    // Round trip time estimate of ACK'ed messages, as in RFC 6298. 
+    // smoothedRTT is 0 until the first measurement
+    uint16 smoothedRTT, rttVariation;
+    // Timeout of the first transmission of a stateful message
+    uint16 resendTimeout;
+    onDeliveryReport deliveryReport;
+    DeferredACK deferredACKs[DEFERRED_ACK_MAX];
+    
+    // Sorted, without duplicates
+    uint16 groupMemberships[GROUP_MEMBERSHIP_MAX];
+    uint8 groupMemberIndex;
+    
+    ReassemblyBuffer reassemblyBuffers[REASSEMBLY_BUFFER_MAX];
+    SegmentedTransfer segmentedTransfer;
+    uint8 currentTransferId;
+    
+    // Slots are lists of timers, the ones of the first level all expiring
+    // in the same tick
+    MeshTimer* timerSlots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    // The tick in progress. Timers of earlier ticks have been run.
+    uint32 timerTick;
+    uint8 runningTimers;
+} MeshContext;
+
+#ifdef TEST_FLAG
+// Number of copies and bytes copied by the protocol, per thread as the
+// simulation sweep runs nodes on several
+extern __thread uint32 meshProtocolCopies, meshProtocolCopiedBytes;
+#endif
+
 void initializeMeshConnectionProtocol(uint16 networkIdentifier, 
 	uint16 deviceIdentifier, 
 	advertiseDataFunction dataFunction, 
@@ -78,18 +422,130 @@ void broadcastMessage(uint8* message, uint8 length);
 
 void broadcastGroupMessage(uint16 groupDestination, uint8* message, uint8 length);
 
-void sendStatefulMessage(uint16 destination, uint8* message, uint8 length);
+// Whether the message was sent and took an entry of the pending ACK table, 
+// see PendingACKPolicy
+PendingACKAdmission sendStatefulMessage(uint16 destination, uint8* message, 
+        uint8 length);
+
+// Higher priorities are kept when the pending ACK table is full, see 
+// PENDING_ACK_EVICT_LOWEST_PRIORITY. sendStatefulMessage uses priority 0. 
+// The sequence ID the delivery report refers to is written to sequenceID 
+// unless NULL.
+PendingACKAdmission sendPrioritizedStatefulMessage(uint16 destination, 
+        uint8* message, uint8 length, uint8 priority, uint8* sequenceID);
 
 void sendStatelessMessage(uint16 destination, uint8* message, uint8 length);
 
+// Sends a message of up to SEGMENTED_MESSAGE_LENGTH_MAX bytes in segments,
+// SEGMENT_WINDOW at a time, delivered once all have arrived. An 
+// acknowledged message is resent in part until a block ACK covers every 
+// segment, as many times as a stateful message, and the outcome goes to the
+// delivery report. FALSE if too long, if the previous message is still 
+// being sent, or if it was acknowledged and is still unacknowledged.
+uint8 sendSegmentedMessage(uint16 destination, uint8* message, uint8 length, 
+        uint8 acknowledged);
+
+// FALSE if already a member or GROUP_MEMBERSHIP_MAX groups are joined
 uint8 joinGroup(uint16 groupId);
 
 uint8 leaveGroup(uint16 groupId);
 
 void destructMeshConnectionProtocol();
 
+// Runs the timers that are due: resends of stateful and segmented messages,
+// and expiry of duplicate detection records and incomplete segmented 
+// messages. May be called at any time, but at least at each deadline given
+// by getNextDeadline.
 void periodicTask();
 
+// The timestamp at which periodicTask has something to do next, which may
+// be in the past if it hasn't been called for a while. FALSE if no timer is 
+// running. Sending or processing a message may bring the deadline forward.
+uint8 getNextDeadline(uint32* deadline);
+
+void setRelaySuppression(RelaySuppressionMode mode, uint8 countThreshold);
+
+// TTL of the messages sent after the call, kept within 1 and MESSAGE_TTL_MAX.
+// A TTL of 1 only reaches direct neighbours.
+void setMessageTTL(uint8 ttl);
+
+// Unicasts are routed along the shortest known path when enabled, which is 
+// the default, and flooded otherwise. Distances are learned from the hops
+// the messages of other nodes took, whatever TTL they were sent with.
+void setUnicastRouting(uint8 enabled);
+
+// Reports the outcome of each stateful and acknowledged segmented message
+// sent after the call, NULL to stop
+void setDeliveryReport(onDeliveryReport callback);
+
+// Keeps the messages waiting for an ACK in buffer instead of the 
+// PENDING_ACK_MAX entries of the context, up to PENDING_ACK_CAPACITY_MAX.
+// Meant to be called right after initialization, as waiting messages are 
+// dropped without a report.
+void setPendingACKBuffer(PendingACK* buffer, uint8 capacity);
+
+// PENDING_ACK_EVICT_OLDEST unless changed
+void setPendingACKPolicy(PendingACKPolicy policy);
+
+// Adds message to aggregate, which holds a single message or an aggregate
+// of aggregateLength bytes, turning it into an aggregate if needed. Returns
+// the new length, or 0 if the message doesn't fit in MESSAGE_LENGTH_MAX 
+// bytes, in which case aggregate is left unchanged.
+uint8 aggregateMessage(uint8* aggregate, uint8 aggregateLength, 
+        uint8* message, uint8 length);
+
+void initializeMeshConnectionProtocolCtx(MeshContext* ctx, 
+        uint16 networkIdentifier, 
+        uint16 deviceIdentifier, 
+        advertiseDataFunction dataFunction, 
+        onMessageRecieved messageCallback,
+        getSystemTimestampFunction timestampFunction,
+        randomFunction randFun,
+        cancelAdvertisementDataFunction cancelDataFunction);
+
+void processIncomingMessageCtx(MeshContext* ctx, uint8* data, uint8 length);
+
+void broadcastMessageCtx(MeshContext* ctx, uint8* message, uint8 length);
+
+void broadcastGroupMessageCtx(MeshContext* ctx, uint16 groupDestination, 
+        uint8* message, uint8 length);
+
+PendingACKAdmission sendStatefulMessageCtx(MeshContext* ctx, 
+        uint16 destination, uint8* message, uint8 length);
+
+PendingACKAdmission sendPrioritizedStatefulMessageCtx(MeshContext* ctx, 
+        uint16 destination, uint8* message, uint8 length, uint8 priority, 
+        uint8* sequenceID);
+
+void sendStatelessMessageCtx(MeshContext* ctx, uint16 destination, 
+        uint8* message, uint8 length);
+
+uint8 sendSegmentedMessageCtx(MeshContext* ctx, uint16 destination, 
+        uint8* message, uint8 length, uint8 acknowledged);
+
+uint8 joinGroupCtx(MeshContext* ctx, uint16 groupId);
+
+uint8 leaveGroupCtx(MeshContext* ctx, uint16 groupId);
+
+void destructMeshConnectionProtocolCtx(MeshContext* ctx);
+
+void periodicTaskCtx(MeshContext* ctx);
+
+uint8 getNextDeadlineCtx(MeshContext* ctx, uint32* deadline);
+
+void setRelaySuppressionCtx(MeshContext* ctx, RelaySuppressionMode mode, 
+        uint8 countThreshold);
+
+void setMessageTTLCtx(MeshContext* ctx, uint8 ttl);
+
+void setUnicastRoutingCtx(MeshContext* ctx, uint8 enabled);
+
+void setDeliveryReportCtx(MeshContext* ctx, onDeliveryReport callback);
+
+void setPendingACKBufferCtx(MeshContext* ctx, PendingACK* buffer, uint8 capacity);
+
+void setPendingACKPolicyCtx(MeshContext* ctx, PendingACKPolicy policy);
+
 #ifdef	__cplusplus
 }
 #endif
@@ -1195,8 +1195,22 @@ static void gapRole_ProcessGAPMsg( gapEventHdr_t *pMsg )
     }
     break;
     
-  case GAP_DEVICE_DISCOVERY_EVENT:
   case GAP_DEVICE_INFO_EVENT:
+    // In streaming mode the report is handed over as it is, without going
+    // through the observer event
+    if ( pGapRoles_AppCGs && pGapRoles_AppCGs->pfnScanReport )
+    {
+      gapDeviceInfoEvent_t *pPkt = (gapDeviceInfoEvent_t *)pMsg;
+      
+      pGapRoles_AppCGs->pfnScanReport( pPkt->pEvtData, pPkt->dataLen );
+    }
+    else
+    {
+      isObserverMsg = TRUE;
+    }
+    break;
+    
+  case GAP_DEVICE_DISCOVERY_EVENT:
     {
       isObserverMsg = TRUE;
     } 
@@ -1237,10 +1251,18 @@ static void gapRole_ProcessGAPMsg( gapEventHdr_t *pMsg )
 */
 static void gapRole_SetupGAP( void )
 {
-  bStatus_t s = GAP_DeviceInit( gapRole_TaskID,
-                               gapRole_profileRole, gapObserverRoleMaxScanRes,
-                               gapRole_IRK, gapRole_SRK,
-                               &gapRole_signCounter );
+  uint8 maxScanRes = gapObserverRoleMaxScanRes;
+  
+  // Reports are not kept in streaming mode, so there is nothing to cap
+  if ( pGapRoles_AppCGs && pGapRoles_AppCGs->pfnScanReport )
+  {
+    maxScanRes = 0;
+  }
+  
+  VOID GAP_DeviceInit( gapRole_TaskID,
+                      gapRole_profileRole, maxScanRes,
+                      gapRole_IRK, gapRole_SRK,
+                      &gapRole_signCounter );
 }
 
 /*********************************************************************
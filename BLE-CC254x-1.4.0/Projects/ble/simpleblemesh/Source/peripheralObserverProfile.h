@@ -99,7 +99,7 @@ extern "C"
 #define GAPROLE_TERMINATE_LINK               2 // Terminate link upon unsuccessful parameter updates
   
 #define GAPOBSERVERROLE_BD_ADDR        0x400  //!< Device's Address. Read Only. Size is uint8[B_ADDR_LEN]. This item is read from the controller.
-#define GAPOBSERVERROLE_MAX_SCAN_RES   0x401  //!< Maximum number of discover scan results to receive. Default is 0 = unlimited.
+#define GAPOBSERVERROLE_MAX_SCAN_RES   0x401  //!< Maximum number of discover scan results to receive. Default is 0 = unlimited. Not used in streaming mode.
   
   
   
@@ -170,6 +170,16 @@ typedef enum
      observerRoleEvent_t *pEvent         //!< Pointer to event structure.
        );
   
+  /**
+  * Observer Report Callback Function, called in streaming mode with the data
+  * of every advertising report as it comes in
+  */
+  typedef void (*gapObserverReportCB_t)
+    (
+     uint8 *pData,                       //!< Advertising or scan response data.
+     uint8 dataLen                       //!< Length of the data.
+       );
+  
 
   
   /**
@@ -180,6 +190,7 @@ typedef enum
     gapRolesStateNotify_t    pfnStateChange;  //!< Whenever the device changes state
     gapRolesRssiRead_t       pfnRssiRead;     //!< When a valid RSSI is read from controller
     gapObserverEventCB_t     observerCB;      //!< Observer Event callback.
+    gapObserverReportCB_t    pfnScanReport;   //!< Streaming mode: every advertising report, instead of GAP_DEVICE_INFO_EVENT in observerCB. NULL to turn streaming mode off.
   } gapRolesCBs_t;
   
   /*-------------------------------------------------------------------
@@ -230,6 +241,9 @@ typedef enum
   
   /**
   * @brief       Does the device initialization.  Only call this function once.
+  *              When pfnScanReport is set the observer streams: discovery
+  *              results are not capped at GAPOBSERVERROLE_MAX_SCAN_RES, and
+  *              each report goes straight to pfnScanReport.
   *
   * @param       pAppCallbacks - pointer to application callbacks.
   *
@@ -0,0 +1,37 @@
+#include "scan_filter.h"
+
+void initializeScanFilter(ScanFilter* filter, uint8* framePrefix,
+                          uint16 networkIdentifier) {
+  for(uint8 i = 0; i < ADVERTISING_FRAME_PREFIX_LENGTH; i++) {
+    filter->framePrefix[i] = framePrefix[i];
+  }
+  filter->networkIdentifier[0] = ((uint8*) &networkIdentifier)[0];
+  filter->networkIdentifier[1] = ((uint8*) &networkIdentifier)[1];
+  for(uint8 i = 0; i < SCAN_FILTER_RESULTS; i++) {
+    filter->counts[i] = 0;
+  }
+}
+
+ScanFilterResult filterScanReport(ScanFilter* filter, uint8* data, uint8 length) {
+  ScanFilterResult result = SCAN_FILTER_ACCEPTED;
+  uint8* prefix = filter->framePrefix;
+  uint8* message = &data[ADVERTISING_FRAME_PREFIX_LENGTH];
+  if(length < ADVERTISING_FRAME_PREFIX_LENGTH + SCAN_FILTER_MESSAGE_MIN_LENGTH) {
+    result = SCAN_FILTER_TOO_SHORT;
+  } else if(data[0] == 0 || data[0] >= length) {
+    result = SCAN_FILTER_BAD_FRAMING;
+  } else if(data[0] != prefix[0] || data[1] != prefix[1]
+            || data[2] != prefix[2] || data[3] != prefix[3]) {
+    result = SCAN_FILTER_NOT_MESH;
+  } else if(message[0] != filter->networkIdentifier[0]
+            || message[1] != filter->networkIdentifier[1]) {
+    // The network identifier leads the message header
+    result = SCAN_FILTER_OTHER_NETWORK;
+  }
+  filter->counts[result]++;
+  return result;
+}
+
+uint32 getScanFilterCount(ScanFilter* filter, ScanFilterResult result) {
+  return filter->counts[result];
+}
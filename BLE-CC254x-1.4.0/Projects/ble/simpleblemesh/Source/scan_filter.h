@@ -0,0 +1,56 @@
+#ifndef SCAN_FILTER_H
+#define SCAN_FILTER_H
+#ifdef TEST_FLAG
+#include "mesh_transport_network_protocol.h"
+#else
+#include "comdef.h"
+#endif
+#include "advertising_queue.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+// Shortest mesh message processIncomingMessage takes, BROADCAST_HEADER_SIZE
+#define SCAN_FILTER_MESSAGE_MIN_LENGTH 7
+
+typedef enum
+{
+  SCAN_FILTER_ACCEPTED = 0,
+  // Too short to hold the frame prefix and a mesh message
+  SCAN_FILTER_TOO_SHORT,
+  // The first AD structure is empty or runs past the end of the report
+  SCAN_FILTER_BAD_FRAMING,
+  // Well formed, but not starting with the frame prefix of forwarded
+  // advertisements
+  SCAN_FILTER_NOT_MESH,
+  // A mesh message of another network
+  SCAN_FILTER_OTHER_NETWORK,
+  SCAN_FILTER_RESULTS
+} ScanFilterResult;
+
+// Rejects advertising reports that can't be mesh messages of this network
+// before they are parsed, with a few byte compares. Mesh frames are told
+// apart by the frame prefix the advertising queue puts in front of every
+// message, its last byte being the length of the mesh AD structure.
+typedef struct
+{
+  uint8 framePrefix[ADVERTISING_FRAME_PREFIX_LENGTH];
+  // Network identifier as laid out in the message header
+  uint8 networkIdentifier[2];
+  // Reports seen, by result
+  uint32 counts[SCAN_FILTER_RESULTS];
+} ScanFilter;
+
+void initializeScanFilter(ScanFilter* filter, uint8* framePrefix,
+                          uint16 networkIdentifier);
+// Advertising data of a report, with the frame prefix. The mesh message
+// follows the prefix when the report is accepted.
+ScanFilterResult filterScanReport(ScanFilter* filter, uint8* data, uint8 length);
+uint32 getScanFilterCount(ScanFilter* filter, ScanFilterResult result);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
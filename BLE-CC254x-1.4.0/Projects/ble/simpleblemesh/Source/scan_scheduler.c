@@ -0,0 +1,107 @@
+#include "scan_scheduler.h"
+
+// Scan windows and intervals in units of 0.625 ms, from the highest duty
+// cycle down: 100%, 86%, 50% and 25%
+static const uint16 scanWindows[SCAN_LEVELS] = {32, 30, 30, 30};
+static const uint16 scanIntervals[SCAN_LEVELS] = {32, 35, 60, 120};
+
+static uint32 getScannedTime(ScanScheduler* scheduler, uint32 time);
+static void closePeriod(ScanScheduler* scheduler, uint32 time);
+
+void initializeScanScheduler(ScanScheduler* scheduler, uint32 time) {
+  scheduler->level = 0;
+  scheduler->isScanning = FALSE;
+  scheduler->initializationTime = time;
+  scheduler->scanStart = time;
+  scheduler->periodStart = time;
+  scheduler->periodPackets = 0;
+  scheduler->periodScanTime = 0;
+  scheduler->receivedPackets = 0;
+  scheduler->missedPackets = 0;
+  scheduler->scanTime = 0;
+}
+
+void startScan(ScanScheduler* scheduler, uint32 time, uint8 backlog) {
+  stopScan(scheduler, time);
+  if((uint32)(time - scheduler->periodStart) >= SCAN_ADAPTATION_PERIOD) {
+    closePeriod(scheduler, time);
+  }
+  if(backlog > 0 || scheduler->periodPackets >= SCAN_BUSY_PACKETS) {
+    scheduler->level = 0;
+  }
+  scheduler->isScanning = TRUE;
+  scheduler->scanStart = time;
+}
+
+void stopScan(ScanScheduler* scheduler, uint32 time) {
+  if(scheduler->isScanning == FALSE) {
+    return;
+  }
+  uint32 scanned = getScannedTime(scheduler, time);
+  scheduler->periodScanTime += scanned;
+  scheduler->scanTime += scanned;
+  scheduler->isScanning = FALSE;
+}
+
+uint8 countScanPacket(ScanScheduler* scheduler) {
+  scheduler->receivedPackets++;
+  if(scheduler->periodPackets < 0xFFFF) {
+    scheduler->periodPackets++;
+  }
+  return scheduler->level > 0 && scheduler->periodPackets >= SCAN_BUSY_PACKETS;
+}
+
+uint16 getScanWindow(ScanScheduler* scheduler) {
+  return scanWindows[scheduler->level];
+}
+
+uint16 getScanInterval(ScanScheduler* scheduler) {
+  return scanIntervals[scheduler->level];
+}
+
+uint16 getScanDutyCycle(ScanScheduler* scheduler, uint32 time) {
+  uint32 elapsed = time - scheduler->initializationTime;
+  uint32 scanned = scheduler->scanTime;
+  if(scheduler->isScanning == TRUE) {
+    scanned += getScannedTime(scheduler, time);
+  }
+  if(elapsed == 0) {
+    return 0;
+  }
+  return (uint16) ((scanned * 1000) / elapsed);
+}
+
+uint32 getReceivedScanPackets(ScanScheduler* scheduler) {
+  return scheduler->receivedPackets;
+}
+
+uint32 getMissedScanPackets(ScanScheduler* scheduler) {
+  return scheduler->missedPackets;
+}
+
+// Time within scan windows since the discovery in progress started
+static uint32 getScannedTime(ScanScheduler* scheduler, uint32 time) {
+  return ((uint32)(time - scheduler->scanStart) * getScanWindow(scheduler))
+          / getScanInterval(scheduler);
+}
+
+static void closePeriod(ScanScheduler* scheduler, uint32 time) {
+  uint32 length = time - scheduler->periodStart;
+  uint32 scanned = scheduler->periodScanTime;
+  // Packets are taken to have come in at the rate they were heard at while
+  // scanning, through the rest of the period as well
+  if(scanned > 0 && length > scanned) {
+    uint32 packets = scheduler->periodPackets;
+    uint32 notScanned = length - scanned;
+    scheduler->missedPackets += packets * (notScanned / scanned)
+      + (packets * (notScanned % scanned)) / scanned;
+  }
+  if(scheduler->periodPackets >= SCAN_BUSY_PACKETS) {
+    scheduler->level = 0;
+  } else if(scheduler->periodPackets == 0 && scheduler->level < SCAN_LEVELS - 1) {
+    scheduler->level++;
+  }
+  scheduler->periodStart = time;
+  scheduler->periodPackets = 0;
+  scheduler->periodScanTime = 0;
+}
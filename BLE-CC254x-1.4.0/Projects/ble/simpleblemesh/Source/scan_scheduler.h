@@ -0,0 +1,75 @@
+#ifndef SCAN_SCHEDULER_H
+#define SCAN_SCHEDULER_H
+#ifdef TEST_FLAG
+#include "mesh_transport_network_protocol.h"
+#else
+#include "comdef.h"
+#endif
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+// Length of a discovery in ms, another one is started as soon as it ends
+#ifndef SCAN_DURATION
+#define SCAN_DURATION 1000
+#endif
+// How often in ms the duty cycle is revised when nothing is queued
+#ifndef SCAN_ADAPTATION_PERIOD
+#define SCAN_ADAPTATION_PERIOD 2000
+#endif
+// Packets heard in an adaptation period that bring scanning back to the
+// highest duty cycle at once
+#ifndef SCAN_BUSY_PACKETS
+#define SCAN_BUSY_PACKETS 4
+#endif
+// Number of scan window and interval pairs, see scan_scheduler.c
+#define SCAN_LEVELS 4
+
+// Scanning of one node. The duty cycle goes to the highest level when
+// advertisements are queued or packets come in, and one level down for every
+// adaptation period in which nothing was heard. It is applied when discovery
+// is started, as the stack only takes the scan window and interval then.
+typedef struct
+{
+  // Index into the scan levels, 0 being the highest duty cycle
+  uint8 level;
+  uint8 isScanning;
+  uint32 initializationTime;
+  // Start of the discovery in progress, and of the adaptation period
+  uint32 scanStart;
+  uint32 periodStart;
+  // Packets heard and time in ms spent within scan windows this adaptation
+  // period
+  uint16 periodPackets;
+  uint32 periodScanTime;
+  // Since initialization: packets heard, packets estimated to be missed
+  // outside scan windows and between discoveries, and time in ms spent
+  // within scan windows
+  uint32 receivedPackets;
+  uint32 missedPackets;
+  uint32 scanTime;
+} ScanScheduler;
+
+void initializeScanScheduler(ScanScheduler* scheduler, uint32 time);
+// Discovery starts at time with backlog advertisements queued, with the scan
+// window and interval the scheduler has settled on
+void startScan(ScanScheduler* scheduler, uint32 time, uint8 backlog);
+// Discovery has ended or was cancelled
+void stopScan(ScanScheduler* scheduler, uint32 time);
+// A packet was heard. Returns TRUE when the next discovery will start at a
+// higher duty cycle than the one in use.
+uint8 countScanPacket(ScanScheduler* scheduler);
+// In units of 0.625 ms
+uint16 getScanWindow(ScanScheduler* scheduler);
+uint16 getScanInterval(ScanScheduler* scheduler);
+// Share of the time since initialization spent within scan windows, per mille
+uint16 getScanDutyCycle(ScanScheduler* scheduler, uint32 time);
+uint32 getReceivedScanPackets(ScanScheduler* scheduler);
+uint32 getMissedScanPackets(ScanScheduler* scheduler);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * File:   ProcessedMessageBenchmark.cpp
+ *
+ * Per-packet cost of the duplicate detection in processIncomingMessage with
+ * a full processed message cache. The cache size is fixed at compile time,
+ * so build once per size, e.g.
+ *
+ *   gcc -DTEST_FLAG -DPROCESSED_MESSAGE_LENGTH=10000 -c mesh_transport_network_protocol.c
+ *   g++ -DTEST_FLAG -DPROCESSED_MESSAGE_LENGTH=10000 ProcessedMessageBenchmark.cpp \
+ *       mesh_transport_network_protocol.o -lbenchmark -lpthread
+ *
+ * for 100 (the default), 1000 and 10000 entries.
+ */
+
+#include "mesh_transport_network_protocol.h"
+#include <benchmark/benchmark.h>
+
+#ifndef PROCESSED_MESSAGE_LENGTH
+#define PROCESSED_MESSAGE_LENGTH 100
+#endif
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static const uint16 networkID = 0xFACB;
+static const uint16 nodeId = 0xC89A;
+
+static void advertiseCallback(uint8* data, uint8 length, uint16 delay) {}
+static void messageCallback(uint16 source, uint8* message, uint8 length) {}
+static void cancelAdvertisementCallback(uint16 source, uint8 sequenceID) {}
+static uint32 getTimestamp() { return 0; }
+static uint16 getRandom() { return 0; }
+
+static void setMessage(uint8* message, uint32 n) {
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = networkID;
+    header->destination = 0x1234;
+    header->type = STATELESS_MESSAGE;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->initialTTL = MESSAGE_TTL_DEFAULT;
+    // Every n gives a unique (source, sequenceID) pair
+    header->source = 1 + (n >> 8);
+    header->sequenceID = n & 0xFF;
+}
+
+// Fill the cache with the messages 0 .. PROCESSED_MESSAGE_LENGTH - 1
+static void fillCache(uint8* message) {
+    initializeMeshConnectionProtocol(networkID, nodeId, &advertiseCallback,
+            &messageCallback, &getTimestamp, &getRandom,
+            &cancelAdvertisementCallback);
+    for(uint32 n = 0; n < PROCESSED_MESSAGE_LENGTH; n++) {
+        setMessage(message, n);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+    }
+}
+
+// A message that is already in the cache
+static void BM_DuplicateHit(benchmark::State& state) {
+    uint8 message[HEADER_SIZE + 1] = {0};
+    fillCache(message);
+    uint32 n = 1;
+    for (auto _ : state) {
+        setMessage(message, n);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+        if(++n == PROCESSED_MESSAGE_LENGTH) n = 1;
+    }
+    state.counters["entries"] = PROCESSED_MESSAGE_LENGTH;
+}
+BENCHMARK(BM_DuplicateHit);
+
+// A new message, which is looked up, inserted and evicts the oldest entry
+static void BM_DuplicateMiss(benchmark::State& state) {
+    uint8 message[HEADER_SIZE + 1] = {0};
+    fillCache(message);
+    uint32 n = PROCESSED_MESSAGE_LENGTH;
+    for (auto _ : state) {
+        setMessage(message, n);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+        // Stay within the 16 bit source space
+        if(++n == 0xFF0000) n = 0;
+    }
+    state.counters["entries"] = PROCESSED_MESSAGE_LENGTH;
+}
+BENCHMARK(BM_DuplicateMiss);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,248 @@
+/*
+ * File:   ProtocolBenchmark.cpp
+ *
+ * Cost of the hot paths of the protocol on the host. Besides the time per
+ * operation every benchmark reports bytes_copied, the bytes the protocol
+ * copies itself plus those it hands to the advertising queue, which copies
+ * them once more. Build with
+ *
+ *   gcc -DTEST_FLAG -O2 -c mesh_transport_network_protocol.c
+ *   g++ -DTEST_FLAG -O2 ProtocolBenchmark.cpp \
+ *       mesh_transport_network_protocol.o -lbenchmark -lpthread
+ */
+
+#include "mesh_transport_network_protocol.h"
+#include <benchmark/benchmark.h>
+
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static const uint16 networkID = 0xFACB;
+static const uint16 nodeId = 0xC89A;
+static uint32 timestamp = 0;
+static uint32 advertisedBytes = 0;
+
+static void advertiseCallback(uint8* data, uint8 length, uint16 delay) {
+    advertisedBytes += length;
+}
+static void messageCallback(uint16 source, uint8* message, uint8 length) {
+    benchmark::DoNotOptimize(message);
+}
+static void cancelAdvertisementCallback(uint16 source, uint8 sequenceID) {}
+static uint32 getTimestamp() { return timestamp; }
+static uint16 getRandom() { return 0; }
+
+static void initializeProtocol() {
+    // Far enough from 0 for nothing to look overdue
+    timestamp = 100000;
+    initializeMeshConnectionProtocol(networkID, nodeId, &advertiseCallback,
+            &messageCallback, &getTimestamp, &getRandom,
+            &cancelAdvertisementCallback);
+}
+
+// Every n gives a unique (source, sequenceID) pair
+static void setMessage(uint8* message, MessageType type, uint16 destination,
+        uint32 n) {
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = networkID;
+    header->destination = destination;
+    header->type = type;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->initialTTL = MESSAGE_TTL_DEFAULT;
+    header->source = 1 + ((n >> 8) & 0x7FFF);
+    header->sequenceID = n & 0xFF;
+}
+
+class CopyCounter {
+public:
+    CopyCounter() :
+        copiedBytes(meshProtocolCopiedBytes), advertised(advertisedBytes) {}
+
+    void report(benchmark::State& state) {
+        state.counters["bytes_copied"] = benchmark::Counter(
+                (meshProtocolCopiedBytes - copiedBytes)
+                    + (advertisedBytes - advertised),
+                benchmark::Counter::kAvgIterations);
+    }
+private:
+    uint32 copiedBytes, advertised;
+};
+
+// A new message of the given type, addressed so that it takes the path of
+// the type
+static void BM_ProcessIncoming(benchmark::State& state) {
+    MessageType type = (MessageType) state.range(0);
+    uint16 destination = nodeId;
+    initializeProtocol();
+    if(type == GROUP_BROADCAST) {
+        destination = 0x100;
+        joinGroup(destination);
+    }
+    uint8 message[HEADER_SIZE + 8] = {0};
+    uint32 n = 0;
+    CopyCounter counter;
+    for (auto _ : state) {
+        setMessage(message, type, destination, n++);
+        processIncomingMessage(message, sizeof(message));
+    }
+    counter.report(state);
+    state.SetLabel(type == BROADCAST ? "broadcast"
+            : type == GROUP_BROADCAST ? "group broadcast"
+            : type == STATELESS_MESSAGE ? "stateless"
+            : type == STATEFUL_MESSAGE ? "stateful, sends ACK"
+            : "ACK, no pending match");
+}
+BENCHMARK(BM_ProcessIncoming)->DenseRange(BROADCAST, STATEFUL_MESSAGE_ACK);
+
+// A new message for another node, which is relayed
+static void BM_ProcessIncomingRelay(benchmark::State& state) {
+    initializeProtocol();
+    uint8 message[HEADER_SIZE + 8] = {0};
+    uint32 n = 0;
+    CopyCounter counter;
+    for (auto _ : state) {
+        setMessage(message, STATELESS_MESSAGE, 0x1234, n++);
+        processIncomingMessage(message, sizeof(message));
+    }
+    counter.report(state);
+}
+BENCHMARK(BM_ProcessIncomingRelay);
+
+// A message that is in the full processed message cache
+static void BM_DuplicateHit(benchmark::State& state) {
+    initializeProtocol();
+    uint8 message[HEADER_SIZE + 8] = {0};
+    for(uint32 n = 0; n < PROCESSED_MESSAGE_LENGTH; n++) {
+        setMessage(message, STATELESS_MESSAGE, 0x1234, n);
+        processIncomingMessage(message, sizeof(message));
+    }
+    uint32 n = 1;
+    CopyCounter counter;
+    for (auto _ : state) {
+        setMessage(message, STATELESS_MESSAGE, 0x1234, n);
+        processIncomingMessage(message, sizeof(message));
+        if(++n == PROCESSED_MESSAGE_LENGTH) n = 1;
+    }
+    counter.report(state);
+}
+BENCHMARK(BM_DuplicateHit);
+
+// A message from another network, rejected before the cache
+static void BM_OtherNetwork(benchmark::State& state) {
+    initializeProtocol();
+    uint8 message[HEADER_SIZE + 8] = {0};
+    setMessage(message, STATELESS_MESSAGE, nodeId, 0);
+    ((MessageHeader*) message)->networkIdentifier = networkID + 1;
+    for (auto _ : state) {
+        processIncomingMessage(message, sizeof(message));
+    }
+}
+BENCHMARK(BM_OtherNetwork);
+
+static void BM_BroadcastMessage(benchmark::State& state) {
+    initializeProtocol();
+    uint8 payload[19] = {0};
+    CopyCounter counter;
+    for (auto _ : state) {
+        broadcastMessage(payload, state.range(0));
+    }
+    counter.report(state);
+}
+BENCHMARK(BM_BroadcastMessage)->Arg(1)->Arg(19);
+
+// Goes through constructDataMessage
+static void BM_SendStatelessMessage(benchmark::State& state) {
+    initializeProtocol();
+    uint8 payload[19] = {0};
+    CopyCounter counter;
+    for (auto _ : state) {
+        sendStatelessMessage(0x1234, payload, state.range(0));
+    }
+    counter.report(state);
+}
+BENCHMARK(BM_SendStatelessMessage)->Arg(1)->Arg(19);
+
+static void BM_SendStatefulMessage(benchmark::State& state) {
+    initializeProtocol();
+    uint8 payload[15] = {0};
+    CopyCounter counter;
+    for (auto _ : state) {
+        sendStatefulMessage(0x1234, payload, sizeof(payload));
+    }
+    counter.report(state);
+}
+BENCHMARK(BM_SendStatefulMessage);
+
+// Fills all memberships but one, so that every join has to look through
+// the full table
+static void BM_JoinLeaveGroup(benchmark::State& state) {
+    initializeProtocol();
+    for(uint16 group = 1; group < GROUP_MEMBERSHIP_MAX; group++) {
+        joinGroup(group);
+    }
+    for (auto _ : state) {
+        joinGroup(0x8000);
+        leaveGroup(0x8000);
+    }
+}
+BENCHMARK(BM_JoinLeaveGroup);
+
+// isMemberOfGroup with GROUP_MEMBERSHIP_MAX memberships, through a local
+// group broadcast to the last group joined or to a group not joined
+static void BM_IsMemberOfGroup(benchmark::State& state) {
+    initializeProtocol();
+    for(uint16 group = 1; group <= GROUP_MEMBERSHIP_MAX; group++) {
+        joinGroup(group);
+    }
+    uint16 group = state.range(0) ? GROUP_MEMBERSHIP_MAX : 0x8000;
+    uint8 payload[8] = {0};
+    for (auto _ : state) {
+        broadcastGroupMessage(group, payload, sizeof(payload));
+    }
+    state.SetLabel(state.range(0) ? "member" : "not member");
+}
+BENCHMARK(BM_IsMemberOfGroup)->Arg(1)->Arg(0);
+
+// The processed message cache and the pending ACKs are full, but nothing
+// has expired or is due
+static void BM_PeriodicTaskFullCaches(benchmark::State& state) {
+    initializeProtocol();
+    uint8 message[HEADER_SIZE + 8] = {0};
+    for(uint32 n = 0; n < PROCESSED_MESSAGE_LENGTH; n++) {
+        setMessage(message, STATELESS_MESSAGE, 0x1234, n);
+        processIncomingMessage(message, sizeof(message));
+    }
+    for(uint8 i = 0; i < PENDING_ACK_MAX; i++) {
+        sendStatefulMessage(0x1234, message, 8);
+    }
+    CopyCounter counter;
+    for (auto _ : state) {
+        periodicTask();
+    }
+    counter.report(state);
+}
+BENCHMARK(BM_PeriodicTaskFullCaches);
+
+// Steady state where a new message arrives and an old one expires every
+// iteration
+static void BM_PeriodicTaskExpiring(benchmark::State& state) {
+    initializeProtocol();
+    uint8 message[HEADER_SIZE + 8] = {0};
+    uint32 n = 0;
+    for(; n < PROCESSED_MESSAGE_LENGTH; n++) {
+        timestamp += 30;
+        setMessage(message, STATELESS_MESSAGE, 0x1234, n);
+        processIncomingMessage(message, sizeof(message));
+    }
+    CopyCounter counter;
+    for (auto _ : state) {
+        timestamp += 30;
+        setMessage(message, STATELESS_MESSAGE, 0x1234, n++);
+        processIncomingMessage(message, sizeof(message));
+        periodicTask();
+    }
+    counter.report(state);
+    state.SetLabel("includes processIncomingMessage");
+}
+BENCHMARK(BM_PeriodicTaskExpiring);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,131 @@
+/*
+ * File:   ScanFilterBenchmark.cpp
+ *
+ * Per-report cost of handling advertising reports as biscuit.c does, with
+ * and without the scan filter in front of processIncomingMessage, on a mix
+ * of mesh messages of the network and reports of other devices. Build with
+ *
+ *   gcc -DTEST_FLAG -O2 -c mesh_transport_network_protocol.c scan_filter.c
+ *   g++ -DTEST_FLAG -O2 ScanFilterBenchmark.cpp \
+ *       mesh_transport_network_protocol.o scan_filter.o -lbenchmark -lpthread
+ */
+
+#include "mesh_transport_network_protocol.h"
+#include "scan_filter.h"
+#include <benchmark/benchmark.h>
+#include <string.h>
+
+#define HEADER_SIZE sizeof(MessageHeader)
+#define REPORTS 256
+
+static const uint16 networkID = 0xFACB;
+static const uint16 nodeId = 0xC89A;
+static uint8 framePrefix[ADVERTISING_FRAME_PREFIX_LENGTH] = {0x02, 0x01, 0x06, 27};
+
+static void advertiseCallback(uint8* data, uint8 length, uint16 delay) {}
+static void messageCallback(uint16 source, uint8* message, uint8 length) {}
+static void cancelAdvertisementCallback(uint16 source, uint8 sequenceID) {}
+static uint32 getTimestamp() { return 100000; }
+static uint16 getRandom() { return 0; }
+
+typedef struct {
+    uint8 data[ADVERTISING_FRAME_LENGTH];
+    uint8 length;
+    bool mesh;
+} Report;
+
+// Advertising data of devices that are not part of the network
+static const uint8 iBeacon[30] = {0x02, 0x01, 0x06, 0x1A, 0xFF, 0x4C, 0x00,
+        0x02, 0x15};
+static const uint8 eddystone[20] = {0x02, 0x01, 0x06, 0x03, 0x03, 0xAA, 0xFE,
+        0x0F, 0x16, 0xAA, 0xFE, 0x10};
+static const uint8 phone[11] = {0x07, 0xFF, 0x4C, 0x00, 0x10, 0x02, 0x0B};
+static const uint8 nodeData[24] = {0x02, 0x01, 0x06, 0x03, 0xBC, 0xCB, 0xFA,
+        0x14, 0x09};
+
+static void setReport(Report* report, const uint8* data, uint8 length) {
+    memset(report->data, 0, sizeof(report->data));
+    memcpy(report->data, data, length);
+    report->length = length;
+    report->mesh = false;
+}
+
+// Every foreignPercent in 100 reports is from another device or network,
+// spread evenly over the others
+static void setReports(Report* reports, int foreignPercent) {
+    int foreign = 0;
+    for(int i = 0; i < REPORTS; i++) {
+        Report* report = &reports[i];
+        if((i + 1) * foreignPercent / 100 == foreign) {
+            setReport(report, framePrefix, ADVERTISING_FRAME_PREFIX_LENGTH);
+            report->length += HEADER_SIZE + 8;
+            report->mesh = true;
+            continue;
+        }
+        switch(foreign++ % 5) {
+        case 0: setReport(report, iBeacon, sizeof(iBeacon)); break;
+        case 1: setReport(report, eddystone, sizeof(eddystone)); break;
+        case 2: setReport(report, phone, sizeof(phone)); break;
+        case 3: setReport(report, nodeData, sizeof(nodeData)); break;
+        default:
+            // A mesh message of another network
+            setReport(report, framePrefix, ADVERTISING_FRAME_PREFIX_LENGTH);
+            report->length += HEADER_SIZE + 8;
+            ((MessageHeader*) &report->data[ADVERTISING_FRAME_PREFIX_LENGTH])
+                    ->networkIdentifier = networkID + 1;
+        }
+    }
+}
+
+// A new message for another node every time, which is relayed
+static void setMessage(Report* report, uint32 n) {
+    MessageHeader* header =
+            (MessageHeader*) &report->data[ADVERTISING_FRAME_PREFIX_LENGTH];
+    header->networkIdentifier = networkID;
+    header->destination = 0x1234;
+    header->type = STATELESS_MESSAGE;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->initialTTL = MESSAGE_TTL_DEFAULT;
+    header->source = 1 + ((n >> 8) & 0x7FFF);
+    header->sequenceID = n & 0xFF;
+}
+
+static void BM_ScanReports(benchmark::State& state) {
+    int foreignPercent = state.range(0);
+    bool filtered = state.range(1);
+    static Report reports[REPORTS];
+    setReports(reports, foreignPercent);
+    initializeMeshConnectionProtocol(networkID, nodeId, &advertiseCallback,
+            &messageCallback, &getTimestamp, &getRandom,
+            &cancelAdvertisementCallback);
+    ScanFilter filter;
+    initializeScanFilter(&filter, framePrefix, networkID);
+    uint32 n = 0;
+    int i = 0;
+    for (auto _ : state) {
+        Report* report = &reports[i];
+        if(report->mesh) {
+            setMessage(report, n++);
+        }
+        if(!filtered || filterScanReport(&filter, report->data,
+                report->length) == SCAN_FILTER_ACCEPTED) {
+            processIncomingMessage(&report->data[ADVERTISING_FRAME_PREFIX_LENGTH],
+                    report->length - ADVERTISING_FRAME_PREFIX_LENGTH);
+        }
+        if(++i == REPORTS) i = 0;
+    }
+    if(filtered) {
+        state.counters["not_mesh"] = benchmark::Counter(
+                getScanFilterCount(&filter, SCAN_FILTER_NOT_MESH)
+                + getScanFilterCount(&filter, SCAN_FILTER_BAD_FRAMING)
+                + getScanFilterCount(&filter, SCAN_FILTER_TOO_SHORT),
+                benchmark::Counter::kAvgIterations);
+        state.counters["other_network"] = benchmark::Counter(
+                getScanFilterCount(&filter, SCAN_FILTER_OTHER_NETWORK),
+                benchmark::Counter::kAvgIterations);
+    }
+    state.SetLabel(filtered ? "scan filter" : "no filter");
+}
+BENCHMARK(BM_ScanReports)->ArgsProduct({{0, 50, 90}, {0, 1}});
+
+BENCHMARK_MAIN();
@@ -0,0 +1,999 @@
+/*
+ * File:   MeshSimulator.cpp
+ */
+
+#include "MeshSimulator.h"
+#include <algorithm>
+#include <math.h>
+#include <queue>
+#include <random>
+#include <string.h>
+
+#define NETWORK_IDENTIFIER 0xFACB
+#define HEADER_SIZE sizeof(MessageHeader)
+#define FRAME_PREFIX_LENGTH 4
+#define FRAME_LENGTH 31
+#define NO_TIME UINT64_MAX
+// Bytes on air around the advertising data: preamble, access address,
+// PDU header, advertiser address and CRC
+#define PACKET_OVERHEAD 16
+// Microseconds per byte at 1 Mbps
+#define BYTE_TIME 8
+// Time between the start of the packets of one advertising event
+#define CHANNEL_SPACING 150
+#define ADVERTISING_DELAY_MAX 10000
+// Upper bound on the duration of an advertising event, as in biscuit.c
+#define ADVERTISING_EVENT_TIME 3000
+#define ADVERTISING_CHANNELS 3
+
+enum SimulationEventType
+{
+    TRAFFIC_EVENT = 0,
+    PERIODIC_EVENT,
+    FORWARD_CHECK_EVENT,
+    ADVERTISING_EVENT,
+    PACKET_START_EVENT,
+    PACKET_END_EVENT,
+    FORWARDING_DONE_EVENT,
+    FORWARDING_RESTART_EVENT,
+    SCAN_START_EVENT,
+    SCAN_END_EVENT
+};
+
+struct SimulationEvent
+{
+    // Simulated time in microseconds
+    uint64_t time;
+    // Tie breaker, keeps the order deterministic
+    uint64_t order;
+    SimulationEventType type;
+    uint16_t node;
+    // Event specific, mostly a generation to detect stale events
+    uint32_t data;
+
+    bool operator>(const SimulationEvent& other) const {
+        return time != other.time ? time > other.time : order > other.order;
+    }
+};
+
+struct QueuedAdvertisement
+{
+    uint8_t length;
+    uint8_t data[FRAME_LENGTH - FRAME_PREFIX_LENGTH];
+    uint64_t dueTime;
+    uint32_t order;
+    uint8_t advertisingClass;
+    uint8_t transmissions;
+    uint16_t transmitInterval;
+};
+
+struct SimulatedNode
+{
+    MeshContext ctx;
+    std::vector<std::pair<uint16_t, double> > neighbours;
+
+    // Observing, as started and stopped by biscuit.c
+    ScanScheduler scanScheduler;
+    bool observing;
+    uint32_t scanGeneration;
+    uint64_t scanStart;
+    uint16_t scanWindow;
+    uint16_t scanInterval;
+    // Time within scan windows of the discoveries that have ended
+    uint64_t scanTime;
+    // Discovery each node was last reported in, when duplicates are filtered
+    // or results capped, and the number of nodes reported this discovery
+    std::vector<uint32_t> reportedIn;
+    uint32_t reportedNodes;
+    uint32_t reportedGeneration;
+
+    std::vector<QueuedAdvertisement> queue;
+    uint32_t queueOrder;
+    uint64_t forwardCheckTime;
+    uint32_t forwardCheckGeneration;
+    uint32_t periodicTaskGeneration;
+
+    // The advertisement on air
+    bool forwarding;
+    uint32_t forwardingGeneration;
+    uint64_t forwardingEnd;
+    uint8_t frame[FRAME_LENGTH];
+    uint8_t frameLength;
+    uint8_t frameTransmissions;
+    uint16_t frameInterval;
+    // Source and sequence ID of the messages in the frame still to be sent
+    std::vector<std::pair<uint16_t, uint8_t> > frameMessages;
+    // A due frame waits for advertising to end, and is built only then
+    bool restarting;
+    uint64_t transmittingUntil;
+
+    // The packet being received
+    bool receiving;
+    uint32_t receptionGeneration;
+    uint64_t receptionEnd;
+    bool receptionCorrupted;
+    bool receptionLost;
+    uint8_t receptionFrame[FRAME_LENGTH];
+    uint8_t receptionLength;
+    int receptionSender;
+};
+
+struct SimulatedMessage
+{
+    MessageType type;
+    uint16_t source;
+    uint16_t destination;
+    uint64_t sendTime;
+    // Nodes that got the message
+    std::vector<bool> delivered;
+};
+
+class MeshSimulator
+{
+public:
+    MeshSimulator(const SimulationConfig& config);
+    SimulationResults run();
+
+private:
+    const SimulationConfig& config;
+    SimulationResults results;
+    std::mt19937_64 random;
+    std::priority_queue<SimulationEvent, std::vector<SimulationEvent>,
+            std::greater<SimulationEvent> > events;
+    uint64_t eventOrder;
+    uint64_t now;
+    std::vector<SimulatedNode> nodes;
+    std::vector<SimulatedMessage> messages;
+    // The node whose protocol instance is running
+    int currentNode;
+
+    void createTopology();
+    void link(int from, int to, double loss);
+    void schedule(uint64_t time, SimulationEventType type, int node, uint32_t data);
+    double uniform();
+
+    void sendMessage();
+    void schedulePeriodicTask(int node);
+    void scheduleForwardCheck(int node);
+    void checkForwarding(int node, uint32_t generation);
+    uint8_t buildFrame(int node, uint8_t* frame, uint8_t* transmissions,
+            uint16_t* transmitInterval);
+    void addFrameMessage(int node, uint8_t* data);
+    uint64_t getHoldTime(uint8_t transmissions, uint16_t transmitInterval);
+    void startForwarding(int node);
+    void restartForwarding(int node, uint32_t generation);
+    void endForwarding(int node, uint32_t generation);
+    void startObserving(int node, uint32_t generation);
+    void endObserving(int node, uint32_t generation);
+    void pauseObserving(int node);
+    void stopObserving(int node);
+    bool isScanResultTableFull(int node);
+    size_t getNextQueued(int node, uint64_t time);
+    bool isAdmitted(int node, uint8_t advertisingClass);
+    void advertise(int node, uint32_t generation);
+    void startPacket(int node, uint32_t data);
+    void endPacket(int node, uint32_t generation);
+    bool isScanning(int node, int channel);
+    void countPacket(uint8_t* frame, uint8_t frameLength, uint64_t packetTime);
+    uint64_t getPacketTime(uint8_t frameLength);
+
+    static thread_local MeshSimulator* current;
+    static void advertiseCallback(uint8* data, uint8 length, uint16 delay);
+    static void cancelAdvertisementCallback(uint16 source, uint8 sequenceID);
+    static void messageCallback(uint16 source, uint8* message, uint8 length);
+    static uint32 getTimestamp();
+    static uint16 getRandom();
+};
+
+thread_local MeshSimulator* MeshSimulator::current = NULL;
+
+// Node indices map to protocol identifiers from 1, as 0 marks a free
+// pending ACK
+static uint16_t getNodeIdentifier(int node) {
+    return node + 1;
+}
+
+MeshSimulator::MeshSimulator(const SimulationConfig& config)
+    : config(config), random(config.seed), eventOrder(0), now(0),
+      nodes(config.nodes), currentNode(-1) {
+    memset(results.types, 0, sizeof(results.types));
+    results.collisions = 0;
+    results.linkLosses = 0;
+    results.notScanning = 0;
+    results.filteredReports = 0;
+    results.cappedReports = 0;
+    results.scanDutyCycle = 0;
+    results.receivedScanPackets = 0;
+    results.missedScanPackets = 0;
+    results.queueDrops = 0;
+    memset(results.classDrops, 0, sizeof(results.classDrops));
+    results.aggregatedPackets = 0;
+    results.periodicTasks = 0;
+    results.links = 0;
+}
+
+SimulationResults MeshSimulator::run() {
+    MeshSimulator* previous = current;
+    current = this;
+
+    createTopology();
+    for(int i = 0; i < config.nodes; i++) {
+        SimulatedNode& node = nodes[i];
+        currentNode = i;
+        initializeMeshConnectionProtocolCtx(&node.ctx, NETWORK_IDENTIFIER,
+                getNodeIdentifier(i),
+                &MeshSimulator::advertiseCallback,
+                &MeshSimulator::messageCallback,
+                &MeshSimulator::getTimestamp,
+                &MeshSimulator::getRandom,
+                &MeshSimulator::cancelAdvertisementCallback);
+        setRelaySuppressionCtx(&node.ctx, config.relaySuppression,
+                config.countThreshold);
+        node.ctx.backoffInterval = config.backoffInterval;
+        setMessageTTLCtx(&node.ctx, config.messageTTL);
+        setUnicastRoutingCtx(&node.ctx, config.unicastRouting);
+        initializeScanScheduler(&node.scanScheduler, 0);
+        node.observing = false;
+        node.scanGeneration = 0;
+        node.scanTime = 0;
+        if(config.filterDuplicates || config.maxScanResults > 0) {
+            node.reportedIn.assign(config.nodes, 0);
+        }
+        node.reportedNodes = 0;
+        node.reportedGeneration = 0;
+        // Nodes start observing at random within a scan interval
+        schedule(random() % (config.scanInterval * 625), SCAN_START_EVENT, i, 0);
+        node.queueOrder = 0;
+        node.forwardCheckTime = NO_TIME;
+        node.forwardCheckGeneration = 0;
+        node.periodicTaskGeneration = 0;
+        node.forwarding = false;
+        node.forwardingGeneration = 0;
+        node.transmittingUntil = 0;
+        node.receiving = false;
+        node.receptionGeneration = 0;
+        // Frames carry the same prefix as in biscuit.c
+        node.frame[0] = 0x02;
+        node.frame[1] = 0x01;
+        node.frame[2] = 0x06;
+        node.frame[3] = FRAME_LENGTH - FRAME_PREFIX_LENGTH;
+        node.restarting = false;
+        schedule(random() % (config.periodicTaskPeriod * 1000),
+                PERIODIC_EVENT, i, 0);
+    }
+    if(config.messageRate > 0) {
+        schedule(0, TRAFFIC_EVENT, 0, 0);
+    }
+
+    uint64_t end = (uint64_t) (config.duration + config.drainTime) * 1000;
+    while(!events.empty() && events.top().time <= end) {
+        SimulationEvent event = events.top();
+        events.pop();
+        now = event.time;
+        currentNode = event.node;
+        switch(event.type) {
+            case TRAFFIC_EVENT:
+                if(now < (uint64_t) config.duration * 1000) {
+                    sendMessage();
+                    double wait = -log(1 - uniform()) / config.messageRate;
+                    schedule(now + (uint64_t) (wait * 1e6), TRAFFIC_EVENT, 0, 0);
+                }
+                break;
+            case PERIODIC_EVENT:
+                if(nodes[event.node].periodicTaskGeneration == event.data) {
+                    results.periodicTasks++;
+                    periodicTaskCtx(&nodes[event.node].ctx);
+                    schedulePeriodicTask(event.node);
+                }
+                break;
+            case FORWARD_CHECK_EVENT:
+                checkForwarding(event.node, event.data);
+                break;
+            case ADVERTISING_EVENT:
+                advertise(event.node, event.data);
+                break;
+            case PACKET_START_EVENT:
+                startPacket(event.node, event.data);
+                break;
+            case PACKET_END_EVENT:
+                endPacket(event.node, event.data);
+                break;
+            case FORWARDING_DONE_EVENT:
+                endForwarding(event.node, event.data);
+                break;
+            case FORWARDING_RESTART_EVENT:
+                restartForwarding(event.node, event.data);
+                break;
+            case SCAN_START_EVENT:
+                startObserving(event.node, event.data);
+                break;
+            case SCAN_END_EVENT:
+                endObserving(event.node, event.data);
+                break;
+        }
+    }
+    for(int i = 0; i < config.nodes; i++) {
+        stopObserving(i);
+        results.scanDutyCycle += (double) nodes[i].scanTime / now / config.nodes;
+        results.receivedScanPackets +=
+                getReceivedScanPackets(&nodes[i].scanScheduler);
+        results.missedScanPackets +=
+                getMissedScanPackets(&nodes[i].scanScheduler);
+    }
+
+    for(size_t i = 0; i < messages.size(); i++) {
+        MessageTypeStatistics& statistics = results.types[messages[i].type];
+        statistics.expectedDeliveries += messages[i].type == BROADCAST ?
+            config.nodes - 1 : 1;
+    }
+    current = previous;
+    return results;
+}
+
+void MeshSimulator::createTopology() {
+    if(!config.links.empty()) {
+        for(size_t i = 0; i < config.links.size(); i++) {
+            const SimulationLink& l = config.links[i];
+            if(l.from < config.nodes && l.to < config.nodes && l.from != l.to) {
+                link(l.from, l.to, l.loss);
+            }
+        }
+        return;
+    }
+
+    int columns = (int) ceil(sqrt((double) config.nodes));
+    std::vector<double> x(config.nodes), y(config.nodes);
+    for(int i = 0; i < config.nodes; i++) {
+        x[i] = uniform();
+        y[i] = uniform();
+    }
+    for(int i = 0; i < config.nodes; i++) {
+        for(int j = i + 1; j < config.nodes; j++) {
+            bool linked = false;
+            switch(config.topology) {
+                case FULL_TOPOLOGY:
+                    linked = true;
+                    break;
+                case LINE_TOPOLOGY:
+                    linked = j == i + 1;
+                    break;
+                case GRID_TOPOLOGY:
+                    linked = (j == i + 1 && j % columns != 0) || j == i + columns;
+                    break;
+                case RANDOM_TOPOLOGY:
+                    linked = hypot(x[i] - x[j], y[i] - y[j]) <= config.radius;
+                    break;
+            }
+            if(linked) {
+                link(i, j, config.linkLoss);
+            }
+        }
+    }
+}
+
+void MeshSimulator::link(int from, int to, double loss) {
+    nodes[from].neighbours.push_back(std::make_pair((uint16_t) to, loss));
+    nodes[to].neighbours.push_back(std::make_pair((uint16_t) from, loss));
+    results.links++;
+}
+
+void MeshSimulator::schedule(uint64_t time, SimulationEventType type,
+        int node, uint32_t data) {
+    SimulationEvent event = {time, eventOrder++, type, (uint16_t) node, data};
+    events.push(event);
+}
+
+double MeshSimulator::uniform() {
+    return (random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void MeshSimulator::sendMessage() {
+    SimulatedMessage message;
+    double type = uniform();
+    message.type = uniform() < config.segmentedShare ? SEGMENTED_MESSAGE
+            : type < config.broadcastShare ? BROADCAST
+            : type < config.broadcastShare + config.statelessShare ?
+                STATELESS_MESSAGE : STATEFUL_MESSAGE;
+    message.source = random() % config.nodes;
+    message.destination = message.source;
+    if(config.nodes > 1) {
+        // Any other node
+        message.destination = (message.source + 1
+                + random() % (config.nodes - 1)) % config.nodes;
+    }
+    message.sendTime = now;
+    message.delivered.assign(config.nodes, false);
+
+    // The payload starts with the message number
+    uint8_t payload[SEGMENTED_MESSAGE_LENGTH_MAX] = {0};
+    uint32_t number = messages.size();
+    memcpy(payload, &number, sizeof(number));
+    uint8_t length = std::max<uint8_t>(config.payloadLength, sizeof(number));
+    length = std::min<uint8_t>(length, FRAME_LENGTH - FRAME_PREFIX_LENGTH - HEADER_SIZE);
+    if(message.type == SEGMENTED_MESSAGE) {
+        length = std::max<uint8_t>(config.segmentedLength, sizeof(number));
+        length = std::min<uint8_t>(length, SEGMENTED_MESSAGE_LENGTH_MAX);
+    }
+    messages.push_back(message);
+    results.types[message.type].sent++;
+
+    currentNode = message.source;
+    MeshContext* ctx = &nodes[message.source].ctx;
+    uint16_t destination = getNodeIdentifier(message.destination);
+    switch(message.type) {
+        case BROADCAST:
+            broadcastMessageCtx(ctx, payload, length);
+            break;
+        case STATELESS_MESSAGE:
+            sendStatelessMessageCtx(ctx, destination, payload, length);
+            break;
+        case SEGMENTED_MESSAGE:
+            // Not sent if the previous one is still unacknowledged
+            sendSegmentedMessageCtx(ctx, destination, payload, length, TRUE);
+            break;
+        default:
+            sendStatefulMessageCtx(ctx, destination, payload, length);
+            break;
+    }
+    schedulePeriodicTask(message.source);
+}
+
+// Runs the periodic task at the earliest protocol timer deadline, as
+// schedulePeriodicTask() in biscuit.c
+void MeshSimulator::schedulePeriodicTask(int i) {
+    SimulatedNode& node = nodes[i];
+    uint32 deadline;
+    uint32_t generation = ++node.periodicTaskGeneration;
+    if(getNextDeadlineCtx(&node.ctx, &deadline)) {
+        schedule(std::max(now, (uint64_t) deadline * 1000), PERIODIC_EVENT,
+                i, generation);
+    }
+}
+
+// Makes sure a forward check is scheduled for when the first queued
+// advertisement is due, as processQueue() in biscuit.c
+void MeshSimulator::scheduleForwardCheck(int i) {
+    SimulatedNode& node = nodes[i];
+    if(node.forwarding || node.restarting || node.queue.empty()) {
+        return;
+    }
+    uint64_t due = std::max(now, node.queue.front().dueTime);
+    if(due < node.forwardCheckTime) {
+        node.forwardCheckTime = due;
+        schedule(due, FORWARD_CHECK_EVENT, i, ++node.forwardCheckGeneration);
+    }
+}
+
+void MeshSimulator::checkForwarding(int i, uint32_t generation) {
+    SimulatedNode& node = nodes[i];
+    if(generation != node.forwardCheckGeneration) {
+        return;
+    }
+    node.forwardCheckTime = NO_TIME;
+    if(node.forwarding || node.restarting || node.queue.empty()) {
+        return;
+    }
+    if(node.queue.front().dueTime > now) {
+        // The first one has been cancelled meanwhile
+        scheduleForwardCheck(i);
+        return;
+    }
+    node.frameLength = buildFrame(i, node.frame, &node.frameTransmissions,
+            &node.frameInterval);
+    startForwarding(i);
+}
+
+// Observing stops and restarts a little later
+void MeshSimulator::startForwarding(int i) {
+    SimulatedNode& node = nodes[i];
+    node.forwarding = true;
+    node.forwardingEnd = now + getHoldTime(node.frameTransmissions,
+            node.frameInterval);
+    pauseObserving(i);
+    schedule(now, ADVERTISING_EVENT, i, node.forwardingGeneration);
+    schedule(node.forwardingEnd, FORWARDING_DONE_EVENT, i,
+            node.forwardingGeneration);
+    scheduleForwardCheck(i);
+}
+
+// Takes the next due advertisement into frame, along with those about due
+// as long as they fit. Returns the length of the frame, it is sent as often
+// and as fast as the most demanding of them asks for.
+uint8_t MeshSimulator::buildFrame(int i, uint8_t* frame,
+        uint8_t* transmissions, uint16_t* transmitInterval) {
+    SimulatedNode& node = nodes[i];
+    size_t next = getNextQueued(i, now);
+    QueuedAdvertisement& first = node.queue[next];
+    uint64_t departure = first.dueTime + config.aggregationWindow * 1000;
+    uint8_t length = first.length;
+    memcpy(&frame[FRAME_PREFIX_LENGTH], first.data, first.length);
+    *transmissions = first.transmissions;
+    *transmitInterval = first.transmitInterval;
+    node.frameMessages.clear();
+    addFrameMessage(i, first.data);
+    node.queue.erase(node.queue.begin() + next);
+    // As in biscuit.c
+    while(config.aggregation && !node.queue.empty()) {
+        next = getNextQueued(i, departure);
+        if(node.queue[next].dueTime > departure) {
+            break;
+        }
+        uint8_t aggregateLength = aggregateMessage(
+                &frame[FRAME_PREFIX_LENGTH], length,
+                node.queue[next].data, node.queue[next].length);
+        if(aggregateLength == 0) {
+            break;
+        }
+        length = aggregateLength;
+        *transmissions = std::max(*transmissions, node.queue[next].transmissions);
+        *transmitInterval = std::min(*transmitInterval,
+                node.queue[next].transmitInterval);
+        addFrameMessage(i, node.queue[next].data);
+        node.queue.erase(node.queue.begin() + next);
+    }
+    return FRAME_PREFIX_LENGTH + length;
+}
+
+void MeshSimulator::addFrameMessage(int i, uint8_t* data) {
+    MessageHeader* header = (MessageHeader*) data;
+    nodes[i].frameMessages.push_back(
+            std::make_pair(header->source, header->sequenceID));
+}
+
+// As getForwardingHoldTime() in biscuit.c
+uint64_t MeshSimulator::getHoldTime(uint8_t transmissions,
+        uint16_t transmitInterval) {
+    if(!config.pipelinedForwarding) {
+        return config.forwardingTime * 1000;
+    }
+    uint64_t period = transmitInterval * 625 + ADVERTISING_DELAY_MAX;
+    return (transmissions - 1) * period + ADVERTISING_EVENT_TIME;
+}
+
+// Advertising stops. With pipelining a due frame goes on air once the 
+// stack has ended advertising.
+void MeshSimulator::endForwarding(int i, uint32_t generation) {
+    SimulatedNode& node = nodes[i];
+    if(!node.forwarding || node.forwardingGeneration != generation) {
+        return;
+    }
+    node.forwarding = false;
+    node.forwardingGeneration++;
+    if(config.pipelinedForwarding && !node.queue.empty()
+            && node.queue.front().dueTime <= now) {
+        node.restarting = true;
+        schedule(now + config.advertisingRestartTime * 1000, 
+                FORWARDING_RESTART_EVENT, i, node.forwardingGeneration);
+        return;
+    }
+    scheduleForwardCheck(i);
+}
+
+// The frame is built from what is still queued, as in biscuit.c
+void MeshSimulator::restartForwarding(int i, uint32_t generation) {
+    SimulatedNode& node = nodes[i];
+    if(node.forwarding || node.forwardingGeneration != generation) {
+        return;
+    }
+    node.restarting = false;
+    node.forwardCheckTime = NO_TIME;
+    node.forwardCheckGeneration++;
+    checkForwarding(i, node.forwardCheckGeneration);
+}
+
+void MeshSimulator::advertise(int i, uint32_t generation) {
+    SimulatedNode& node = nodes[i];
+    if(!node.forwarding || generation != node.forwardingGeneration) {
+        return;
+    }
+    uint64_t packetTime = getPacketTime(node.frameLength);
+    for(int channel = 0; channel < ADVERTISING_CHANNELS; channel++) {
+        schedule(now + channel * (packetTime + CHANNEL_SPACING),
+                PACKET_START_EVENT, i,
+                channel | (generation << 2));
+    }
+
+    // Each advertising event is delayed at random by up to 10 ms
+    uint16_t interval = config.pipelinedForwarding ? node.frameInterval
+            : config.advertisingInterval;
+    uint64_t next = now + interval * 625 + random() % ADVERTISING_DELAY_MAX;
+    if(next + ADVERTISING_CHANNELS * (packetTime + CHANNEL_SPACING)
+                <= node.forwardingEnd) {
+        schedule(next, ADVERTISING_EVENT, i, generation);
+    }
+}
+
+void MeshSimulator::startPacket(int i, uint32_t data) {
+    SimulatedNode& sender = nodes[i];
+    int channel = data & 0x3;
+    if(!sender.forwarding || (data >> 2) != (sender.forwardingGeneration & 0x3FFFFFFF)) {
+        return;
+    }
+    uint64_t packetTime = getPacketTime(sender.frameLength);
+    countPacket(sender.frame, sender.frameLength, packetTime);
+
+    // Half duplex, transmitting aborts a reception
+    sender.transmittingUntil = now + packetTime;
+    if(sender.receiving) {
+        sender.receiving = false;
+        sender.receptionGeneration++;
+    }
+
+    for(size_t n = 0; n < sender.neighbours.size(); n++) {
+        int r = sender.neighbours[n].first;
+        SimulatedNode& receiver = nodes[r];
+        if(receiver.transmittingUntil > now || !isScanning(r, channel)) {
+            results.notScanning++;
+        } else if(receiver.receiving && receiver.receptionEnd > now) {
+            // Both packets are lost
+            receiver.receptionCorrupted = true;
+            results.collisions++;
+        } else {
+            receiver.receiving = true;
+            receiver.receptionGeneration++;
+            receiver.receptionEnd = now + packetTime;
+            receiver.receptionCorrupted = false;
+            receiver.receptionLost = uniform() < sender.neighbours[n].second;
+            memcpy(receiver.receptionFrame, sender.frame, sender.frameLength);
+            receiver.receptionLength = sender.frameLength;
+            receiver.receptionSender = i;
+            schedule(receiver.receptionEnd, PACKET_END_EVENT, r,
+                    receiver.receptionGeneration);
+        }
+    }
+}
+
+void MeshSimulator::endPacket(int i, uint32_t generation) {
+    SimulatedNode& node = nodes[i];
+    if(!node.receiving || generation != node.receptionGeneration) {
+        return;
+    }
+    node.receiving = false;
+    if(node.receptionCorrupted) {
+        results.collisions++;
+    } else if(node.receptionLost) {
+        results.linkLosses++;
+    } else if(config.filterDuplicates
+            && node.reportedIn[node.receptionSender] == node.scanGeneration) {
+        // The controller reports each device once per discovery
+        results.filteredReports++;
+    } else if(config.maxScanResults > 0 && isScanResultTableFull(i)) {
+        // The stack keeps no more devices this discovery
+        results.cappedReports++;
+    } else {
+        if(config.filterDuplicates || config.maxScanResults > 0) {
+            if(node.reportedIn[node.receptionSender] != node.scanGeneration) {
+                node.reportedNodes++;
+            }
+            node.reportedIn[node.receptionSender] = node.scanGeneration;
+        }
+        // Taken at the next start of discovery, as in biscuit.c
+        countScanPacket(&node.scanScheduler);
+        processIncomingMessageCtx(&node.ctx,
+                &node.receptionFrame[FRAME_PREFIX_LENGTH],
+                node.receptionLength - FRAME_PREFIX_LENGTH);
+        schedulePeriodicTask(i);
+    }
+}
+
+// Scanning goes through the advertising channels, one per scan interval, 
+// from the start of the discovery
+bool MeshSimulator::isScanning(int i, int channel) {
+    SimulatedNode& node = nodes[i];
+    if(!node.observing) {
+        return false;
+    }
+    uint64_t interval = node.scanInterval * 625;
+    uint64_t time = now - node.scanStart;
+    return time % interval < (uint64_t) node.scanWindow * 625
+            && (int) ((time / interval) % ADVERTISING_CHANNELS) == channel;
+}
+
+// Starts a discovery, as startObserving() in biscuit.c
+void MeshSimulator::startObserving(int i, uint32_t generation) {
+    SimulatedNode& node = nodes[i];
+    if(node.observing || generation != node.scanGeneration) {
+        return;
+    }
+    node.observing = true;
+    node.scanGeneration++;
+    node.scanStart = now;
+    startScan(&node.scanScheduler, now / 1000, node.queue.size());
+    if(config.adaptiveScanning) {
+        node.scanWindow = getScanWindow(&node.scanScheduler);
+        node.scanInterval = getScanInterval(&node.scanScheduler);
+    } else {
+        node.scanWindow = config.scanWindow;
+        node.scanInterval = config.scanInterval;
+    }
+    schedule(now + config.scanDuration * 1000, SCAN_END_EVENT, i,
+            node.scanGeneration);
+}
+
+// The discovery has run its course, the next one starts once the stack has
+// reported its end
+void MeshSimulator::endObserving(int i, uint32_t generation) {
+    SimulatedNode& node = nodes[i];
+    if(!node.observing || generation != node.scanGeneration) {
+        return;
+    }
+    stopObserving(i);
+    schedule(now + config.scanRestartTime * 1000, SCAN_START_EVENT, i,
+            node.scanGeneration);
+}
+
+// Observing stops, and starts again after observingRestartDelay
+void MeshSimulator::pauseObserving(int i) {
+    SimulatedNode& node = nodes[i];
+    stopObserving(i);
+    node.scanGeneration++;
+    schedule(now + config.observingRestartDelay * 1000, SCAN_START_EVENT, i,
+            node.scanGeneration);
+}
+
+// Whether the sender of the packet being received is a new device, with as
+// many already reported this discovery as the stack keeps
+bool MeshSimulator::isScanResultTableFull(int i) {
+    SimulatedNode& node = nodes[i];
+    if(node.reportedGeneration != node.scanGeneration) {
+        node.reportedGeneration = node.scanGeneration;
+        node.reportedNodes = 0;
+    }
+    return node.reportedIn[node.receptionSender] != node.scanGeneration
+            && node.reportedNodes >= config.maxScanResults;
+}
+
+void MeshSimulator::stopObserving(int i) {
+    SimulatedNode& node = nodes[i];
+    if(!node.observing) {
+        return;
+    }
+    node.observing = false;
+    node.receiving = false;
+    node.receptionGeneration++;
+    node.scanTime += (now - node.scanStart) * node.scanWindow / node.scanInterval;
+    stopScan(&node.scanScheduler, now / 1000);
+}
+
+// A packet counts for every message it carries, which share its airtime
+void MeshSimulator::countPacket(uint8_t* frame, uint8_t frameLength,
+        uint64_t packetTime) {
+    uint8_t* message = &frame[FRAME_PREFIX_LENGTH];
+    uint8_t length = frameLength - FRAME_PREFIX_LENGTH;
+    if(((MessageHeader*) message)->source != AGGREGATE_SOURCE) {
+        MessageHeader* header = (MessageHeader*) message;
+        results.types[header->type].packets++;
+        results.types[header->type].airtime += packetTime;
+        return;
+    }
+    results.aggregatedPackets++;
+    std::vector<int> types;
+    for(uint8_t i = AGGREGATE_HEADER_SIZE; i < length; i += 1 + message[i]) {
+        // Messages lack the network identifier, the header would start 
+        // two bytes earlier
+        types.push_back(((MessageHeader*) &message[i - 1])->type);
+    }
+    for(size_t i = 0; i < types.size(); i++) {
+        results.types[types[i]].packets++;
+        results.types[types[i]].airtime += packetTime / types.size();
+    }
+}
+
+uint64_t MeshSimulator::getPacketTime(uint8_t frameLength) {
+    return (PACKET_OVERHEAD + frameLength) * BYTE_TIME;
+}
+
+// The queued advertisement to send at time, as getNextInAdvertisementQueue()
+size_t MeshSimulator::getNextQueued(int i, uint64_t time) {
+    SimulatedNode& node = nodes[i];
+    if(!config.priorityClasses) {
+        return 0;
+    }
+    for(uint8_t c = 0; c < ADVERTISING_CLASSES; c++) {
+        for(size_t n = 0; n < node.queue.size()
+                && node.queue[n].dueTime <= time; n++) {
+            if(node.queue[n].advertisingClass == c) {
+                return n;
+            }
+        }
+    }
+    return 0;
+}
+
+// Leaves the slots the other classes have reserved and not used, as in
+// advertising_queue.c
+bool MeshSimulator::isAdmitted(int i, uint8_t advertisingClass) {
+    static const uint8_t reserved[ADVERTISING_CLASSES] = {
+        ADVERTISING_QUEUE_CONTROL_RESERVED,
+        ADVERTISING_QUEUE_LOCAL_RESERVED,
+        ADVERTISING_QUEUE_RELAY_RESERVED
+    };
+    SimulatedNode& node = nodes[i];
+    size_t kept = 0;
+    if(config.priorityClasses) {
+        size_t used[ADVERTISING_CLASSES] = {0};
+        for(size_t n = 0; n < node.queue.size(); n++) {
+            used[node.queue[n].advertisingClass]++;
+        }
+        for(uint8_t c = 0; c < ADVERTISING_CLASSES; c++) {
+            if(c != advertisingClass && used[c] < reserved[c]) {
+                kept += reserved[c] - used[c];
+            }
+        }
+    }
+    return node.queue.size() + kept < config.advertisingQueueSize;
+}
+
+void MeshSimulator::advertiseCallback(uint8* data, uint8 length, uint16 delay) {
+    MeshSimulator* simulator = current;
+    SimulatedNode& node = simulator->nodes[simulator->currentNode];
+    MessageHeader* header = (MessageHeader*) data;
+    uint8_t advertisingClass = ADVERTISING_CLASS_RELAY;
+    if(header->type == STATEFUL_MESSAGE_ACK || header->type == SEGMENT_ACK) {
+        advertisingClass = ADVERTISING_CLASS_CONTROL;
+    } else if(header->source == getNodeIdentifier(simulator->currentNode)
+            || header->source == AGGREGATE_SOURCE) {
+        advertisingClass = ADVERTISING_CLASS_LOCAL;
+    }
+    if(!simulator->isAdmitted(simulator->currentNode, advertisingClass)
+            || length > FRAME_LENGTH - FRAME_PREFIX_LENGTH) {
+        simulator->results.queueDrops++;
+        simulator->results.classDrops[advertisingClass]++;
+        return;
+    }
+
+    QueuedAdvertisement advertisement;
+    advertisement.advertisingClass = advertisingClass;
+    advertisement.transmissions = simulator->config.transmissions[advertisingClass];
+    advertisement.transmitInterval = 
+            simulator->config.transmitIntervals[advertisingClass];
+    advertisement.length = length;
+    memcpy(advertisement.data, data, length);
+    advertisement.dueTime = simulator->now + delay * 1000;
+    advertisement.order = node.queueOrder++;
+    // Ordered on due time, then on order of arrival
+    std::vector<QueuedAdvertisement>::iterator position = node.queue.begin();
+    while(position != node.queue.end()
+            && position->dueTime <= advertisement.dueTime) {
+        position++;
+    }
+    node.queue.insert(position, advertisement);
+    simulator->scheduleForwardCheck(simulator->currentNode);
+}
+
+void MeshSimulator::cancelAdvertisementCallback(uint16 source, uint8 sequenceID) {
+    MeshSimulator* simulator = current;
+    SimulatedNode& node = simulator->nodes[simulator->currentNode];
+    for(size_t i = 0; i < node.queue.size(); i++) {
+        MessageHeader* header = (MessageHeader*) node.queue[i].data;
+        if(header->source == source && header->sequenceID == sequenceID) {
+            node.queue.erase(node.queue.begin() + i);
+            return;
+        }
+    }
+    // The transmissions left of a frame on air are cut short once none of
+    // its messages needs them, as in biscuit.c
+    if(!simulator->config.pipelinedForwarding || !node.forwarding) {
+        return;
+    }
+    std::vector<std::pair<uint16_t, uint8_t> >::iterator message = std::find(
+            node.frameMessages.begin(), node.frameMessages.end(),
+            std::make_pair(source, sequenceID));
+    if(message == node.frameMessages.end()) {
+        return;
+    }
+    node.frameMessages.erase(message);
+    if(node.frameMessages.empty()) {
+        simulator->endForwarding(simulator->currentNode,
+                node.forwardingGeneration);
+    }
+}
+
+void MeshSimulator::messageCallback(uint16 source, uint8* message, uint8 length) {
+    MeshSimulator* simulator = current;
+    uint32_t number;
+    if(length < sizeof(number)) {
+        return;
+    }
+    memcpy(&number, message, sizeof(number));
+    if(number >= simulator->messages.size()) {
+        return;
+    }
+    SimulatedMessage& sent = simulator->messages[number];
+    int node = simulator->currentNode;
+    if(node == sent.source) {
+        // The own copy handed back by the protocol
+        return;
+    }
+
+    MessageTypeStatistics& statistics = simulator->results.types[sent.type];
+    if(sent.delivered[node]) {
+        statistics.duplicateDeliveries++;
+        return;
+    }
+    sent.delivered[node] = true;
+    statistics.deliveries++;
+    simulator->results.latencies.push_back(
+            (simulator->now - sent.sendTime) / 1000.0);
+}
+
+uint32 MeshSimulator::getTimestamp() {
+    return current->now / 1000;
+}
+
+uint16 MeshSimulator::getRandom() {
+    return current->random() & 0xFFFF;
+}
+
+SimulationResults runSimulation(const SimulationConfig& config) {
+    MeshSimulator simulator(config);
+    return simulator.run();
+}
+
+double SimulationResults::deliveryRatio() const {
+    uint64_t expected = 0, delivered = 0;
+    for(int i = 0; i <= SEGMENT_ACK; i++) {
+        expected += types[i].expectedDeliveries;
+        delivered += types[i].deliveries;
+    }
+    return expected > 0 ? (double) delivered / expected : 0;
+}
+
+double SimulationResults::latencyPercentile(double percentile) const {
+    if(latencies.empty()) {
+        return 0;
+    }
+    std::vector<double> sorted(latencies);
+    size_t rank = (size_t) (percentile / 100 * (sorted.size() - 1) + 0.5);
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+}
+
+const char* getMessageTypeName(int type) {
+    switch(type) {
+        case BROADCAST: return "broadcast";
+        case GROUP_BROADCAST: return "group";
+        case STATELESS_MESSAGE: return "stateless";
+        case STATEFUL_MESSAGE: return "stateful";
+        case STATEFUL_MESSAGE_ACK: return "ack";
+        case SEGMENTED_MESSAGE: return "segmented";
+        case SEGMENT_ACK: return "block_ack";
+    }
+    return "unknown";
+}
+
+void printSimulationResults(FILE* file, const SimulationResults& results) {
+    fprintf(file, "%-10s %8s %10s %10s %8s %10s %10s %10s\n", "type", "sent",
+            "expected", "delivered", "ratio", "duplicates", "packets", 
+            "airtime_ms");
+    for(int i = 0; i <= SEGMENT_ACK; i++) {
+        const MessageTypeStatistics& statistics = results.types[i];
+        if(statistics.sent == 0 && statistics.packets == 0) {
+            continue;
+        }
+        fprintf(file, "%-10s %8u %10u %10u %8.3f %10u %10u %10.1f\n",
+                getMessageTypeName(i), statistics.sent,
+                statistics.expectedDeliveries, statistics.deliveries,
+                statistics.expectedDeliveries > 0 ?
+                    (double) statistics.deliveries / statistics.expectedDeliveries : 0,
+                statistics.duplicateDeliveries, statistics.packets, statistics.airtime / 1000.0);
+    }
+    fprintf(file, "delivery ratio %.3f\n", results.deliveryRatio());
+    fprintf(file, "latency ms p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+            results.latencyPercentile(50), results.latencyPercentile(90),
+            results.latencyPercentile(99), results.latencyPercentile(100));
+    fprintf(file, "links %u, packets missed: not scanning %u, collisions %u, "
+            "link loss %u, queue drops %u, aggregated packets %u\n", 
+            results.links, results.notScanning, results.collisions, 
+            results.linkLosses, results.queueDrops, results.aggregatedPackets);
+    fprintf(file, "queue drops: control %u, local %u, relay %u\n",
+            results.classDrops[ADVERTISING_CLASS_CONTROL],
+            results.classDrops[ADVERTISING_CLASS_LOCAL],
+            results.classDrops[ADVERTISING_CLASS_RELAY]);
+    fprintf(file, "scanning: duty cycle %.3f, duplicate reports filtered %u, "
+            "reports over the result cap %u, scan scheduler packets heard %u, "
+            "estimated missed %u\n",
+            results.scanDutyCycle, results.filteredReports, results.cappedReports,
+            results.receivedScanPackets, results.missedScanPackets);
+    fprintf(file, "periodic tasks %u\n", results.periodicTasks);
+}
@@ -0,0 +1,180 @@
+/*
+ * File:   MeshSimulator.h
+ *
+ * Discrete-event simulation of a network of Biscuit nodes, each running its
+ * own instance of the mesh protocol on a virtual clock. The radio is modelled
+ * after biscuit.c: advertisements are queued with the delay asked for by the
+ * protocol, each one is advertised for FORWARDING_REPEAT_COUNT events at the
+ * advertising interval on the three advertising channels, and nodes hear them only while
+ * scanning on the same channel without colliding packets.
+ *
+ * Built on the TEST_FLAG host build of the protocol, e.g.
+ *
+ *   gcc -std=gnu99 -O2 -DTEST_FLAG -c mesh_transport_network_protocol.c \
+ *       scan_scheduler.c
+ *   g++ -O2 -DTEST_FLAG MeshSimulator.cpp SimulatorMain.cpp \
+ *       mesh_transport_network_protocol.o scan_scheduler.o -o meshsim
+ */
+
+#ifndef MESHSIMULATOR_H
+#define	MESHSIMULATOR_H
+#include "mesh_transport_network_protocol.h"
+#include "advertising_queue.h"
+#include "scan_scheduler.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+enum TopologyType
+{
+    FULL_TOPOLOGY = 0,
+    LINE_TOPOLOGY,
+    GRID_TOPOLOGY,
+    // Nodes placed at random in a unit square, linked when within radius
+    RANDOM_TOPOLOGY
+};
+
+struct SimulationLink
+{
+    // Node indices, starting at 0
+    uint16_t from, to;
+    // Probability that a packet is lost on the link, in both directions
+    double loss;
+};
+
+struct SimulationConfig
+{
+    int nodes = 16;
+    TopologyType topology = GRID_TOPOLOGY;
+    double radius = 0.35;
+    // Loss on every generated link
+    double linkLoss = 0.1;
+    // Replaces the generated topology when not empty
+    std::vector<SimulationLink> links;
+    uint64_t seed = 1;
+
+    // Messages are sent during duration ms, after which the network gets
+    // drainTime ms to deliver what is in flight
+    uint32_t duration = 60000;
+    uint32_t drainTime = 20000;
+    // Messages per second sent by the whole network and the share of each
+    // type, the rest being stateful messages
+    double messageRate = 2;
+    double broadcastShare = 0.4;
+    double statelessShare = 0.3;
+    // At least 4, room for the message number
+    uint8_t payloadLength = 8;
+    // Share of the messages sent as acknowledged segmented messages of 
+    // segmentedLength bytes, taken before the shares above
+    double segmentedShare = 0;
+    uint8_t segmentedLength = 200;
+
+    // Radio timing as configured in biscuit.c, intervals in 0.625 ms units
+    // and times in ms
+    uint16_t advertisingInterval = 70;
+    // Discoveries last scanDuration, and the next one starts scanRestartTime
+    // after. With adaptive scanning the scan window and interval are those
+    // of the scan scheduler of the node, otherwise the ones below. With
+    // duplicates filtered each node is heard at most once per discovery.
+    // With maxScanResults set, the stack keeps that many devices per
+    // discovery and drops the reports of any other, otherwise every report
+    // is streamed as with the observer profile in biscuit.c.
+    bool adaptiveScanning = true;
+    bool filterDuplicates = false;
+    uint8_t maxScanResults = 0;
+    uint16_t scanDuration = SCAN_DURATION;
+    uint16_t scanRestartTime = 5;
+    uint16_t scanWindow = 30;
+    uint16_t scanInterval = 35;
+    // Each forwarded frame is held on air for as many advertising events, 
+    // at the interval, as asked for by the class of its messages. When the
+    // next one is due by then it is built and goes on air once the stack 
+    // has ended advertising, which takes advertisingRestartTime, as in 
+    // biscuit.c. Without pipelining every frame is held for forwardingTime
+    // at advertisingInterval, and the next one is built after it.
+    bool pipelinedForwarding = true;
+    // By AdvertisingClass
+    uint8_t transmissions[ADVERTISING_CLASSES] = {
+        ADVERTISING_CONTROL_TRANSMISSIONS, ADVERTISING_LOCAL_TRANSMISSIONS,
+        ADVERTISING_RELAY_TRANSMISSIONS
+    };
+    uint16_t transmitIntervals[ADVERTISING_CLASSES] = {
+        ADVERTISING_CONTROL_INTERVAL, ADVERTISING_LOCAL_INTERVAL,
+        ADVERTISING_RELAY_INTERVAL
+    };
+    uint16_t advertisingRestartTime = 2;
+    uint16_t forwardingTime = 90;
+    uint16_t observingRestartDelay = 15;
+    // Queued messages due within this many ms of the first are sent in the
+    // same advertisement when they fit
+    bool aggregation = true;
+    uint16_t aggregationWindow = 20;
+    // Delay of the first periodic task, later ones follow the protocol timers
+    uint16_t periodicTaskPeriod = 2500;
+    uint8_t advertisingQueueSize = 16;
+    // Due ACKs go before messages of the node, which go before relays, and 
+    // each class has slots reserved as in advertising_queue.c
+    bool priorityClasses = true;
+    RelaySuppressionMode relaySuppression = RELAY_SUPPRESSION_FIXED;
+    // Used by the fixed relay suppression
+    uint8_t countThreshold = 4;
+    uint16_t backoffInterval = 40;
+    uint8_t messageTTL = MESSAGE_TTL_DEFAULT;
+    bool unicastRouting = true;
+};
+
+struct MessageTypeStatistics
+{
+    // Messages sent by the applications
+    uint32_t sent;
+    // Node and message pairs that should see a delivery, and those that did
+    uint32_t expectedDeliveries;
+    uint32_t deliveries;
+    // Deliveries of a message a node already had
+    uint32_t duplicateDeliveries;
+    // Advertising packets on air carrying the type, and their airtime
+    uint32_t packets;
+    uint64_t airtime;
+};
+
+struct SimulationResults
+{
+    // Indexed by MessageType
+    MessageTypeStatistics types[SEGMENT_ACK + 1];
+    // End to end latency of every delivery in ms
+    std::vector<double> latencies;
+    // Packets that reached a node but weren't received
+    uint32_t collisions;
+    uint32_t linkLosses;
+    uint32_t notScanning;
+    // Packets dropped by the duplicate filter of the controller
+    uint32_t filteredReports;
+    // Reports dropped as the scan result table of the stack was full
+    uint32_t cappedReports;
+    // Mean share of the time the nodes spent within scan windows, and the
+    // packet counters of their scan schedulers, which only know the duty
+    // cycle with adaptive scanning
+    double scanDutyCycle;
+    uint32_t receivedScanPackets;
+    uint32_t missedScanPackets;
+    // Advertisements dropped since the queue was full, in total and by 
+    // AdvertisingClass
+    uint32_t queueDrops;
+    uint32_t classDrops[ADVERTISING_CLASSES];
+    // Packets carrying several messages
+    uint32_t aggregatedPackets;
+    // Periodic task runs, as scheduled from the protocol timers
+    uint32_t periodicTasks;
+    uint32_t links;
+
+    double deliveryRatio() const;
+    double latencyPercentile(double percentile) const;
+};
+
+SimulationResults runSimulation(const SimulationConfig& config);
+
+void printSimulationResults(FILE* file, const SimulationResults& results);
+
+const char* getMessageTypeName(int type);
+
+#endif	/* MESHSIMULATOR_H */
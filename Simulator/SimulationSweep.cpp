@@ -0,0 +1,165 @@
+/*
+ * File:   SimulationSweep.cpp
+ */
+
+#include "SimulationSweep.h"
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Pending runs of one worker. The owner takes from the back, idle workers
+// steal from the front.
+struct SweepWorkQueue
+{
+    std::mutex lock;
+    std::deque<size_t> runs;
+};
+
+class SweepPool
+{
+public:
+    SweepPool(const std::vector<SimulationConfig>& configs,
+            std::vector<SimulationResults>& results, unsigned threads);
+    void run();
+
+private:
+    const std::vector<SimulationConfig>& configs;
+    std::vector<SimulationResults>& results;
+    std::vector<SweepWorkQueue> queues;
+
+    void work(unsigned worker);
+    bool takeOwn(unsigned worker, size_t* run);
+    bool steal(unsigned worker, size_t* run);
+};
+
+SweepPool::SweepPool(const std::vector<SimulationConfig>& configs,
+        std::vector<SimulationResults>& results, unsigned threads)
+    : configs(configs), results(results), queues(threads) {
+    // Deal the runs out like cards, so that neighbouring grid points, which
+    // tend to cost about the same, end up on different workers
+    for(size_t i = 0; i < configs.size(); i++) {
+        queues[i % threads].runs.push_back(i);
+    }
+}
+
+void SweepPool::run() {
+    std::vector<std::thread> workers;
+    for(unsigned i = 1; i < queues.size(); i++) {
+        workers.push_back(std::thread(&SweepPool::work, this, i));
+    }
+    work(0);
+    for(size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void SweepPool::work(unsigned worker) {
+    size_t run;
+    // No runs are added once started, so there is nothing left to do when
+    // all queues are found empty
+    while(takeOwn(worker, &run) || steal(worker, &run)) {
+        results[run] = runSimulation(configs[run]);
+    }
+}
+
+bool SweepPool::takeOwn(unsigned worker, size_t* run) {
+    SweepWorkQueue& queue = queues[worker];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if(queue.runs.empty()) {
+        return false;
+    }
+    *run = queue.runs.back();
+    queue.runs.pop_back();
+    return true;
+}
+
+bool SweepPool::steal(unsigned worker, size_t* run) {
+    for(unsigned i = 1; i < queues.size(); i++) {
+        SweepWorkQueue& victim = queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if(!victim.runs.empty()) {
+            *run = victim.runs.front();
+            victim.runs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<SimulationConfig> expandSweepGrid(const SimulationConfig& base,
+        const SweepGrid& grid) {
+    std::vector<SimulationConfig> configs;
+    // An empty list keeps the value of the base configuration
+    size_t nodes = grid.nodes.empty() ? 1 : grid.nodes.size();
+    size_t suppressions = grid.relaySuppressions.empty() ? 1 : grid.relaySuppressions.size();
+    size_t thresholds = grid.countThresholds.empty() ? 1 : grid.countThresholds.size();
+    size_t backoffs = grid.backoffIntervals.empty() ? 1 : grid.backoffIntervals.size();
+    size_t losses = grid.linkLosses.empty() ? 1 : grid.linkLosses.size();
+    size_t seeds = grid.seeds.empty() ? 1 : grid.seeds.size();
+    for(size_t n = 0; n < nodes; n++)
+    for(size_t r = 0; r < suppressions; r++)
+    for(size_t t = 0; t < thresholds; t++)
+    for(size_t b = 0; b < backoffs; b++)
+    for(size_t l = 0; l < losses; l++)
+    for(size_t s = 0; s < seeds; s++) {
+        SimulationConfig config = base;
+        if(!grid.nodes.empty()) config.nodes = grid.nodes[n];
+        if(!grid.relaySuppressions.empty()) config.relaySuppression = grid.relaySuppressions[r];
+        if(!grid.countThresholds.empty()) config.countThreshold = grid.countThresholds[t];
+        if(!grid.backoffIntervals.empty()) config.backoffInterval = grid.backoffIntervals[b];
+        if(!grid.linkLosses.empty()) config.linkLoss = grid.linkLosses[l];
+        if(!grid.seeds.empty()) config.seed = grid.seeds[s];
+        configs.push_back(config);
+    }
+    return configs;
+}
+
+std::vector<SimulationResults> runSweep(
+        const std::vector<SimulationConfig>& configs, unsigned threads) {
+    std::vector<SimulationResults> results(configs.size());
+    if(threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if(threads == 0) {
+        threads = 1;
+    }
+    if(threads > configs.size() && !configs.empty()) {
+        threads = configs.size();
+    }
+    SweepPool pool(configs, results, threads);
+    pool.run();
+    return results;
+}
+
+void printSweepCsvHeader(FILE* file) {
+    fprintf(file, "nodes,suppression,count_threshold,backoff_interval,link_loss,seed,"
+            "delivery_ratio,latency_p50,latency_p90,latency_p99,links,"
+            "collisions,link_losses,queue_drops");
+    for(int i = 0; i <= SEGMENT_ACK; i++) {
+        const char* name = getMessageTypeName(i);
+        fprintf(file, ",%s_sent,%s_delivered,%s_packets,%s_airtime_ms",
+                name, name, name, name);
+    }
+    fprintf(file, "\n");
+}
+
+void printSweepCsvRow(FILE* file, const SimulationConfig& config,
+        const SimulationResults& results) {
+    fprintf(file, "%d,%s,%u,%u,%g,%llu,%.4f,%.1f,%.1f,%.1f,%u,%u,%u,%u",
+            config.nodes,
+            config.relaySuppression == RELAY_SUPPRESSION_ADAPTIVE ?
+                "adaptive" : "fixed",
+            config.countThreshold, config.backoffInterval,
+            config.linkLoss, (unsigned long long) config.seed,
+            results.deliveryRatio(), results.latencyPercentile(50),
+            results.latencyPercentile(90), results.latencyPercentile(99),
+            results.links, results.collisions, results.linkLosses,
+            results.queueDrops);
+    for(int i = 0; i <= SEGMENT_ACK; i++) {
+        const MessageTypeStatistics& statistics = results.types[i];
+        fprintf(file, ",%u,%u,%u,%.1f", statistics.sent,
+                statistics.deliveries, statistics.packets,
+                statistics.airtime / 1000.0);
+    }
+    fprintf(file, "\n");
+}
@@ -0,0 +1,39 @@
+/*
+ * File:   SimulationSweep.h
+ *
+ * Runs many independent simulations in parallel. Every run only depends on
+ * its own configuration and seed, so the results are the same whatever the
+ * number of threads.
+ */
+
+#ifndef SIMULATIONSWEEP_H
+#define	SIMULATIONSWEEP_H
+#include "MeshSimulator.h"
+#include <vector>
+
+struct SweepGrid
+{
+    // Every combination of the values below is run once per seed
+    std::vector<int> nodes;
+    std::vector<RelaySuppressionMode> relaySuppressions;
+    std::vector<uint8_t> countThresholds;
+    std::vector<uint16_t> backoffIntervals;
+    std::vector<double> linkLosses;
+    std::vector<uint64_t> seeds;
+};
+
+// One configuration per grid point, based on the given configuration
+std::vector<SimulationConfig> expandSweepGrid(const SimulationConfig& base,
+        const SweepGrid& grid);
+
+// Runs all configurations on threads threads, 0 meaning one per core.
+// results[i] belongs to configs[i].
+std::vector<SimulationResults> runSweep(
+        const std::vector<SimulationConfig>& configs, unsigned threads);
+
+void printSweepCsvHeader(FILE* file);
+
+void printSweepCsvRow(FILE* file, const SimulationConfig& config,
+        const SimulationResults& results);
+
+#endif	/* SIMULATIONSWEEP_H */
@@ -0,0 +1,205 @@
+/*
+ * File:   SimulatorMain.cpp
+ *
+ * Runs one simulation and prints the results, e.g.
+ *
+ *   meshsim --nodes 25 --topology grid --loss 0.1 --rate 4 --seed 3
+ *
+ * Links can be given in a file with one "from to loss" line per link, node
+ * indices starting at 0.
+ */
+
+#include "MeshSimulator.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void printUsage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --nodes n             number of nodes\n"
+            "  --topology t          full, line, grid or random\n"
+            "  --radius r            link range of the random topology\n"
+            "  --loss p              packet loss on every link\n"
+            "  --links file          links as \"from to loss\" lines\n"
+            "  --duration ms         time during which messages are sent\n"
+            "  --drain ms            time to settle afterwards\n"
+            "  --rate n              messages per second in the network\n"
+            "  --mix b,s             broadcast and stateless shares, the\n"
+            "                        rest is stateful\n"
+            "  --payload n           payload length\n"
+            "  --segmented p,n       share of segmented messages and their\n"
+            "                        length\n"
+            "  --suppression m       relay suppression, fixed or adaptive\n"
+            "  --count-threshold n   receptions before a relay is cancelled\n"
+            "  --ttl n               hops a message may take\n"
+            "  --routing on|off      route unicasts, or flood them\n"
+            "  --aggregation on|off  several messages per advertisement\n"
+            "  --priority on|off     ACKs and own messages before relays\n"
+            "  --pipelining on|off   hold frames by class, the next one follows\n"
+            "                        as soon as advertising has ended\n"
+            "  --repeats c,l,r       advertising events per forwarded frame,\n"
+            "                        for ACKs, own messages and relays\n"
+            "  --intervals c,l,r     their advertising intervals, in units\n"
+            "                        of 0.625 ms\n"
+            "  --adaptive-scan on|off\n"
+            "                        scan duty cycle from the scan scheduler\n"
+            "  --scan-duration ms    length of a discovery\n"
+            "  --filter-duplicates on|off\n"
+            "                        one report per node and discovery\n"
+            "  --max-scan-results n  devices reported per discovery, 0 for\n"
+            "                        no limit\n"
+            "  --seed n              random seed\n", program);
+}
+
+static bool parseTopology(const char* name, TopologyType* topology) {
+    const char* names[] = {"full", "line", "grid", "random"};
+    for(int i = 0; i < 4; i++) {
+        if(strcmp(name, names[i]) == 0) {
+            *topology = (TopologyType) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool readLinks(const char* fileName, std::vector<SimulationLink>* links) {
+    FILE* file = fopen(fileName, "r");
+    if(file == NULL) {
+        return false;
+    }
+    unsigned from, to;
+    double loss;
+    while(fscanf(file, "%u %u %lf", &from, &to, &loss) == 3) {
+        SimulationLink link = {(uint16_t) from, (uint16_t) to, loss};
+        links->push_back(link);
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    SimulationConfig config;
+    for(int i = 1; i < argc; i++) {
+        const char* option = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if(value == NULL) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        i++;
+        if(strcmp(option, "--nodes") == 0) {
+            config.nodes = atoi(value);
+        } else if(strcmp(option, "--topology") == 0) {
+            if(!parseTopology(value, &config.topology)) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(option, "--radius") == 0) {
+            config.radius = atof(value);
+        } else if(strcmp(option, "--loss") == 0) {
+            config.linkLoss = atof(value);
+        } else if(strcmp(option, "--links") == 0) {
+            if(!readLinks(value, &config.links)) {
+                fprintf(stderr, "cannot read %s\n", value);
+                return 1;
+            }
+        } else if(strcmp(option, "--duration") == 0) {
+            config.duration = strtoul(value, NULL, 10);
+        } else if(strcmp(option, "--drain") == 0) {
+            config.drainTime = strtoul(value, NULL, 10);
+        } else if(strcmp(option, "--rate") == 0) {
+            config.messageRate = atof(value);
+        } else if(strcmp(option, "--mix") == 0) {
+            if(sscanf(value, "%lf,%lf", &config.broadcastShare,
+                    &config.statelessShare) != 2) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(option, "--payload") == 0) {
+            config.payloadLength = atoi(value);
+        } else if(strcmp(option, "--segmented") == 0) {
+            unsigned length = config.segmentedLength;
+            if(sscanf(value, "%lf,%u", &config.segmentedShare, &length) < 1) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            config.segmentedLength = length;
+        } else if(strcmp(option, "--suppression") == 0) {
+            if(strcmp(value, "fixed") == 0) {
+                config.relaySuppression = RELAY_SUPPRESSION_FIXED;
+            } else if(strcmp(value, "adaptive") == 0) {
+                config.relaySuppression = RELAY_SUPPRESSION_ADAPTIVE;
+            } else {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if(strcmp(option, "--count-threshold") == 0) {
+            config.countThreshold = atoi(value);
+        } else if(strcmp(option, "--ttl") == 0) {
+            config.messageTTL = atoi(value);
+        } else if(strcmp(option, "--routing") == 0) {
+            config.unicastRouting = strcmp(value, "off") != 0;
+        } else if(strcmp(option, "--aggregation") == 0) {
+            config.aggregation = strcmp(value, "off") != 0;
+        } else if(strcmp(option, "--priority") == 0) {
+            config.priorityClasses = strcmp(value, "off") != 0;
+        } else if(strcmp(option, "--pipelining") == 0) {
+            config.pipelinedForwarding = strcmp(value, "off") != 0;
+        } else if(strcmp(option, "--repeats") == 0) {
+            unsigned repeats[ADVERTISING_CLASSES];
+            if(sscanf(value, "%u,%u,%u", &repeats[0], &repeats[1],
+                    &repeats[2]) != ADVERTISING_CLASSES) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            for(int c = 0; c < ADVERTISING_CLASSES; c++) {
+                config.transmissions[c] = repeats[c];
+            }
+        } else if(strcmp(option, "--intervals") == 0) {
+            unsigned intervals[ADVERTISING_CLASSES];
+            if(sscanf(value, "%u,%u,%u", &intervals[0], &intervals[1],
+                    &intervals[2]) != ADVERTISING_CLASSES) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            for(int c = 0; c < ADVERTISING_CLASSES; c++) {
+                config.transmitIntervals[c] = intervals[c];
+            }
+        } else if(strcmp(option, "--adaptive-scan") == 0) {
+            config.adaptiveScanning = strcmp(value, "off") != 0;
+        } else if(strcmp(option, "--scan-duration") == 0) {
+            config.scanDuration = atoi(value);
+        } else if(strcmp(option, "--filter-duplicates") == 0) {
+            config.filterDuplicates = strcmp(value, "off") != 0;
+        } else if(strcmp(option, "--max-scan-results") == 0) {
+            config.maxScanResults = atoi(value);
+        } else if(strcmp(option, "--seed") == 0) {
+            config.seed = strtoull(value, NULL, 10);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    for(int c = 0; c < ADVERTISING_CLASSES; c++) {
+        if(config.transmissions[c] < 1) {
+            fprintf(stderr, "--repeats must be at least 1\n");
+            return 1;
+        }
+        if(config.transmitIntervals[c] < 32) {
+            fprintf(stderr, "--intervals must be at least 32\n");
+            return 1;
+        }
+    }
+    if(config.scanDuration < 1) {
+        fprintf(stderr, "--scan-duration must be at least 1\n");
+        return 1;
+    }
+    if(config.nodes < 1 || config.nodes > 0xFFFE) {
+        fprintf(stderr, "--nodes must be between 1 and 65534\n");
+        return 1;
+    }
+
+    SimulationResults results = runSimulation(config);
+    printSimulationResults(stdout, results);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * File:   SweepMain.cpp
+ *
+ * Runs a simulation for every point of a parameter grid and writes one CSV
+ * row per run, e.g.
+ *
+ *   meshsweep --nodes 16,36,64 --count-threshold 2,3,4 --backoff 20,40,80 \
+ *       --loss 0,0.1,0.3 --seeds 10 --output sweep.csv
+ *
+ * Lists are comma separated. The rows come in grid order and are the same
+ * for any --threads. Built like the simulator, with
+ *
+ *   g++ -O2 -pthread -DTEST_FLAG MeshSimulator.cpp SimulationSweep.cpp \
+ *       SweepMain.cpp mesh_transport_network_protocol.o -o meshsweep
+ */
+
+#include "SimulationSweep.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void printUsage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --nodes list            numbers of nodes\n"
+            "  --suppression list      relay suppressions, fixed or adaptive\n"
+            "  --count-threshold list  receptions before a relay is cancelled\n"
+            "  --backoff list          relay backoff intervals in ms\n"
+            "  --loss list             packet loss on every link\n"
+            "  --seeds n               run every point with seeds 1 .. n\n"
+            "  --topology t            full, line, grid or random\n"
+            "  --radius r              link range of the random topology\n"
+            "  --duration ms           time during which messages are sent\n"
+            "  --drain ms              time to settle afterwards\n"
+            "  --rate n                messages per second in the network\n"
+            "  --threads n             worker threads, default one per core\n"
+            "  --output file           CSV file, default standard output\n",
+            program);
+}
+
+template <typename T>
+static std::vector<T> parseList(const char* value) {
+    std::vector<T> list;
+    char* end = (char*) value;
+    while(*end != '\0') {
+        list.push_back((T) strtod(end, &end));
+        if(*end == ',') {
+            end++;
+        } else if(*end != '\0') {
+            // Not a number
+            list.clear();
+            break;
+        }
+    }
+    return list;
+}
+
+int main(int argc, char** argv) {
+    SimulationConfig base;
+    SweepGrid grid;
+    unsigned threads = 0;
+    const char* output = NULL;
+    const char* topologies[] = {"full", "line", "grid", "random"};
+
+    for(int i = 1; i < argc; i += 2) {
+        const char* option = argv[i];
+        const char* value = argv[i + 1];
+        bool valid = true;
+        if(value == NULL) {
+            valid = false;
+        } else if(strcmp(option, "--nodes") == 0) {
+            grid.nodes = parseList<int>(value);
+            valid = !grid.nodes.empty();
+        } else if(strcmp(option, "--suppression") == 0) {
+            grid.relaySuppressions.clear();
+            if(strstr(value, "fixed") != NULL) {
+                grid.relaySuppressions.push_back(RELAY_SUPPRESSION_FIXED);
+            }
+            if(strstr(value, "adaptive") != NULL) {
+                grid.relaySuppressions.push_back(RELAY_SUPPRESSION_ADAPTIVE);
+            }
+            valid = !grid.relaySuppressions.empty();
+        } else if(strcmp(option, "--count-threshold") == 0) {
+            grid.countThresholds = parseList<uint8_t>(value);
+            valid = !grid.countThresholds.empty();
+        } else if(strcmp(option, "--backoff") == 0) {
+            grid.backoffIntervals = parseList<uint16_t>(value);
+            valid = !grid.backoffIntervals.empty();
+        } else if(strcmp(option, "--loss") == 0) {
+            grid.linkLosses = parseList<double>(value);
+            valid = !grid.linkLosses.empty();
+        } else if(strcmp(option, "--seeds") == 0) {
+            for(int seed = 1; seed <= atoi(value); seed++) {
+                grid.seeds.push_back(seed);
+            }
+        } else if(strcmp(option, "--topology") == 0) {
+            valid = false;
+            for(int t = 0; t < 4; t++) {
+                if(strcmp(value, topologies[t]) == 0) {
+                    base.topology = (TopologyType) t;
+                    valid = true;
+                }
+            }
+        } else if(strcmp(option, "--radius") == 0) {
+            base.radius = atof(value);
+        } else if(strcmp(option, "--duration") == 0) {
+            base.duration = strtoul(value, NULL, 10);
+        } else if(strcmp(option, "--drain") == 0) {
+            base.drainTime = strtoul(value, NULL, 10);
+        } else if(strcmp(option, "--rate") == 0) {
+            base.messageRate = atof(value);
+        } else if(strcmp(option, "--threads") == 0) {
+            threads = atoi(value);
+        } else if(strcmp(option, "--output") == 0) {
+            output = value;
+        } else {
+            valid = false;
+        }
+        if(!valid) {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    for(size_t i = 0; i < grid.nodes.size(); i++) {
+        if(grid.nodes[i] < 1 || grid.nodes[i] > 0xFFFE) {
+            fprintf(stderr, "--nodes must be between 1 and 65534\n");
+            return 1;
+        }
+    }
+
+    FILE* file = stdout;
+    if(output != NULL && (file = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "cannot write %s\n", output);
+        return 1;
+    }
+    std::vector<SimulationConfig> configs = expandSweepGrid(base, grid);
+    std::vector<SimulationResults> results = runSweep(configs, threads);
+    printSweepCsvHeader(file);
+    for(size_t i = 0; i < configs.size(); i++) {
+        printSweepCsvRow(file, configs[i], results[i]);
+    }
+    if(file != stdout) {
+        fclose(file);
+    }
+    return 0;
+}
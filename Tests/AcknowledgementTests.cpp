@@ -0,0 +1,128 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static const uint16 peer = 0x0100;
+static int cancelCalls;
+static uint16 lastDelay;
+static uint8 lastLength;
+
+static void cancelCallback(uint16 source, uint8 sequenceID) {
+    cancelCalls++;
+}
+
+static void recordingAdvertiseCallback(uint8* data, uint8 length, uint16 delay) {
+    lastDelay = delay;
+    lastLength = length;
+    TNPTest::advertiseCallback(data, length, delay);
+}
+
+static void initializeRecordingProtocol(uint16 nodeId) {
+    cancelCalls = 0;
+    initializeMeshConnectionProtocol(TNPTest::networkID, nodeId, 
+            &recordingAdvertiseCallback, 
+            &TNPTest::messageCallback,
+            &TNPTest::getTimestamp,
+            &TNPTest::getRandom,
+            &cancelCallback);
+}
+
+static void receiveStateful(uint8 sequenceID) {
+    uint8 message[HEADER_SIZE + 1] = {0};
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = TNPTest::networkID;
+    header->source = peer;
+    header->destination = TNPTest::nodeId;
+    header->type = STATEFUL_MESSAGE;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->sequenceID = sequenceID;
+    processIncomingMessage(message, HEADER_SIZE + 1);
+}
+
+static uint8* lastAdvertisement() {
+    return TNPTest::advertisingData[TNPTest::advertisingCalls - 1];
+}
+
+TEST_F(TNPTest, DeferredACKCoversSeveralMessages) {
+    initializeRecordingProtocol(TNPTest::nodeId);
+    
+    receiveStateful(5);
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    ASSERT_EQ(100, lastDelay);
+    
+    // Each one replaces the queued ACK, which keeps its deadline
+    TNPTest::timestamp += 30;
+    receiveStateful(8);
+    receiveStateful(6);
+    ASSERT_EQ(3, TNPTest::advertisingCalls);
+    ASSERT_EQ(2, cancelCalls);
+    ASSERT_EQ(70, lastDelay);
+    TNPTest::validateHeaderData(TNPTest::networkID, TNPTest::nodeId, peer, 
+            STATEFUL_MESSAGE_ACK, lastAdvertisement());
+    ASSERT_EQ(8, lastAdvertisement()[HEADER_SIZE]);
+    ASSERT_EQ(0x06, lastAdvertisement()[HEADER_SIZE + 1]);
+    
+    // Too far apart to be covered by the same ACK
+    receiveStateful(20);
+    ASSERT_EQ(2, cancelCalls);
+    ASSERT_EQ(20, lastAdvertisement()[HEADER_SIZE]);
+    ASSERT_EQ(0, lastAdvertisement()[HEADER_SIZE + 1]);
+    
+    // Once an ACK has left it isn't replaced
+    TNPTest::timestamp += 100;
+    receiveStateful(21);
+    ASSERT_EQ(2, cancelCalls);
+    ASSERT_EQ(0, lastAdvertisement()[HEADER_SIZE + 1]);
+}
+
+TEST_F(TNPTest, ACKGoesAlongWithMessage) {
+    initializeRecordingProtocol(TNPTest::nodeId);
+    uint8 data[3] = {1, 2, 3};
+    receiveStateful(5);
+    
+    sendStatelessMessage(peer, data, 3);
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+    ASSERT_EQ(1, cancelCalls);
+    ASSERT_EQ(AGGREGATE_SOURCE, ((MessageHeader*) lastAdvertisement())->source);
+    
+    // The next one goes alone
+    sendStatelessMessage(peer, data, 3);
+    ASSERT_EQ(HEADER_SIZE + 3, lastLength);
+    ASSERT_NE(AGGREGATE_SOURCE, ((MessageHeader*) lastAdvertisement())->source);
+}
+
+TEST_F(TNPTest, BlockACKClearsPendingACKs) {
+    uint8 data[3] = {1, 2, 3};
+    TNPTest::initializeProtocol(TNPTest::networkID, peer);
+    for(int i = 0; i < 3; i++) {
+        sendStatefulMessage(TNPTest::nodeId, data, 3);
+    }
+    sendStatefulMessage(0x0200, data, 3);
+    
+    // The receiver answers all three with one ACK, along with a message
+    initializeRecordingProtocol(TNPTest::nodeId);
+    for(int i = 0; i < 3; i++) {
+        processIncomingMessage(TNPTest::advertisingData[i], HEADER_SIZE + 3);
+    }
+    ASSERT_EQ(3, TNPTest::messageCallbacks);
+    sendStatelessMessage(peer, data, 3);
+    uint8 aggregate[MESSAGE_LENGTH_MAX];
+    uint8 aggregateLength = lastLength;
+    memcpy(aggregate, lastAdvertisement(), aggregateLength);
+    
+    TNPTest::initializeProtocol(TNPTest::networkID, peer);
+    for(int i = 0; i < 3; i++) {
+        sendStatefulMessage(TNPTest::nodeId, data, 3);
+    }
+    sendStatefulMessage(0x0200, data, 3);
+    TNPTest::resetRecords();
+    processIncomingMessage(aggregate, aggregateLength);
+    ASSERT_EQ(1, TNPTest::messageCallbacks);
+    
+    // Only the message to the other node is resent
+    TNPTest::timestamp += 5001;
+    periodicTask();
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    TNPTest::validateHeaderData(TNPTest::networkID, peer, 0x0200, 
+            STATEFUL_MESSAGE, TNPTest::advertisingData[0]);
+}
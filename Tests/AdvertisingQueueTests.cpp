@@ -0,0 +1,276 @@
+#include "advertising_queue.h"
+#include "mesh_transport_network_protocol.h"
+#include <gtest/gtest.h>
+#include <stdlib.h>
+
+static uint8 framePrefix[ADVERTISING_FRAME_PREFIX_LENGTH] = {0x02, 0x01, 0x06, 27};
+
+static uint8 enqueueTypedMessage(uint16 source, uint8 sequenceID, 
+        MessageType type, uint32 timeStamp) {
+    uint8 data[sizeof(MessageHeader) + 1] = {0};
+    MessageHeader* header = (MessageHeader*) data;
+    header->source = source;
+    header->sequenceID = sequenceID;
+    header->type = type;
+    data[sizeof(MessageHeader)] = sequenceID;
+    return enqueueAdvertisement(sizeof(data), data, timeStamp);
+}
+
+static void enqueueMessage(uint16 source, uint8 sequenceID, uint32 timeStamp) {
+    ASSERT_TRUE(enqueueTypedMessage(source, sequenceID, BROADCAST, timeStamp));
+}
+
+static uint8 firstSequenceID() {
+    return ((MessageHeader*) getFirstInAdvertisementQueue()->data)->sequenceID;
+}
+
+TEST(AdvertisingQueueTest, OrderedByTimeStamp) {
+    initializeAdvertisementQueue(framePrefix);
+    ASSERT_TRUE(getFirstInAdvertisementQueue() == NULL);
+
+    enqueueMessage(1, 0, 300);
+    enqueueMessage(1, 1, 100);
+    enqueueMessage(1, 2, 200);
+    // Same timestamp as an earlier item, comes after it
+    enqueueMessage(1, 3, 100);
+    ASSERT_EQ(4, getAdvertisementQueueSize());
+
+    uint8 expected[4] = {1, 3, 2, 0};
+    for(int i = 0; i < 4; i++) {
+        AdvQueueItem* first = getFirstInAdvertisementQueue();
+        ASSERT_EQ(expected[i], firstSequenceID());
+        ASSERT_EQ(expected[i], first->data[sizeof(MessageHeader)]);
+        ASSERT_EQ(sizeof(MessageHeader) + 1, first->length);
+        removeFirstInAdvertisementQueue();
+    }
+    ASSERT_EQ(0, getAdvertisementQueueSize());
+}
+
+TEST(AdvertisingQueueTest, FullQueue) {
+    initializeAdvertisementQueue(framePrefix);
+    setAdvertisementQueueSource(1);
+    for(int i = 0; i < ADVERTISING_QUEUE_CONTROL_RESERVED; i++) {
+        ASSERT_TRUE(enqueueTypedMessage(2, i, STATEFUL_MESSAGE_ACK, 1000 + i));
+    }
+    for(int i = ADVERTISING_QUEUE_CONTROL_RESERVED; i < ADVERTISING_QUEUE_MAX_SIZE; i++) {
+        enqueueMessage(1, i, i);
+    }
+    uint8 data[sizeof(MessageHeader)] = {0};
+    ASSERT_FALSE(enqueueAdvertisement(sizeof(data), data, 0));
+
+    removeFirstInAdvertisementQueue();
+    ASSERT_TRUE(enqueueAdvertisement(sizeof(data), data, 0));
+}
+
+TEST(AdvertisingQueueTest, ReservedSlots) {
+    const int relayCapacity = ADVERTISING_QUEUE_MAX_SIZE 
+            - ADVERTISING_QUEUE_CONTROL_RESERVED - ADVERTISING_QUEUE_LOCAL_RESERVED;
+    initializeAdvertisementQueue(framePrefix);
+    setAdvertisementQueueSource(1);
+    
+    // Relays leave the reserved slots free
+    for(int i = 0; i < relayCapacity; i++) {
+        enqueueMessage(2, i, i);
+    }
+    ASSERT_FALSE(enqueueTypedMessage(2, 200, BROADCAST, 0));
+    ASSERT_EQ(1, getAdvertisementQueueDrops(ADVERTISING_CLASS_RELAY));
+    
+    // Messages of this node fill their own, but not those kept for ACKs
+    for(int i = 0; i < ADVERTISING_QUEUE_LOCAL_RESERVED; i++) {
+        enqueueMessage(1, i, i);
+    }
+    ASSERT_FALSE(enqueueTypedMessage(1, 200, STATEFUL_MESSAGE, 0));
+    ASSERT_EQ(1, getAdvertisementQueueDrops(ADVERTISING_CLASS_LOCAL));
+    
+    // ACKs of any node take the rest
+    for(int i = 0; i < ADVERTISING_QUEUE_CONTROL_RESERVED; i++) {
+        ASSERT_TRUE(enqueueTypedMessage(3, i, STATEFUL_MESSAGE_ACK, i));
+    }
+    ASSERT_FALSE(enqueueTypedMessage(3, 200, SEGMENT_ACK, 0));
+    ASSERT_EQ(1, getAdvertisementQueueDrops(ADVERTISING_CLASS_CONTROL));
+    ASSERT_EQ(ADVERTISING_QUEUE_MAX_SIZE, getAdvertisementQueueSize());
+    
+    // A slot left by a relay goes to whichever class comes
+    removeFirstInAdvertisementQueue();
+    ASSERT_TRUE(enqueueTypedMessage(1, 201, BROADCAST, 0));
+}
+
+TEST(AdvertisingQueueTest, DueItemsByClass) {
+    initializeAdvertisementQueue(framePrefix);
+    setAdvertisementQueueSource(1);
+    ASSERT_TRUE(enqueueTypedMessage(2, 0, BROADCAST, 100));
+    ASSERT_TRUE(enqueueTypedMessage(1, 1, STATELESS_MESSAGE, 120));
+    ASSERT_TRUE(enqueueTypedMessage(2, 2, STATEFUL_MESSAGE_ACK, 150));
+    ASSERT_TRUE(enqueueTypedMessage(1, 3, STATEFUL_MESSAGE, 300));
+    
+    // Nothing due yet, the earliest one is next
+    ASSERT_EQ(0, ((MessageHeader*) getNextInAdvertisementQueue(50)->data)->sequenceID);
+    ASSERT_EQ(0, firstSequenceID());
+    // Of the due ones the ACK goes first, then the message of this node, 
+    // even though the relay has waited longest
+    uint8 expected[4] = {2, 1, 0, 3};
+    for(int i = 0; i < 4; i++) {
+        AdvQueueItem* next = getNextInAdvertisementQueue(200);
+        ASSERT_EQ(expected[i], ((MessageHeader*) next->data)->sequenceID);
+        removeFromAdvertisementQueue(next);
+    }
+    ASSERT_EQ(0, getAdvertisementQueueSize());
+}
+
+TEST(AdvertisingQueueTest, TransmissionsByClass) {
+    initializeAdvertisementQueue(framePrefix);
+    setAdvertisementQueueSource(1);
+    ASSERT_TRUE(enqueueTypedMessage(2, 0, STATEFUL_MESSAGE_ACK, 100));
+    ASSERT_TRUE(enqueueTypedMessage(1, 1, STATEFUL_MESSAGE, 200));
+    ASSERT_TRUE(enqueueTypedMessage(2, 2, BROADCAST, 300));
+
+    uint8 transmissions[3] = {
+        ADVERTISING_CONTROL_TRANSMISSIONS, ADVERTISING_LOCAL_TRANSMISSIONS,
+        ADVERTISING_RELAY_TRANSMISSIONS
+    };
+    uint16 intervals[3] = {
+        ADVERTISING_CONTROL_INTERVAL, ADVERTISING_LOCAL_INTERVAL,
+        ADVERTISING_RELAY_INTERVAL
+    };
+    for(int i = 0; i < 3; i++) {
+        AdvQueueItem* first = getFirstInAdvertisementQueue();
+        ASSERT_EQ(i, ((MessageHeader*) first->data)->sequenceID);
+        ASSERT_EQ(transmissions[i], first->transmissions);
+        ASSERT_EQ(intervals[i], first->transmitInterval);
+        removeFirstInAdvertisementQueue();
+    }
+}
+
+TEST(AdvertisingQueueTest, DequeueBySourceAndSequenceID) {
+    initializeAdvertisementQueue(framePrefix);
+    enqueueMessage(1, 5, 50);
+    enqueueMessage(2, 5, 40);
+    enqueueMessage(1, 6, 30);
+
+    ASSERT_FALSE(dequeueAdvertisement(2, 6));
+    ASSERT_TRUE(dequeueAdvertisement(1, 6));
+    ASSERT_FALSE(dequeueAdvertisement(1, 6));
+    ASSERT_EQ(2, getAdvertisementQueueSize());
+    ASSERT_EQ(2, ((MessageHeader*) getFirstInAdvertisementQueue()->data)->source);
+    ASSERT_TRUE(dequeueAdvertisement(2, 5));
+    ASSERT_EQ(1, ((MessageHeader*) getFirstInAdvertisementQueue()->data)->source);
+    ASSERT_EQ(5, firstSequenceID());
+}
+
+// A third of the messages are ACKs, a third are local and the rest relays
+static uint16 randomSource(uint8 sequenceID) {
+    return sequenceID % 3 == 1 ? 0x100 : 0x100 + sequenceID;
+}
+
+static int randomClass(uint8 sequenceID) {
+    return sequenceID % 3;
+}
+
+TEST(AdvertisingQueueTest, RandomOperations) {
+    initializeAdvertisementQueue(framePrefix);
+    setAdvertisementQueueSource(0x100);
+    uint32 timeStamps[256];
+    bool queued[256] = {false};
+    int queuedCount = 0;
+    srand(7);
+
+    for(int n = 0; n < 100000; n++) {
+        uint8 sequenceID = rand() & 0xFF;
+        int operation = rand() % 4;
+        // Leaves room for any class, whatever the reservations
+        if(operation == 0 && !queued[sequenceID]
+                && queuedCount < ADVERTISING_QUEUE_MAX_SIZE 
+                    - ADVERTISING_QUEUE_CONTROL_RESERVED 
+                    - ADVERTISING_QUEUE_LOCAL_RESERVED) {
+            timeStamps[sequenceID] = rand() % 1000;
+            ASSERT_TRUE(enqueueTypedMessage(randomSource(sequenceID), sequenceID,
+                    randomClass(sequenceID) == ADVERTISING_CLASS_CONTROL 
+                        ? STATEFUL_MESSAGE_ACK : BROADCAST, 
+                    timeStamps[sequenceID]));
+            queued[sequenceID] = true;
+            queuedCount++;
+        } else if(operation == 1) {
+            ASSERT_EQ(queued[sequenceID],
+                    dequeueAdvertisement(randomSource(sequenceID), sequenceID));
+            if(queued[sequenceID]) {
+                queued[sequenceID] = false;
+                queuedCount--;
+            }
+        } else if(operation == 2 && queuedCount > 0) {
+            // Of the items due, the next has the highest class and then the
+            // lowest timestamp
+            uint32 time = rand() % 1000;
+            AdvQueueItem* next = getNextInAdvertisementQueue(time);
+            uint8 nextID = ((MessageHeader*) next->data)->sequenceID;
+            ASSERT_TRUE(queued[nextID]);
+            if(timeStamps[nextID] <= time) {
+                for(int i = 0; i < 256; i++) {
+                    ASSERT_TRUE(!queued[i] || timeStamps[i] > time 
+                            || randomClass(i) > randomClass(nextID)
+                            || (randomClass(i) == randomClass(nextID) 
+                                && timeStamps[i] >= timeStamps[nextID]));
+                }
+            } else {
+                ASSERT_EQ(nextID, firstSequenceID());
+            }
+            removeFromAdvertisementQueue(next);
+            queued[nextID] = false;
+            queuedCount--;
+        } else if(queuedCount > 0) {
+            // The first item has the lowest timestamp of all queued items
+            uint8 first = firstSequenceID();
+            ASSERT_TRUE(queued[first]);
+            for(int i = 0; i < 256; i++) {
+                ASSERT_TRUE(!queued[i] || timeStamps[i] >= timeStamps[first]);
+            }
+            removeFirstInAdvertisementQueue();
+            queued[first] = false;
+            queuedCount--;
+        }
+        ASSERT_EQ(queuedCount, getAdvertisementQueueSize());
+    }
+}
+
+static void forwardingAdvertiseCallback(uint8* data, uint8 length, uint16 delay) {
+    enqueueAdvertisement(length, data, delay);
+}
+static void forwardingMessageCallback(uint16 source, uint8* message, uint8 length) {}
+static uint32 forwardingTimestamp() { return 0; }
+static uint16 forwardingRandom() { return 0; }
+static void forwardingCancel(uint16 source, uint8 sequenceID) {}
+
+TEST(AdvertisingQueueTest, ForwardCopiesMessageOnce) {
+    initializeAdvertisementQueue(framePrefix);
+    initializeMeshConnectionProtocol(0xFACB, 0xC89A, &forwardingAdvertiseCallback,
+            &forwardingMessageCallback, &forwardingTimestamp, &forwardingRandom,
+            &forwardingCancel);
+
+    // A scan result carrying a message to be forwarded
+    uint8 scanData[ADVERTISING_FRAME_LENGTH] = {0x02, 0x01, 0x06, 27};
+    uint8* message = &scanData[ADVERTISING_FRAME_PREFIX_LENGTH];
+    uint8 length = sizeof(MessageHeader) + 5;
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = 0xFACB;
+    header->source = 0x1234;
+    header->destination = 0x4321;
+    header->type = STATELESS_MESSAGE;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->sequenceID = 9;
+
+    uint32 copies = advertisingQueueCopies;
+    uint32 copiedBytes = advertisingQueueCopiedBytes;
+    processIncomingMessage(message, length);
+    ASSERT_EQ(1, getAdvertisementQueueSize());
+    ASSERT_EQ(copies + 1, advertisingQueueCopies);
+    ASSERT_EQ(copiedBytes + length, advertisingQueueCopiedBytes);
+
+    // The frame handed to the radio is complete without further copying, 
+    // one hop less. The scan result is left as it was.
+    AdvQueueItem* first = getFirstInAdvertisementQueue();
+    ASSERT_EQ(length, first->length);
+    ASSERT_EQ(MESSAGE_TTL_DEFAULT, header->ttl);
+    header->ttl--;
+    for(int i = 0; i < ADVERTISING_FRAME_PREFIX_LENGTH + length; i++) {
+        ASSERT_EQ(scanData[i], first->frame[i]);
+    }
+}
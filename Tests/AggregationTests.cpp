@@ -0,0 +1,84 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static void setMessage(uint8* message, MessageType type, uint16 destination, 
+        uint8 sequenceID, uint8 payload) {
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = TNPTest::networkID;
+    header->source = 0x0100;
+    header->type = type;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->initialTTL = MESSAGE_TTL_DEFAULT;
+    header->sequenceID = sequenceID;
+    if(type == BROADCAST) {
+        message[BROADCAST_HEADER_SIZE] = payload;
+    } else {
+        header->destination = destination;
+        message[HEADER_SIZE] = payload;
+    }
+}
+
+TEST_F(TNPTest, AggregatedMessages) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 aggregate[MESSAGE_LENGTH_MAX] = {0};
+    uint8 message[HEADER_SIZE + 3] = {0};
+    
+    setMessage(aggregate, STATELESS_MESSAGE, TNPTest::nodeId, 0, 1);
+    setMessage(message, BROADCAST, 0, 1, 2);
+    uint8 length = aggregateMessage(aggregate, HEADER_SIZE + 3, message, 8);
+    ASSERT_EQ(AGGREGATE_HEADER_SIZE + 1 + HEADER_SIZE + 1 + 1 + 6, length);
+    setMessage(message, STATELESS_MESSAGE, 0x1234, 2, 3);
+    
+    // The third doesn't fit
+    uint8 copy[MESSAGE_LENGTH_MAX];
+    memcpy(copy, aggregate, length);
+    ASSERT_EQ(0, aggregateMessage(aggregate, length, message, HEADER_SIZE + 3));
+    TNPTest::validateData(copy, aggregate, length);
+    
+    processIncomingMessage(aggregate, length);
+    ASSERT_EQ(2, TNPTest::messageCallbacks);
+    ASSERT_EQ(1, TNPTest::messageData[0][0]);
+    ASSERT_EQ(2, TNPTest::messageData[1][0]);
+    // The broadcast is relayed on its own
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    ASSERT_EQ(BROADCAST, ((MessageHeader*) TNPTest::advertisingData[0])->type);
+    ASSERT_EQ(1, ((MessageHeader*) TNPTest::advertisingData[0])->sequenceID);
+    
+    // Duplicates are still detected
+    processIncomingMessage(aggregate, length);
+    ASSERT_EQ(2, TNPTest::messageCallbacks);
+}
+
+TEST_F(TNPTest, AggregateSmallMessages) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 aggregate[MESSAGE_LENGTH_MAX] = {0};
+    uint8 message[8] = {0};
+    
+    setMessage(aggregate, BROADCAST, 0, 0, 1);
+    uint8 length = 8;
+    for(uint8 i = 1; i < 3; i++) {
+        setMessage(message, BROADCAST, 0, i, 1 + i);
+        length = aggregateMessage(aggregate, length, message, 8);
+    }
+    ASSERT_EQ(AGGREGATE_HEADER_SIZE + 3 * 7, length);
+    
+    // Not from another network
+    ((MessageHeader*) message)->networkIdentifier++;
+    ASSERT_EQ(0, aggregateMessage(aggregate, 8, message, 8));
+    
+    processIncomingMessage(aggregate, length);
+    ASSERT_EQ(3, TNPTest::messageCallbacks);
+    ASSERT_EQ(3, TNPTest::advertisingCalls);
+    
+    // A truncated aggregate gives what is complete
+    TNPTest::resetRecords();
+    setMessage(aggregate, BROADCAST, 0, 10, 1);
+    length = 8;
+    for(uint8 i = 1; i < 3; i++) {
+        setMessage(message, BROADCAST, 0, 10 + i, 1);
+        length = aggregateMessage(aggregate, length, message, 8);
+    }
+    processIncomingMessage(aggregate, length - 1);
+    ASSERT_EQ(2, TNPTest::messageCallbacks);
+}
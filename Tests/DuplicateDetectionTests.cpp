@@ -0,0 +1,170 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static void setStatelessHeader(uint8* message, uint16 source, uint8 sequenceID) {
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = TNPTest::networkID;
+    header->destination = 0x1234;
+    header->type = STATELESS_MESSAGE;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->source = source;
+    header->sequenceID = sequenceID;
+}
+
+TEST_F(TNPTest, DuplicateFromOtherNodeNotForwarded) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 message[HEADER_SIZE + 1] = {0};
+
+    setStatelessHeader(message, 0x100, 7);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+
+    // Same sequence ID from another source is a different message
+    setStatelessHeader(message, 0x101, 7);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+}
+
+#ifndef PROCESSED_MESSAGE_WINDOW
+TEST_F(TNPTest, DuplicateDetectionAfterEviction) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 message[HEADER_SIZE + 1] = {0};
+
+    // Fill the processed message cache several times over, using sources
+    // that collide with each other in the index
+    for(int i = 0; i < 300; i++) {
+        setStatelessHeader(message, 0x100 + (i & 0x7), i >> 3);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+    }
+    ASSERT_EQ(300, TNPTest::advertisingCalls);
+
+    // The latest messages are still remembered and thus not forwarded again
+    for(int i = 250; i < 300; i++) {
+        setStatelessHeader(message, 0x100 + (i & 0x7), i >> 3);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+    }
+    ASSERT_EQ(300, TNPTest::advertisingCalls);
+
+    // The first ones have been evicted and are processed as new messages
+    for(int i = 0; i < 10; i++) {
+        setStatelessHeader(message, 0x100 + (i & 0x7), i >> 3);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+    }
+    ASSERT_EQ(310, TNPTest::advertisingCalls);
+}
+
+TEST_F(TNPTest, ProcessedMessageExpiryStress) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 message[HEADER_SIZE + 1] = {0};
+    const uint32 start = 1000;
+    const uint32 interval = 100;
+    const uint32 messages = 2000000;
+    TNPTest::timestamp = start;
+    
+    // One new message every 100 ms and the periodic task every 2500 ms, so 
+    // that expiry rather than the ring size limits what is remembered
+    for(uint32 n = 0; n < messages; n++) {
+        TNPTest::timestamp = start + n * interval;
+        if(n % 25 == 0) {
+            periodicTask();
+        }
+        
+        int advertisingCount = TNPTest::advertisingCalls;
+        setStatelessHeader(message, 1 + (n >> 8), n & 0xFF);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+        ASSERT_EQ(advertisingCount + 1, TNPTest::advertisingCalls);
+        
+        // A message received 3000 ms ago hasn't expired yet
+        if(n >= 30) {
+            setStatelessHeader(message, 1 + ((n - 30) >> 8), (n - 30) & 0xFF);
+            processIncomingMessage(message, HEADER_SIZE + 1);
+            ASSERT_EQ(advertisingCount + 1, TNPTest::advertisingCalls);
+        }
+        
+        // Right after the periodic task, one received 3100 ms ago has
+        if(n % 25 == 0 && n >= 31) {
+            setStatelessHeader(message, 1 + ((n - 31) >> 8), (n - 31) & 0xFF);
+            processIncomingMessage(message, HEADER_SIZE + 1);
+            ASSERT_EQ(advertisingCount + 2, TNPTest::advertisingCalls);
+        }
+    }
+}
+#else
+TEST_F(TNPTest, SequenceWindowOutOfOrder) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 message[HEADER_SIZE + 1] = {0};
+
+    // Receive every other sequence ID, wrapping around 255
+    for(int i = 0; i < 20; i += 2) {
+        setStatelessHeader(message, 0x100, 240 + i);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+    }
+    ASSERT_EQ(10, TNPTest::advertisingCalls);
+
+    // The skipped ones are still new when they arrive late
+    for(int i = 1; i < 20; i += 2) {
+        setStatelessHeader(message, 0x100, 240 + i);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+    }
+    ASSERT_EQ(20, TNPTest::advertisingCalls);
+
+    // But none of them are processed twice
+    for(int i = 0; i < 20; i++) {
+        setStatelessHeader(message, 0x100, 240 + i);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+    }
+    ASSERT_EQ(20, TNPTest::advertisingCalls);
+}
+
+TEST_F(TNPTest, SequenceWindowRejectsTooOld) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 message[HEADER_SIZE + 1] = {0};
+
+    setStatelessHeader(message, 0x100, 100);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    // 31 behind is within the window, 32 behind is not
+    setStatelessHeader(message, 0x100, 69);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+    setStatelessHeader(message, 0x100, 68);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+}
+
+TEST_F(TNPTest, SequenceWindowPerSource) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 message[HEADER_SIZE + 1] = {0};
+
+    setStatelessHeader(message, 0x100, 3);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+
+    // A burst from one chatty node doesn't evict the history of others
+    for(int i = 0; i < 1000; i++) {
+        setStatelessHeader(message, 0x200, i);
+        processIncomingMessage(message, HEADER_SIZE + 1);
+    }
+    ASSERT_EQ(1001, TNPTest::advertisingCalls);
+    setStatelessHeader(message, 0x100, 3);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    ASSERT_EQ(1001, TNPTest::advertisingCalls);
+}
+
+TEST_F(TNPTest, SequenceWindowExpires) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 message[HEADER_SIZE + 1] = {0};
+    TNPTest::timestamp = 10000;
+
+    setStatelessHeader(message, 0x100, 100);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+
+    // After a while the source is forgotten, so a restarted node is accepted.
+    // Expired records are cleared up to 500 ms late.
+    TNPTest::timestamp += 3501;
+    periodicTask();
+    setStatelessHeader(message, 0x100, 0);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+}
+#endif
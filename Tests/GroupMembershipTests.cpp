@@ -0,0 +1,65 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#include <set>
+#include <stdlib.h>
+
+// A group broadcast is handed to the own application only when a member
+static bool isMember(uint16 group) {
+    uint8 data[1] = {0};
+    int messageCallbacks = TNPTest::messageCallbacks;
+    broadcastGroupMessage(group, data, 1);
+    return TNPTest::messageCallbacks > messageCallbacks;
+}
+
+TEST_F(TNPTest, JoinGroupRejectsDuplicates) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    ASSERT_TRUE(joinGroup(5));
+    ASSERT_FALSE(joinGroup(5));
+    ASSERT_TRUE(leaveGroup(5));
+    // Only joined once, so no longer a member
+    ASSERT_FALSE(isMember(5));
+    ASSERT_FALSE(leaveGroup(5));
+}
+
+TEST_F(TNPTest, FullGroupMemberships) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    for(int i = 0; i < GROUP_MEMBERSHIP_MAX; i++) {
+        ASSERT_TRUE(joinGroup(1000 - i * 7));
+    }
+    ASSERT_FALSE(joinGroup(1));
+
+    // Leaving the last and first groups doesn't disturb the others
+    ASSERT_TRUE(leaveGroup(1000 - (GROUP_MEMBERSHIP_MAX - 1) * 7));
+    ASSERT_TRUE(leaveGroup(1000));
+    for(int i = 1; i < GROUP_MEMBERSHIP_MAX - 1; i++) {
+        ASSERT_TRUE(isMember(1000 - i * 7));
+    }
+    ASSERT_FALSE(isMember(1000));
+    ASSERT_TRUE(joinGroup(1));
+    ASSERT_TRUE(isMember(1));
+}
+
+TEST_F(TNPTest, RandomGroupMemberships) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    std::set<uint16> groups;
+    srand(11);
+    for(int n = 0; n < 20000; n++) {
+        uint16 group = rand() % 64;
+        switch(rand() % 3) {
+            case 0:
+                ASSERT_EQ(groups.count(group) == 0 
+                        && groups.size() < GROUP_MEMBERSHIP_MAX, 
+                        joinGroup(group) == TRUE);
+                if(groups.size() < GROUP_MEMBERSHIP_MAX) {
+                    groups.insert(group);
+                }
+                break;
+            case 1:
+                ASSERT_EQ(groups.erase(group) == 1, leaveGroup(group) == TRUE);
+                break;
+            default:
+                ASSERT_EQ(groups.count(group) == 1, isMember(group));
+                break;
+        }
+    }
+}
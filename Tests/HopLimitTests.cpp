@@ -0,0 +1,69 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static void setHeader(uint8* message, MessageType type, uint16 destination, 
+        uint8 sequenceID, uint8 ttl) {
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = TNPTest::networkID;
+    header->source = 0x0100;
+    header->destination = destination;
+    header->type = type;
+    header->sequenceID = sequenceID;
+    header->ttl = ttl;
+}
+
+TEST_F(TNPTest, RelayDecrementsTTL) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 message[HEADER_SIZE + 1] = {0};
+    
+    setHeader(message, BROADCAST, 0, 0, 5);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    setHeader(message, STATELESS_MESSAGE, 0x1234, 1, 2);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+    ASSERT_EQ(4, ((MessageHeader*) TNPTest::advertisingData[0])->ttl);
+    ASSERT_EQ(1, ((MessageHeader*) TNPTest::advertisingData[1])->ttl);
+}
+
+TEST_F(TNPTest, RelayDropsAtZeroTTL) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 message[HEADER_SIZE + 1] = {0};
+    joinGroup(0x0200);
+    
+    setHeader(message, BROADCAST, 0, 0, 1);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    setHeader(message, GROUP_BROADCAST, 0x0200, 1, 1);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    setHeader(message, STATELESS_MESSAGE, 0x1234, 2, 0);
+    processIncomingMessage(message, HEADER_SIZE + 1);
+    
+    // Nothing is relayed, but the messages for this node are still delivered
+    ASSERT_EQ(0, TNPTest::advertisingCalls);
+    ASSERT_EQ(2, TNPTest::messageCallbacks);
+}
+
+TEST_F(TNPTest, SetMessageTTL) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 data[1] = {0};
+    
+    setMessageTTL(3);
+    broadcastMessage(data, 1);
+    sendStatelessMessage(0x1234, data, 1);
+    setMessageTTL(0);
+    sendStatefulMessage(0x1234, data, 1);
+    setMessageTTL(100);
+    sendStatelessMessage(0x1234, data, 1);
+    
+    ASSERT_EQ(3, ((MessageHeader*) TNPTest::advertisingData[0])->ttl);
+    ASSERT_EQ(3, ((MessageHeader*) TNPTest::advertisingData[1])->ttl);
+    ASSERT_EQ(1, ((MessageHeader*) TNPTest::advertisingData[2])->ttl);
+    ASSERT_EQ(MESSAGE_TTL_MAX, ((MessageHeader*) TNPTest::advertisingData[3])->ttl);
+    
+    // Resends keep the TTL the message was sent with
+    TNPTest::timestamp += 6000;
+    periodicTask();
+    ASSERT_EQ(5, TNPTest::advertisingCalls);
+    ASSERT_EQ(1, ((MessageHeader*) TNPTest::advertisingData[4])->ttl);
+}
@@ -0,0 +1,167 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static int failures, deliveries;
+static uint8 lastFailed;
+
+static void countingReport(uint16 destination, uint8 sequenceID, uint8 delivered) {
+    if(delivered) {
+        deliveries++;
+    } else {
+        failures++;
+        lastFailed = sequenceID;
+    }
+}
+
+static void initializeWithBuffer(PendingACK* buffer, uint8 capacity, 
+        PendingACKPolicy policy) {
+    failures = 0;
+    deliveries = 0;
+    TNPTest::initializeProtocolWithDefaultParameters();
+    setDeliveryReport(&countingReport);
+    setPendingACKBuffer(buffer, capacity);
+    setPendingACKPolicy(policy);
+}
+
+static void receiveACK(uint16 source, uint8 sequenceID) {
+    static uint8 ackSequenceID = 0;
+    uint8 ack[HEADER_SIZE + 2] = {0};
+    MessageHeader* header = (MessageHeader*) ack;
+    header->networkIdentifier = TNPTest::networkID;
+    header->source = source;
+    header->destination = TNPTest::nodeId;
+    header->type = STATEFUL_MESSAGE_ACK;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->sequenceID = ackSequenceID++;
+    ack[HEADER_SIZE] = sequenceID;
+    processIncomingMessage(ack, HEADER_SIZE + 2);
+}
+
+TEST_F(TNPTest, PendingACKBufferFromCaller) {
+    PendingACK buffer[40];
+    uint8 message[3] = {1, 2, 3};
+    uint8 sequenceIDs[40];
+    initializeWithBuffer(buffer, 40, PENDING_ACK_REJECT);
+    
+    for(int i = 0; i < 40; i++) {
+        ASSERT_EQ(PENDING_ACK_ADMITTED, sendPrioritizedStatefulMessage(
+                0x0100 + i % 7, message, 3, 0, &sequenceIDs[i]));
+    }
+    ASSERT_EQ(PENDING_ACK_REJECTED, sendStatefulMessage(0x0100, message, 3));
+    
+    // ACKs in another order than the messages, some for nothing pending
+    for(int i = 0; i < 40; i++) {
+        int j = (i * 17) % 40;
+        receiveACK(0x0100 + j % 7, sequenceIDs[j]);
+        receiveACK(0x0100 + (j + 1) % 7, sequenceIDs[j]);
+    }
+    ASSERT_EQ(40, deliveries);
+    ASSERT_EQ(0, failures);
+    
+    // Room for all again
+    for(int i = 0; i < 40; i++) {
+        ASSERT_EQ(PENDING_ACK_ADMITTED, sendStatefulMessage(0x0100, message, 3));
+    }
+}
+
+TEST_F(TNPTest, RejectedMessageIsNotSent) {
+    PendingACK buffer[2];
+    uint8 message[3] = {1, 2, 3};
+    initializeWithBuffer(buffer, 2, PENDING_ACK_REJECT);
+    sendStatefulMessage(0x0100, message, 3);
+    sendStatefulMessage(0x0100, message, 3);
+    
+    TNPTest::resetRecords();
+    ASSERT_EQ(PENDING_ACK_REJECTED, sendStatefulMessage(0x0100, message, 3));
+    ASSERT_EQ(0, TNPTest::advertisingCalls);
+    ASSERT_EQ(0, failures);
+}
+
+TEST_F(TNPTest, LowestPriorityIsEvicted) {
+    PendingACK buffer[3];
+    uint8 message[3] = {1, 2, 3};
+    uint8 sequenceIDs[3];
+    initializeWithBuffer(buffer, 3, PENDING_ACK_EVICT_LOWEST_PRIORITY);
+    sendPrioritizedStatefulMessage(0x0100, message, 3, 2, &sequenceIDs[0]);
+    TNPTest::timestamp += 10;
+    sendPrioritizedStatefulMessage(0x0100, message, 3, 1, &sequenceIDs[1]);
+    TNPTest::timestamp += 10;
+    sendPrioritizedStatefulMessage(0x0100, message, 3, 1, &sequenceIDs[2]);
+    
+    // Nothing below priority 1, so a priority 0 message isn't sent
+    TNPTest::resetRecords();
+    ASSERT_EQ(PENDING_ACK_REJECTED, 
+            sendPrioritizedStatefulMessage(0x0100, message, 3, 0, NULL));
+    ASSERT_EQ(0, TNPTest::advertisingCalls);
+    
+    // The older one of priority 1 makes room
+    TNPTest::timestamp += 10;
+    ASSERT_EQ(PENDING_ACK_ADMITTED_EVICTED, 
+            sendPrioritizedStatefulMessage(0x0100, message, 3, 1, NULL));
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    ASSERT_EQ(1, failures);
+    ASSERT_EQ(sequenceIDs[1], lastFailed);
+    
+    ASSERT_EQ(PENDING_ACK_ADMITTED_EVICTED, 
+            sendPrioritizedStatefulMessage(0x0100, message, 3, 3, NULL));
+    ASSERT_EQ(sequenceIDs[2], lastFailed);
+}
+
+static uint8 resendOnFailure;
+
+static void resendingReport(uint16 destination, uint8 sequenceID, uint8 delivered) {
+    uint8 message[3] = {4, 5, 6};
+    countingReport(destination, sequenceID, delivered);
+    if(!delivered && resendOnFailure) {
+        resendOnFailure = FALSE;
+        sendStatefulMessage(destination, message, 3);
+    }
+}
+
+TEST_F(TNPTest, ReportTakingTheEvictedEntry) {
+    PendingACK buffer[2];
+    uint8 message[3] = {1, 2, 3};
+    initializeWithBuffer(buffer, 2, PENDING_ACK_EVICT_OLDEST);
+    sendStatefulMessage(0x0100, message, 3);
+    TNPTest::timestamp += 10;
+    sendStatefulMessage(0x0100, message, 3);
+    TNPTest::timestamp += 10;
+    
+    // The report resends the evicted message into the freed entry, so the 
+    // next oldest makes room
+    setDeliveryReport(&resendingReport);
+    resendOnFailure = TRUE;
+    TNPTest::resetRecords();
+    ASSERT_EQ(PENDING_ACK_ADMITTED_EVICTED, sendStatefulMessage(0x0100, message, 3));
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+    ASSERT_EQ(2, failures);
+    
+    // Once the report has taken back the entry of every message evicted, 
+    // the one being sent is rejected
+    resendOnFailure = TRUE;
+    setPendingACKBuffer(buffer, 1);
+    sendStatefulMessage(0x0100, message, 3);
+    TNPTest::resetRecords();
+    ASSERT_EQ(PENDING_ACK_REJECTED, sendStatefulMessage(0x0100, message, 3));
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+}
+
+TEST_F(TNPTest, OldestIsEvicted) {
+    PendingACK buffer[3];
+    uint8 message[3] = {1, 2, 3};
+    uint8 sequenceIDs[3];
+    initializeWithBuffer(buffer, 3, PENDING_ACK_EVICT_OLDEST);
+    for(int i = 0; i < 3; i++) {
+        sendPrioritizedStatefulMessage(0x0100, message, 3, 0, &sequenceIDs[i]);
+        TNPTest::timestamp += 10;
+    }
+    // Freeing the middle one leaves the first the oldest
+    receiveACK(0x0100, sequenceIDs[1]);
+    sendStatefulMessage(0x0100, message, 3);
+    
+    ASSERT_EQ(PENDING_ACK_ADMITTED_EVICTED, sendStatefulMessage(0x0100, message, 3));
+    ASSERT_EQ(sequenceIDs[0], lastFailed);
+    ASSERT_EQ(PENDING_ACK_ADMITTED_EVICTED, sendStatefulMessage(0x0100, message, 3));
+    ASSERT_EQ(sequenceIDs[2], lastFailed);
+}
@@ -0,0 +1,49 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static MeshContext nodes[2];
+
+static void relayInSecondNode(uint8* data, uint8 length, uint16 delay) {
+    TNPTest::advertiseCallback(data, length, delay);
+    processIncomingMessageCtx(&nodes[1], data, length);
+}
+
+static void initializeNode(MeshContext* ctx, uint16 nodeId, 
+        advertiseDataFunction advertise) {
+    initializeMeshConnectionProtocolCtx(ctx, TNPTest::networkID, nodeId, 
+            advertise, 
+            &TNPTest::messageCallback,
+            &TNPTest::getTimestamp,
+            &TNPTest::getRandom,
+            &TNPTest::cancelAdvertisementCallback);
+}
+
+TEST_F(TNPTest, ContextsAreIndependent) {
+    initializeNode(&nodes[0], 0x0001, &relayInSecondNode);
+    initializeNode(&nodes[1], 0x0002, &TNPTest::advertiseCallback);
+    uint8 message[3] = {1, 2, 3};
+
+    // The second node receives and forwards what the first one sends
+    sendStatelessMessageCtx(&nodes[0], 0x0003, message, 3);
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+    TNPTest::validateHeaderData(TNPTest::networkID, 0x0001, 0x0003, 
+            STATELESS_MESSAGE, TNPTest::advertisingData[1]);
+
+    // Only the second node has it processed, so the first one still 
+    // forwards it when it comes back
+    processIncomingMessageCtx(&nodes[1], TNPTest::advertisingData[0], 
+            HEADER_SIZE + 3);
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+    initializeNode(&nodes[0], 0x0001, &TNPTest::advertiseCallback);
+    processIncomingMessageCtx(&nodes[0], TNPTest::advertisingData[0], 
+            HEADER_SIZE + 3);
+    ASSERT_EQ(3, TNPTest::advertisingCalls);
+
+    // Group memberships are per node
+    ASSERT_TRUE(joinGroupCtx(&nodes[1], 0x0100));
+    broadcastGroupMessageCtx(&nodes[0], 0x0100, message, 3);
+    ASSERT_EQ(0, TNPTest::messageCallbacks);
+    broadcastGroupMessageCtx(&nodes[1], 0x0100, message, 3);
+    ASSERT_EQ(1, TNPTest::messageCallbacks);
+}
@@ -9,7 +9,7 @@ TEST_F(TNPTest, ReceiveBroadcast) {
     int length = 5;
     uint8 data[5] = {0x89, 0x27, 0x90, 0x12, 0xBA};
     broadcastMessage(data, length);
-    processIncomingMessage(advertisingData[0], 6 + length);
+    processIncomingMessage(advertisingData[0], BROADCAST_HEADER_SIZE + length);
     
     // Check message callback count and its data, and that the broadcast is 
     // forwarded (both to the app and to rest of network)
@@ -18,10 +18,13 @@ TEST_F(TNPTest, ReceiveBroadcast) {
     
     TNPTest::validateData(data, TNPTest::messageData[0], length);
     TNPTest::validateData(data, TNPTest::messageData[1], length);
-    TNPTest::validateData(advertisingData[0], advertisingData[1], length + 6);
+    // The relayed copy has one hop less, the received one is left as it was
+    ((MessageHeader*) advertisingData[0])->ttl--;
+    TNPTest::validateData(advertisingData[0], advertisingData[1], length + BROADCAST_HEADER_SIZE);
+    ((MessageHeader*) advertisingData[0])->ttl++;
     
     // Make sure the broadcast isn't forwarded if recieved a 2nd time
-    processIncomingMessage(advertisingData[0], 6 + length);
+    processIncomingMessage(advertisingData[0], BROADCAST_HEADER_SIZE + length);
     ASSERT_EQ(2, TNPTest::messageCallbacks);
 }
 
@@ -42,6 +45,7 @@ TEST_F(TNPTest, ReceiveGroupBroadcast) {
     ASSERT_EQ(1, TNPTest::messageCallbacks);
     TNPTest::validateData(data, TNPTest::messageData[0], length);
     ASSERT_EQ(2, TNPTest::advertisingCalls);
+    ((MessageHeader*) advertisingData[0])->ttl--;
     TNPTest::validateData(advertisingData[0], advertisingData[1], HEADER_SIZE + length);
     
     // Test processing a message that isn't addressed to the groupID
@@ -57,14 +61,11 @@ TEST_F(TNPTest, ReceiveStatelessAddressedMessage) {
     TNPTest::initializeProtocolWithDefaultParameters();
     int length = 5;
     uint8 data[5] = {0x99, 0xF1, 0xAB, 0x3B, 0xB1};
-    uint16 sender = TNPTest::nodeId;
     uint16 receiver = 0x7B8F;
     
     sendStatelessMessage(receiver, data, length);
     
-    initializeMeshConnectionProtocol(TNPTest::networkID, receiver, 
-            &TNPTest::advertiseCallback, &TNPTest::messageCallback,
-            &TNPTest::getTimestamp);
+    TNPTest::initializeProtocol(TNPTest::networkID, receiver);
     
     // Test processing a message addressed to this node
     processIncomingMessage(advertisingData[0], HEADER_SIZE + length);
@@ -83,9 +84,10 @@ TEST_F(TNPTest, ReceiveStatelessAddressedMessage) {
     // Test processing a message that isn't addressed to this node
     sendStatelessMessage(27218, data, length);
     processIncomingMessage(advertisingData[1], HEADER_SIZE + length);
-    // Make sure it's forwarded to the rest of the network, but not the app
+    // Make sure it's forwarded to the rest of the network, but not the app.
+    // Sending it was an advertising call of its own, the relay is the third.
     ASSERT_EQ(1, TNPTest::messageCallbacks);
-    ASSERT_EQ(2, TNPTest::advertisingCalls);
+    ASSERT_EQ(3, TNPTest::advertisingCalls);
 }
 
 TEST_F(TNPTest, ReceiveStatefulAddressedMessage) {
@@ -99,9 +101,7 @@ TEST_F(TNPTest, ReceiveStatefulAddressedMessage) {
     sendStatefulMessage(receiver, data, length);
     
     // Switch to the reciever and process message addressed to it
-    initializeMeshConnectionProtocol(TNPTest::networkID, receiver, 
-            &TNPTest::advertiseCallback, &TNPTest::messageCallback,
-            &TNPTest::getTimestamp);
+    TNPTest::initializeProtocol(TNPTest::networkID, receiver);
     processIncomingMessage(advertisingData[0], HEADER_SIZE + length);
     
     // Check message callback count and its data. Make sure the message isn't
@@ -112,14 +112,16 @@ TEST_F(TNPTest, ReceiveStatefulAddressedMessage) {
     // Validate that the ACK is actually an ACK, and that it's sent to the 
     // node from which the stateful message orginated, i.e. the sender
     TNPTest::validateHeaderData(TNPTest::networkID, receiver, sender,
-            STATEFUL_MESSAGE_ACK, 1, advertisingData[1]);
+            STATEFUL_MESSAGE_ACK, advertisingData[1]);
     
-    // Test processing a message that isn't addressed to this node
+    // Test processing a message that isn't addressed to this node. The ACK 
+    // above took advertisingData[1], so it is sent as the third call.
     sendStatefulMessage(27218, data, length);
-    processIncomingMessage(advertisingData[1], HEADER_SIZE + length);
-    // Make sure it's forwarded to the rest of the network, but not the app
+    processIncomingMessage(advertisingData[2], HEADER_SIZE + length);
+    // Make sure it's forwarded to the rest of the network, but not the app:
+    // the message, the ACK, this send and its relay
     ASSERT_EQ(1, TNPTest::messageCallbacks);
-    ASSERT_EQ(3, TNPTest::advertisingCalls);
+    ASSERT_EQ(4, TNPTest::advertisingCalls);
 }
 
 TEST_F(TNPTest, ReceiveMessageFromAnotherNetwork) {
@@ -132,9 +134,7 @@ TEST_F(TNPTest, ReceiveMessageFromAnotherNetwork) {
     sendStatefulMessage(TNPTest::nodeId, data, length);
     
     // Switch to local network ID and process message
-    initializeMeshConnectionProtocol(networkID, TNPTest::nodeId, 
-            &TNPTest::advertiseCallback, &TNPTest::messageCallback,
-            &TNPTest::getTimestamp);
+    TNPTest::initializeProtocol(networkID, TNPTest::nodeId);
     TNPTest::resetRecords();
     processIncomingMessage(advertisingData[0], HEADER_SIZE + length);
     // Make sure no message is forwarded neither to the app or the network
@@ -144,7 +144,6 @@ TEST_F(TNPTest, ReceiveMessageFromAnotherNetwork) {
 
 TEST_F(TNPTest, ReceiveInvalidMessage) {
     TNPTest::initializeProtocolWithDefaultParameters();
-    int length = 0;
     
     // Some invalid messages
     uint8 data1[9] = {0x46, 0x75, 0x34, 0x23, 0x24, 0x12, 0x23, 0x12, 0x21};
@@ -158,6 +157,25 @@ TEST_F(TNPTest, ReceiveInvalidMessage) {
     ASSERT_EQ(0, TNPTest::advertisingCalls);
 }
 
+TEST_F(TNPTest, ReceiveTruncatedAddressedMessage) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 data[1] = {0x99};
+    uint16 receiver = 0x7B8F;
+    sendStatelessMessage(receiver, data, 0);
+    
+    // Long enough for a broadcast header, but not for the destination and 
+    // initial TTL of an addressed one
+    TNPTest::initializeProtocol(TNPTest::networkID, receiver);
+    processIncomingMessage(advertisingData[0], BROADCAST_HEADER_SIZE);
+    processIncomingMessage(advertisingData[0], HEADER_SIZE - 1);
+    ASSERT_EQ(0, TNPTest::messageCallbacks);
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    
+    // The whole header is enough, even without payload
+    processIncomingMessage(advertisingData[0], HEADER_SIZE);
+    ASSERT_EQ(1, TNPTest::messageCallbacks);
+}
+
 TEST_F(TNPTest, ResendStatefulMessage) {
     uint16 sender = TNPTest::nodeId;
     uint16 receiver1 = 0x18FB, receiver2 = 0x83A1;
@@ -181,13 +199,14 @@ TEST_F(TNPTest, ResendStatefulMessage) {
     periodicTask();
     ASSERT_EQ(advertisingCount, TNPTest::advertisingCalls);
     
-    // Go ahead 101 ms in time, run periodic task which should resend first msg
-    TNPTest::timestamp += 101;
+    // Go ahead 4101 ms in time, run periodic task which should resend first 
+    // msg, 5051 ms after it was sent, past the 5000 ms resend timeout
+    TNPTest::timestamp += 4101;
     periodicTask();
     ASSERT_EQ(advertisingCount + 1, TNPTest::advertisingCalls);
     // Validate that the right data is sent out
     TNPTest::validateHeaderData(TNPTest::networkID, sender, receiver1, 
-            STATEFUL_MESSAGE, 9, TNPTest::advertisingData[TNPTest::advertisingCalls-1]);
+            STATEFUL_MESSAGE, TNPTest::advertisingData[TNPTest::advertisingCalls-1]);
     TNPTest::validateData(&TNPTest::advertisingData[0][HEADER_SIZE], &TNPTest::advertisingData[TNPTest::advertisingCalls-1][HEADER_SIZE], 9);
     
     // ACK the first message
@@ -197,7 +216,7 @@ TEST_F(TNPTest, ResendStatefulMessage) {
     ackHeader->destination = sender;
     ackHeader->source = receiver1;
     ackHeader->sequenceID = 99;
-    ackHeader->length = 1;
+    ackHeader->ttl = MESSAGE_TTL_DEFAULT;
     ackHeader->type = STATEFUL_MESSAGE_ACK;
 
     // Assign the sequenceID of the resent message as the content
@@ -205,19 +224,20 @@ TEST_F(TNPTest, ResendStatefulMessage) {
     // Process the ACK for the first message
     processIncomingMessage(ackData, 10);
 
-    // Go ahead 1001 ms and run periodic task, which should resend only the two
-    // last sent messages, since the first one has been acked
+    // Go ahead 5001 ms and run periodic task, which should resend only the two
+    // last sent messages, since the first one has been acked. They are then 
+    // past the resend timeout too.
     advertisingCount = TNPTest::advertisingCalls;
-    TNPTest::timestamp += 1001;
+    TNPTest::timestamp += 5001;
     periodicTask();
     ASSERT_EQ(advertisingCount + 2, TNPTest::advertisingCalls);
     // Validate that the right data is sent out in message 2
     TNPTest::validateHeaderData(TNPTest::networkID, sender, receiver2, 
-            STATEFUL_MESSAGE, 3, TNPTest::advertisingData[TNPTest::advertisingCalls-2]);
+            STATEFUL_MESSAGE, TNPTest::advertisingData[TNPTest::advertisingCalls-2]);
     TNPTest::validateData(&TNPTest::advertisingData[1][HEADER_SIZE], &TNPTest::advertisingData[TNPTest::advertisingCalls-2][HEADER_SIZE], 3);
     // in message 3
     TNPTest::validateHeaderData(TNPTest::networkID, sender, receiver1, 
-            STATEFUL_MESSAGE, 5, TNPTest::advertisingData[TNPTest::advertisingCalls-1]);
+            STATEFUL_MESSAGE, TNPTest::advertisingData[TNPTest::advertisingCalls-1]);
     TNPTest::validateData(&TNPTest::advertisingData[2][HEADER_SIZE], &TNPTest::advertisingData[TNPTest::advertisingCalls-1][HEADER_SIZE], 5);
     
     // Ack the 2nd message
@@ -227,7 +247,7 @@ TEST_F(TNPTest, ResendStatefulMessage) {
     processIncomingMessage(ackData, 10);
     
     // Go ahead 100ms and check that the no message isn't resent again, since
-    // the timeout hasn't expired yet (901ms left until the resend of 2 last msg)
+    // the timeout hasn't expired yet (4901ms left until the resend of 2 last msg)
     advertisingCount = TNPTest::advertisingCalls;
     TNPTest::timestamp += 100;
     periodicTask();
@@ -240,14 +260,20 @@ TEST_F(TNPTest, ResendStatefulMessage) {
     ackHeader->sequenceID += 1;
     processIncomingMessage(ackData, 10);
     
-    // Go ahead 901 ms and check that only the 3rd message is resent,
-    // since the 2nd has been ACK'ed
+    // The 3rd message has been resent once, so it waits twice as long 
+    // before the next resend
     advertisingCount = TNPTest::advertisingCalls;
-    TNPTest::timestamp += 901;
+    TNPTest::timestamp += 4901;
+    periodicTask();
+    ASSERT_EQ(advertisingCount, TNPTest::advertisingCalls);
+    
+    // Go ahead 5000 ms and check that only the 3rd message is resent,
+    // since the 2nd has been ACK'ed
+    TNPTest::timestamp += 5000;
     periodicTask();
     ASSERT_EQ(advertisingCount + 1, TNPTest::advertisingCalls);
     TNPTest::validateHeaderData(TNPTest::networkID, sender, receiver1, 
-            STATEFUL_MESSAGE, 5, TNPTest::advertisingData[TNPTest::advertisingCalls-1]);
+            STATEFUL_MESSAGE, TNPTest::advertisingData[TNPTest::advertisingCalls-1]);
     
     // ACK the 3rd message
     ackHeader->source = receiver1;
@@ -256,7 +282,7 @@ TEST_F(TNPTest, ResendStatefulMessage) {
     processIncomingMessage(ackData, 10);
     // Make sure that after a timeout period, all messages have been ACK'ed
     advertisingCount = TNPTest::advertisingCalls;
-    TNPTest::timestamp += 1001;
+    TNPTest::timestamp += 30001;
     periodicTask();
     ASSERT_EQ(advertisingCount, TNPTest::advertisingCalls);
 }
\ No newline at end of file
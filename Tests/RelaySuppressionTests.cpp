@@ -0,0 +1,95 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static int cancelCalls;
+static uint16 lastDelay;
+
+static void cancelCallback(uint16 source, uint8 sequenceID) {
+    cancelCalls++;
+}
+
+static void delayCallback(uint8* data, uint8 length, uint16 delay) {
+    lastDelay = delay;
+}
+
+static uint16 randomCounter() {
+    static uint16 counter = 0;
+    return counter += 37;
+}
+
+static void initializeCountingProtocol() {
+    cancelCalls = 0;
+    initializeMeshConnectionProtocol(TNPTest::networkID, TNPTest::nodeId, 
+            &delayCallback, 
+            &TNPTest::messageCallback,
+            &TNPTest::getTimestamp,
+            &randomCounter,
+            &cancelCallback);
+}
+
+// Receives the broadcast n from a source times times, returns the number 
+// of receptions after which its relay was cancelled, or 0 if never
+static int receive(uint32 n, int times) {
+    uint8 message[HEADER_SIZE + 1] = {0};
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = TNPTest::networkID;
+    header->type = BROADCAST;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->source = 0x100 + (n >> 8);
+    header->sequenceID = n & 0xFF;
+    int cancelledAt = 0;
+    for(int i = 1; i <= times; i++) {
+        int cancels = cancelCalls;
+        processIncomingMessage(message, HEADER_SIZE + 1);
+        if(cancelledAt == 0 && cancelCalls > cancels) {
+            cancelledAt = i;
+        }
+    }
+    return cancelledAt;
+}
+
+TEST_F(TNPTest, FixedRelaySuppression) {
+    initializeCountingProtocol();
+    setRelaySuppression(RELAY_SUPPRESSION_FIXED, 4);
+    ASSERT_EQ(4, receive(0, 5));
+    setRelaySuppression(RELAY_SUPPRESSION_FIXED, 2);
+    ASSERT_EQ(2, receive(1, 5));
+}
+
+TEST_F(TNPTest, AdaptiveRelaySuppressionFollowsDensity) {
+    initializeCountingProtocol();
+    setRelaySuppression(RELAY_SUPPRESSION_ADAPTIVE, 0);
+    
+    // Few copies per message, a relay is only cancelled well above that
+    uint32 n = 0;
+    for(; n < 3 * PROCESSED_MESSAGE_LENGTH; n++) {
+        receive(n, 2);
+    }
+    ASSERT_EQ(6, receive(n++, 7));
+    
+    // Somewhat more, which never takes more copies than fewer did
+    for(int i = 0; i < 3 * PROCESSED_MESSAGE_LENGTH; i++) {
+        receive(n++, 6);
+    }
+    ASSERT_EQ(4, receive(n++, 7));
+    
+    // Many copies per message, three are enough
+    for(int i = 0; i < 3 * PROCESSED_MESSAGE_LENGTH; i++) {
+        receive(n++, 12);
+    }
+    ASSERT_EQ(3, receive(n++, 5));
+}
+
+TEST_F(TNPTest, AdaptiveRelayListenPeriod) {
+    initializeCountingProtocol();
+    setRelaySuppression(RELAY_SUPPRESSION_ADAPTIVE, 0);
+    uint16 longest = 0;
+    for(uint32 n = 0; n < 1000; n++) {
+        receive(n, 1);
+        longest = lastDelay > longest ? lastDelay : longest;
+    }
+    // Spread over four backoff intervals
+    ASSERT_GT(longest, 120);
+    ASSERT_LT(longest, 160);
+}
@@ -0,0 +1,133 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static const uint16 receiver = 0x0100;
+static uint16 randomValue;
+static int reports;
+static uint16 reportedDestination;
+static uint8 reportedSequenceID, reportedDelivered;
+
+static uint16 getFixedRandom() {
+    return randomValue;
+}
+
+static void deliveryReport(uint16 destination, uint8 sequenceID, uint8 delivered) {
+    reports++;
+    reportedDestination = destination;
+    reportedSequenceID = sequenceID;
+    reportedDelivered = delivered;
+}
+
+static void initializeReportingProtocol(uint16 random) {
+    randomValue = random;
+    reports = 0;
+    initializeMeshConnectionProtocol(TNPTest::networkID, TNPTest::nodeId, 
+            &TNPTest::advertiseCallback, 
+            &TNPTest::messageCallback,
+            &TNPTest::getTimestamp,
+            &getFixedRandom,
+            &TNPTest::cancelAdvertisementCallback);
+    setDeliveryReport(&deliveryReport);
+}
+
+static void receiveACK(uint8 sequenceID) {
+    uint8 ack[HEADER_SIZE + 2] = {0};
+    MessageHeader* header = (MessageHeader*) ack;
+    header->networkIdentifier = TNPTest::networkID;
+    header->source = receiver;
+    header->destination = TNPTest::nodeId;
+    header->type = STATEFUL_MESSAGE_ACK;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->sequenceID = 200 + sequenceID;
+    ack[HEADER_SIZE] = sequenceID;
+    processIncomingMessage(ack, HEADER_SIZE + 2);
+}
+
+TEST_F(TNPTest, ResendTimeoutFollowsRoundTripTime) {
+    uint8 message[3] = {1, 2, 3};
+    initializeReportingProtocol(0);
+    TNPTest::timestamp = 1000;
+    uint8 sequenceID;
+    sendPrioritizedStatefulMessage(receiver, message, 3, 0, &sequenceID);
+    
+    TNPTest::timestamp += 300;
+    receiveACK(sequenceID);
+    ASSERT_EQ(1, reports);
+    ASSERT_EQ(receiver, reportedDestination);
+    ASSERT_EQ(sequenceID, reportedSequenceID);
+    ASSERT_TRUE(reportedDelivered);
+    
+    // 300 ms round trips give the shortest timeout instead of the initial 
+    // 5000 ms
+    TNPTest::timestamp += 700;
+    sendStatefulMessage(receiver, message, 3);
+    TNPTest::resetRecords();
+    TNPTest::timestamp += 999;
+    periodicTask();
+    ASSERT_EQ(0, TNPTest::advertisingCalls);
+    TNPTest::timestamp += 1;
+    periodicTask();
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    
+    // The ACK of the resent message doesn't count as a measurement, so new 
+    // messages keep the timeout backed off by the resend
+    TNPTest::timestamp += 4000;
+    receiveACK(((MessageHeader*) TNPTest::advertisingData[0])->sequenceID);
+    ASSERT_EQ(2, reports);
+    sendStatefulMessage(receiver, message, 3);
+    TNPTest::resetRecords();
+    TNPTest::timestamp += 1999;
+    periodicTask();
+    ASSERT_EQ(0, TNPTest::advertisingCalls);
+    TNPTest::timestamp += 1;
+    periodicTask();
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+}
+
+TEST_F(TNPTest, ResendsBackOffWithJitter) {
+    uint8 message[3] = {1, 2, 3};
+    initializeReportingProtocol(1000);
+    TNPTest::timestamp = 0;
+    uint8 sequenceID;
+    sendPrioritizedStatefulMessage(receiver, message, 3, 0, &sequenceID);
+    TNPTest::resetRecords();
+    
+    // Timeouts of 5000, 10000 and 20000 ms, each with 1000 ms jitter
+    uint32 resendTimes[3] = {6000, 17000, 38000};
+    for(int i = 0; i < 3; i++) {
+        TNPTest::timestamp = resendTimes[i] - 1;
+        periodicTask();
+        ASSERT_EQ(i, TNPTest::advertisingCalls);
+        TNPTest::timestamp = resendTimes[i];
+        periodicTask();
+        ASSERT_EQ(i + 1, TNPTest::advertisingCalls);
+    }
+    
+    // Given up once the last resend has timed out as well
+    TNPTest::timestamp = 68999;
+    periodicTask();
+    ASSERT_EQ(0, reports);
+    TNPTest::timestamp = 69000;
+    periodicTask();
+    ASSERT_EQ(3, TNPTest::advertisingCalls);
+    ASSERT_EQ(1, reports);
+    ASSERT_EQ(sequenceID, reportedSequenceID);
+    ASSERT_FALSE(reportedDelivered);
+}
+
+TEST_F(TNPTest, OverwrittenPendingACKIsReported) {
+    uint8 message[3] = {1, 2, 3};
+    initializeReportingProtocol(0);
+    uint8 first;
+    sendPrioritizedStatefulMessage(receiver, message, 3, 0, &first);
+    for(int i = 0; i < PENDING_ACK_MAX - 1; i++) {
+        sendStatefulMessage(receiver, message, 3);
+    }
+    ASSERT_EQ(0, reports);
+    
+    ASSERT_EQ(PENDING_ACK_ADMITTED_EVICTED, sendStatefulMessage(receiver, message, 3));
+    ASSERT_EQ(1, reports);
+    ASSERT_EQ(first, reportedSequenceID);
+    ASSERT_FALSE(reportedDelivered);
+}
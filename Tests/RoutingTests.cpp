@@ -0,0 +1,101 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static const uint16 destination = 0x0200;
+
+static void receive(MessageType type, uint16 source, uint16 target, 
+        uint8 sequenceID, uint8 ttl, uint8 initialTTL = MESSAGE_TTL_DEFAULT) {
+    uint8 message[HEADER_SIZE + 1] = {0};
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = TNPTest::networkID;
+    header->source = source;
+    header->destination = target;
+    header->type = type;
+    header->sequenceID = sequenceID;
+    header->ttl = ttl;
+    header->initialTTL = initialTTL;
+    processIncomingMessage(message, HEADER_SIZE + 1);
+}
+
+static uint8 sentTTL() {
+    return ((MessageHeader*) TNPTest::advertisingData[TNPTest::advertisingCalls - 1])->ttl;
+}
+
+TEST_F(TNPTest, UnicastTTLFollowsLearnedDistance) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 data[1] = {0};
+    
+    // No route yet
+    sendStatelessMessage(destination, data, 1);
+    ASSERT_EQ(MESSAGE_TTL_DEFAULT, sentTTL());
+    
+    // Three hops away, the closest copy counts
+    receive(BROADCAST, destination, 0, 0, MESSAGE_TTL_DEFAULT - 3);
+    receive(BROADCAST, destination, 0, 0, MESSAGE_TTL_DEFAULT - 2);
+    sendStatelessMessage(destination, data, 1);
+    ASSERT_EQ(4, sentTTL());
+    sendStatefulMessage(destination, data, 1);
+    ASSERT_EQ(4, sentTTL());
+    
+    // Resends are flooded
+    TNPTest::timestamp += 6000;
+    periodicTask();
+    ASSERT_EQ(MESSAGE_TTL_DEFAULT, sentTTL());
+    
+    // Forgotten when not heard from for long
+    TNPTest::timestamp += 30000;
+    sendStatelessMessage(destination, data, 1);
+    ASSERT_EQ(MESSAGE_TTL_DEFAULT, sentTTL());
+}
+
+TEST_F(TNPTest, RoutesLearnedWhateverTheSenderTTL) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 data[1] = {0};
+    
+    // A neighbour sending with a smaller TTL than this node
+    receive(BROADCAST, destination, 0, 0, 10, 10);
+    sendStatelessMessage(destination, data, 1);
+    ASSERT_EQ(2, sentTTL());
+    
+    // A routed unicast that took three hops
+    receive(STATELESS_MESSAGE, 0x0300, 0x1234, 0, 2, 4);
+    sendStatelessMessage(0x0300, data, 1);
+    ASSERT_EQ(4, sentTTL());
+    
+    // More TTL left than sent with isn't a valid message to learn from
+    receive(STATELESS_MESSAGE, 0x0400, 0x1234, 0, 5, 4);
+    sendStatelessMessage(0x0400, data, 1);
+    ASSERT_EQ(MESSAGE_TTL_DEFAULT, sentTTL());
+}
+
+TEST_F(TNPTest, RelayOnlyOnRoute) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    // Two hops away
+    receive(BROADCAST, destination, 0, 0, MESSAGE_TTL_DEFAULT - 1);
+    TNPTest::resetRecords();
+    
+    // Enough hops left to get there from here
+    receive(STATELESS_MESSAGE, 0x0300, destination, 0, 3);
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    ASSERT_EQ(2, sentTTL());
+    // This node is off the path
+    receive(STATELESS_MESSAGE, 0x0300, destination, 1, 2);
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    // Flooded when there is no route
+    receive(STATELESS_MESSAGE, 0x0300, 0x0400, 2, 2);
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+}
+
+TEST_F(TNPTest, UnicastRoutingDisabled) {
+    TNPTest::initializeProtocolWithDefaultParameters();
+    uint8 data[1] = {0};
+    setUnicastRouting(FALSE);
+    receive(BROADCAST, destination, 0, 0, MESSAGE_TTL_DEFAULT - 1);
+    TNPTest::resetRecords();
+    
+    receive(STATELESS_MESSAGE, 0x0300, destination, 0, 2);
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    sendStatelessMessage(destination, data, 1);
+    ASSERT_EQ(MESSAGE_TTL_DEFAULT, sentTTL());
+}
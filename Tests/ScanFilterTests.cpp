@@ -0,0 +1,62 @@
+#include "scan_filter.h"
+#include <gtest/gtest.h>
+#include <string.h>
+
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static uint8 framePrefix[ADVERTISING_FRAME_PREFIX_LENGTH] = {0x02, 0x01, 0x06, 27};
+static const uint16 networkID = 0xFACB;
+
+static uint8 setMeshFrame(uint8* frame, uint16 network) {
+    memcpy(frame, framePrefix, ADVERTISING_FRAME_PREFIX_LENGTH);
+    MessageHeader* header = (MessageHeader*) &frame[ADVERTISING_FRAME_PREFIX_LENGTH];
+    memset(header, 0, HEADER_SIZE);
+    header->networkIdentifier = network;
+    header->source = 0x1234;
+    header->type = BROADCAST;
+    return ADVERTISING_FRAME_PREFIX_LENGTH + HEADER_SIZE + 2;
+}
+
+TEST(ScanFilterTest, AcceptsMeshFramesOfTheNetwork) {
+    ScanFilter filter;
+    initializeScanFilter(&filter, framePrefix, networkID);
+    uint8 frame[ADVERTISING_FRAME_LENGTH];
+    uint8 length = setMeshFrame(frame, networkID);
+    ASSERT_EQ(SCAN_FILTER_ACCEPTED, filterScanReport(&filter, frame, length));
+    // The shortest message the protocol takes
+    ASSERT_EQ(SCAN_FILTER_ACCEPTED, filterScanReport(&filter, frame,
+            ADVERTISING_FRAME_PREFIX_LENGTH + SCAN_FILTER_MESSAGE_MIN_LENGTH));
+    ASSERT_EQ(2, getScanFilterCount(&filter, SCAN_FILTER_ACCEPTED));
+}
+
+TEST(ScanFilterTest, RejectsForeignReportsByReason) {
+    ScanFilter filter;
+    initializeScanFilter(&filter, framePrefix, networkID);
+    uint8 frame[ADVERTISING_FRAME_LENGTH];
+
+    uint8 length = setMeshFrame(frame, networkID + 1);
+    ASSERT_EQ(SCAN_FILTER_OTHER_NETWORK, filterScanReport(&filter, frame, length));
+
+    length = setMeshFrame(frame, networkID);
+    ASSERT_EQ(SCAN_FILTER_TOO_SHORT, filterScanReport(&filter, frame,
+            ADVERTISING_FRAME_PREFIX_LENGTH + SCAN_FILTER_MESSAGE_MIN_LENGTH - 1));
+    ASSERT_EQ(SCAN_FILTER_TOO_SHORT, filterScanReport(&filter, frame, 0));
+
+    // An iBeacon: flags, then manufacturer specific data
+    uint8 beacon[30] = {0x02, 0x01, 0x06, 0x1A, 0xFF, 0x4C, 0x00, 0x02, 0x15};
+    ASSERT_EQ(SCAN_FILTER_NOT_MESH, filterScanReport(&filter, beacon, sizeof(beacon)));
+    // The advertising data of a node when it isn't forwarding
+    uint8 nodeData[12] = {0x02, 0x01, 0x06, 0x03, 0xBC, 0xCB, 0xFA, 0x04, 0x09};
+    ASSERT_EQ(SCAN_FILTER_NOT_MESH, filterScanReport(&filter, nodeData, sizeof(nodeData)));
+
+    frame[0] = 0;
+    ASSERT_EQ(SCAN_FILTER_BAD_FRAMING, filterScanReport(&filter, frame, length));
+    frame[0] = length;
+    ASSERT_EQ(SCAN_FILTER_BAD_FRAMING, filterScanReport(&filter, frame, length));
+
+    ASSERT_EQ(0, getScanFilterCount(&filter, SCAN_FILTER_ACCEPTED));
+    ASSERT_EQ(2, getScanFilterCount(&filter, SCAN_FILTER_TOO_SHORT));
+    ASSERT_EQ(2, getScanFilterCount(&filter, SCAN_FILTER_BAD_FRAMING));
+    ASSERT_EQ(2, getScanFilterCount(&filter, SCAN_FILTER_NOT_MESH));
+    ASSERT_EQ(1, getScanFilterCount(&filter, SCAN_FILTER_OTHER_NETWORK));
+}
@@ -0,0 +1,86 @@
+#include "scan_scheduler.h"
+#include <gtest/gtest.h>
+
+// Scans on through adaptation periods in which nothing is heard
+static void scanIdle(ScanScheduler* scheduler, uint32* time, int periods) {
+    for(int i = 0; i < periods; i++) {
+        *time += SCAN_ADAPTATION_PERIOD;
+        startScan(scheduler, *time, 0);
+    }
+}
+
+static uint32 getDutyCycleLevel(ScanScheduler* scheduler) {
+    return 1000 * getScanWindow(scheduler) / getScanInterval(scheduler);
+}
+
+TEST(ScanSchedulerTest, LowersDutyCycleWhenIdle) {
+    ScanScheduler scheduler;
+    uint32 time = 1000;
+    initializeScanScheduler(&scheduler, time);
+    startScan(&scheduler, time, 0);
+    ASSERT_EQ(1000, getDutyCycleLevel(&scheduler));
+
+    // One level down for every quiet period, down to the lowest
+    uint32 lastLevel = 1000;
+    for(int level = 1; level < SCAN_LEVELS; level++) {
+        scanIdle(&scheduler, &time, 1);
+        ASSERT_LT(getDutyCycleLevel(&scheduler), lastLevel);
+        lastLevel = getDutyCycleLevel(&scheduler);
+    }
+    scanIdle(&scheduler, &time, 2);
+    ASSERT_EQ(lastLevel, getDutyCycleLevel(&scheduler));
+
+    // A short discovery doesn't end the period
+    startScan(&scheduler, time + SCAN_ADAPTATION_PERIOD - 1, 0);
+    ASSERT_EQ(lastLevel, getDutyCycleLevel(&scheduler));
+}
+
+TEST(ScanSchedulerTest, RaisesDutyCycleOnTrafficAndBacklog) {
+    ScanScheduler scheduler;
+    uint32 time = 0;
+    initializeScanScheduler(&scheduler, time);
+    scanIdle(&scheduler, &time, SCAN_LEVELS);
+    ASSERT_LT(getDutyCycleLevel(&scheduler), 1000);
+
+    // Queued advertisements bring it back up at the next start
+    startScan(&scheduler, time + 10, 1);
+    ASSERT_EQ(1000, getDutyCycleLevel(&scheduler));
+
+    scanIdle(&scheduler, &time, SCAN_LEVELS);
+    ASSERT_LT(getDutyCycleLevel(&scheduler), 1000);
+    // So do packets, once enough are heard
+    for(int i = 1; i < SCAN_BUSY_PACKETS; i++) {
+        ASSERT_FALSE(countScanPacket(&scheduler));
+    }
+    ASSERT_TRUE(countScanPacket(&scheduler));
+    startScan(&scheduler, time + 10, 0);
+    ASSERT_EQ(1000, getDutyCycleLevel(&scheduler));
+    ASSERT_FALSE(countScanPacket(&scheduler));
+}
+
+TEST(ScanSchedulerTest, CountsDutyCycleAndMissedPackets) {
+    ScanScheduler scheduler;
+    uint32 time = 500;
+    initializeScanScheduler(&scheduler, time);
+
+    // Scanning all the time for the first half of the period
+    startScan(&scheduler, time, 0);
+    for(int i = 0; i < 10; i++) {
+        countScanPacket(&scheduler);
+    }
+    time += SCAN_ADAPTATION_PERIOD / 2;
+    ASSERT_EQ(1000, getScanDutyCycle(&scheduler, time));
+    stopScan(&scheduler, time);
+    ASSERT_EQ(500, getScanDutyCycle(&scheduler, time + SCAN_ADAPTATION_PERIOD / 2));
+
+    // As many are taken to have been missed in the other half
+    time += SCAN_ADAPTATION_PERIOD / 2;
+    startScan(&scheduler, time, 0);
+    ASSERT_EQ(10, getReceivedScanPackets(&scheduler));
+    ASSERT_EQ(10, getMissedScanPackets(&scheduler));
+
+    // Stopping again changes nothing, 1200 of 2400 ms were scanned
+    stopScan(&scheduler, time + 200);
+    stopScan(&scheduler, time + 300);
+    ASSERT_EQ(500, getScanDutyCycle(&scheduler, time + 400));
+}
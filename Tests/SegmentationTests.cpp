@@ -0,0 +1,301 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#include "advertising_queue.h"
+#include <vector>
+#define HEADER_SIZE sizeof(MessageHeader)
+
+struct Frame {
+    uint8 length;
+    uint8 data[32];
+};
+
+static MeshContext sender, receiver;
+static std::vector<Frame> frames;
+static std::vector<std::vector<uint8> > deliveries;
+static int reports;
+static uint16 reportedDestination;
+static uint8 reportedDelivered;
+
+static void recordFrame(uint8* data, uint8 length, uint16 delay) {
+    Frame frame;
+    frame.length = length;
+    memcpy(frame.data, data, length);
+    frames.push_back(frame);
+}
+
+static void recordDelivery(uint16 source, uint8* message, uint8 length) {
+    deliveries.push_back(std::vector<uint8>(message, message + length));
+}
+
+static void recordReport(uint16 destination, uint8 transferID, uint8 delivered) {
+    reports++;
+    reportedDestination = destination;
+    reportedDelivered = delivered;
+}
+
+static void initializeNodes() {
+    frames.clear();
+    deliveries.clear();
+    reports = 0;
+    initializeMeshConnectionProtocolCtx(&sender, TNPTest::networkID, 0x0001, 
+            &recordFrame, &recordDelivery, &TNPTest::getTimestamp,
+            &TNPTest::getRandom, &TNPTest::cancelAdvertisementCallback);
+    initializeMeshConnectionProtocolCtx(&receiver, TNPTest::networkID, 0x0002, 
+            &recordFrame, &recordDelivery, &TNPTest::getTimestamp,
+            &TNPTest::getRandom, &TNPTest::cancelAdvertisementCallback);
+    setDeliveryReportCtx(&sender, &recordReport);
+}
+
+// Hands the frames sent from first on to the node, except the one skipped
+static void deliverFrames(MeshContext* ctx, size_t first, size_t skipped) {
+    size_t last = frames.size();
+    for(size_t i = first; i < last; i++) {
+        if(i != skipped) {
+            Frame frame = frames[i];
+            processIncomingMessageCtx(ctx, frame.data, frame.length);
+        }
+    }
+}
+
+// Lets the sender hand over the windows left of the current round
+static void sendRemainingWindows() {
+    while(sender.segmentedTransfer.unsentSegments != 0) {
+        TNPTest::timestamp += SEGMENT_WINDOW_INTERVAL;
+        periodicTaskCtx(&sender);
+    }
+}
+
+static SegmentHeader* getSegmentHeader(size_t frame) {
+    return (SegmentHeader*) &frames[frame].data[HEADER_SIZE];
+}
+
+TEST_F(TNPTest, SegmentedMessage) {
+    initializeNodes();
+    uint8 message[200];
+    for(int i = 0; i < 200; i++) message[i] = i;
+    
+    ASSERT_TRUE(sendSegmentedMessageCtx(&sender, 0x0002, message, 200, FALSE));
+    ASSERT_EQ(SEGMENT_WINDOW, frames.size());
+    // Not before the window is out
+    ASSERT_FALSE(sendSegmentedMessageCtx(&sender, 0x0002, message, 200, FALSE));
+    TNPTest::timestamp += SEGMENT_WINDOW_INTERVAL - 1;
+    periodicTaskCtx(&sender);
+    ASSERT_EQ(SEGMENT_WINDOW, frames.size());
+    sendRemainingWindows();
+    ASSERT_EQ(13, frames.size());
+    for(uint8 i = 0; i < 13; i++) {
+        ASSERT_EQ(SEGMENTED_MESSAGE, ((MessageHeader*) frames[i].data)->type);
+        ASSERT_EQ(i, getSegmentHeader(i)->segmentIndex);
+        ASSERT_EQ(12, getSegmentHeader(i)->lastSegmentIndex);
+        ASSERT_EQ(0, getSegmentHeader(i)->acknowledged);
+        ASSERT_LE(frames[i].length, MESSAGE_LENGTH_MAX);
+    }
+    ASSERT_EQ(MESSAGE_LENGTH_MAX, frames[0].length);
+    ASSERT_EQ(HEADER_SIZE + sizeof(SegmentHeader) + 200 - 12 * SEGMENT_PAYLOAD_LENGTH, 
+            frames[12].length);
+    
+    // Out of order, and a segment twice
+    std::swap(frames[2], frames[7]);
+    frames.push_back(frames[4]);
+    deliverFrames(&receiver, 0, frames.size());
+    ASSERT_EQ(1, deliveries.size());
+    ASSERT_EQ(200, deliveries[0].size());
+    TNPTest::validateData(message, &deliveries[0][0], 200);
+    // No ACKs
+    ASSERT_EQ(14, frames.size());
+}
+
+TEST_F(TNPTest, SegmentedMessageTooLong) {
+    initializeNodes();
+    uint8 message[SEGMENTED_MESSAGE_LENGTH_MAX + 1] = {0};
+    ASSERT_FALSE(sendSegmentedMessageCtx(&sender, 0x0002, message, 
+            SEGMENTED_MESSAGE_LENGTH_MAX + 1, FALSE));
+    ASSERT_TRUE(sendSegmentedMessageCtx(&sender, 0x0002, message, 
+            SEGMENTED_MESSAGE_LENGTH_MAX, FALSE));
+    sendRemainingWindows();
+    ASSERT_EQ(SEGMENT_COUNT_MAX, frames.size());
+}
+
+TEST_F(TNPTest, SegmentBlockACK) {
+    initializeNodes();
+    uint8 message[90];
+    for(int i = 0; i < 90; i++) message[i] = 90 - i;
+    
+    ASSERT_TRUE(sendSegmentedMessageCtx(&sender, 0x0002, message, 90, TRUE));
+    sendRemainingWindows();
+    ASSERT_EQ(6, frames.size());
+    // Only one acknowledged message at a time
+    ASSERT_FALSE(sendSegmentedMessageCtx(&sender, 0x0002, message, 90, TRUE));
+    
+    // Segment 3 is lost, the last one gets a single ACK for the others
+    deliverFrames(&receiver, 0, 3);
+    ASSERT_EQ(0, deliveries.size());
+    ASSERT_EQ(7, frames.size());
+    ASSERT_EQ(SEGMENT_ACK, ((MessageHeader*) frames[6].data)->type);
+    ASSERT_EQ(0x37, frames[6].data[HEADER_SIZE + 1]);
+    
+    // Segment 3 is resent, with the last one
+    deliverFrames(&sender, 6, frames.size());
+    ASSERT_EQ(9, frames.size());
+    ASSERT_EQ(3, getSegmentHeader(7)->segmentIndex);
+    ASSERT_EQ(5, getSegmentHeader(8)->segmentIndex);
+    
+    deliverFrames(&receiver, 7, frames.size());
+    ASSERT_EQ(1, deliveries.size());
+    TNPTest::validateData(message, &deliveries[0][0], 90);
+    ASSERT_EQ(0x3F, frames[9].data[HEADER_SIZE + 1]);
+    ASSERT_EQ(0x3F, frames[10].data[HEADER_SIZE + 1]);
+    
+    // Done, nothing is resent
+    deliverFrames(&sender, 9, frames.size());
+    ASSERT_EQ(1, reports);
+    ASSERT_EQ(0x0002, reportedDestination);
+    ASSERT_TRUE(reportedDelivered);
+    TNPTest::timestamp += 6000;
+    periodicTaskCtx(&sender);
+    ASSERT_EQ(11, frames.size());
+    ASSERT_TRUE(sendSegmentedMessageCtx(&sender, 0x0002, message, 90, TRUE));
+}
+
+TEST_F(TNPTest, SegmentBlockACKLongestMessage) {
+    initializeNodes();
+    uint8 message[200];
+    for(int i = 0; i < 200; i++) message[i] = 3 * i;
+    
+    ASSERT_TRUE(sendSegmentedMessageCtx(&sender, 0x0002, message, 200, TRUE));
+    sendRemainingWindows();
+    ASSERT_EQ(13, frames.size());
+    
+    // Segment 9 is lost, the ACK holds the others in both bytes
+    deliverFrames(&receiver, 0, 9);
+    ASSERT_EQ(14, frames.size());
+    ASSERT_EQ(SEGMENT_ACK, ((MessageHeader*) frames[13].data)->type);
+    ASSERT_EQ(0xFF, frames[13].data[HEADER_SIZE + 1]);
+    ASSERT_EQ(0x1D, frames[13].data[HEADER_SIZE + 2]);
+    
+    deliverFrames(&sender, 13, frames.size());
+    ASSERT_EQ(16, frames.size());
+    ASSERT_EQ(9, getSegmentHeader(14)->segmentIndex);
+    ASSERT_EQ(12, getSegmentHeader(15)->segmentIndex);
+    
+    deliverFrames(&receiver, 14, frames.size());
+    ASSERT_EQ(1, deliveries.size());
+    ASSERT_EQ(200, deliveries[0].size());
+    TNPTest::validateData(message, &deliveries[0][0], 200);
+    ASSERT_EQ(0xFF, frames[16].data[HEADER_SIZE + 1]);
+    ASSERT_EQ(0x1F, frames[16].data[HEADER_SIZE + 2]);
+    
+    deliverFrames(&sender, 16, frames.size());
+    ASSERT_EQ(1, reports);
+    ASSERT_TRUE(reportedDelivered);
+}
+
+TEST_F(TNPTest, SegmentedMessageResentWithoutACK) {
+    initializeNodes();
+    uint8 message[40] = {0};
+    
+    ASSERT_TRUE(sendSegmentedMessageCtx(&sender, 0x0002, message, 40, TRUE));
+    ASSERT_EQ(3, frames.size());
+    
+    for(int i = 0; i < 3; i++) {
+        TNPTest::timestamp += 6000;
+        periodicTaskCtx(&sender);
+    }
+    ASSERT_EQ(12, frames.size());
+    // Given up
+    ASSERT_EQ(0, reports);
+    TNPTest::timestamp += 6000;
+    periodicTaskCtx(&sender);
+    ASSERT_EQ(12, frames.size());
+    ASSERT_EQ(1, reports);
+    ASSERT_FALSE(reportedDelivered);
+    ASSERT_TRUE(sendSegmentedMessageCtx(&sender, 0x0002, message, 40, TRUE));
+}
+
+TEST_F(TNPTest, SegmentLostEveryTime) {
+    initializeNodes();
+    uint8 message[40] = {0};
+    ASSERT_TRUE(sendSegmentedMessageCtx(&sender, 0x0002, message, 40, TRUE));
+    
+    // Segment 1 is lost, the ACK for the others comes twice
+    deliverFrames(&receiver, 0, 1);
+    ASSERT_EQ(4, frames.size());
+    Frame ack = frames[3];
+    deliverFrames(&sender, 3, frames.size());
+    ASSERT_EQ(6, frames.size());
+    processIncomingMessageCtx(&sender, ack.data, ack.length);
+    ASSERT_EQ(6, frames.size());
+    
+    // Segment 1 is lost again, the ACK that follows adds nothing and 
+    // doesn't start another round
+    deliverFrames(&receiver, 4, 4);
+    ASSERT_EQ(7, frames.size());
+    deliverFrames(&sender, 6, frames.size());
+    ASSERT_EQ(7, frames.size());
+    
+    // The round started by the first ACK counts, so two more are left
+    for(int i = 0; i < 2; i++) {
+        TNPTest::timestamp += 6000;
+        periodicTaskCtx(&sender);
+    }
+    ASSERT_EQ(11, frames.size());
+    ASSERT_EQ(0, reports);
+    TNPTest::timestamp += 6000;
+    periodicTaskCtx(&sender);
+    ASSERT_EQ(11, frames.size());
+    ASSERT_EQ(1, reports);
+    ASSERT_EQ(0x0002, reportedDestination);
+    ASSERT_FALSE(reportedDelivered);
+}
+
+static void queueFrame(uint8* data, uint8 length, uint16 delay) {
+    enqueueAdvertisement(length, data, TNPTest::timestamp + delay);
+}
+
+// The messages of this node that are due go on air, to the receiver
+static void sendLocalAdvertisements() {
+    AdvQueueItem* item = getNextInAdvertisementQueue(TNPTest::timestamp);
+    while(item != NULL && getAdvertisingClass(item->data) == ADVERTISING_CLASS_LOCAL) {
+        processIncomingMessageCtx(&receiver, item->data, item->length);
+        removeFromAdvertisementQueue(item);
+        item = getNextInAdvertisementQueue(TNPTest::timestamp);
+    }
+}
+
+TEST_F(TNPTest, SegmentsPacedThroughAdvertisingQueue) {
+    uint8 framePrefix[ADVERTISING_FRAME_PREFIX_LENGTH] = {0x02, 0x01, 0x06, 27};
+    initializeNodes();
+    initializeMeshConnectionProtocolCtx(&sender, TNPTest::networkID, 0x0001, 
+            &queueFrame, &recordDelivery, &TNPTest::getTimestamp,
+            &TNPTest::getRandom, &TNPTest::cancelAdvertisementCallback);
+    setDeliveryReportCtx(&sender, &recordReport);
+    initializeAdvertisementQueue(framePrefix);
+    setAdvertisementQueueSource(0x0001);
+    
+    // Relays waiting take all slots but the reserved ones
+    uint8 relay[HEADER_SIZE + 1] = {0};
+    ((MessageHeader*) relay)->source = 0x0300;
+    ((MessageHeader*) relay)->type = BROADCAST;
+    while(enqueueAdvertisement(sizeof(relay), relay, TNPTest::timestamp + 10000)) {
+        ((MessageHeader*) relay)->sequenceID++;
+    }
+    
+    uint8 message[200];
+    for(int i = 0; i < 200; i++) message[i] = 200 - i;
+    ASSERT_TRUE(sendSegmentedMessageCtx(&sender, 0x0002, message, 200, TRUE));
+    while(sender.segmentedTransfer.destination != 0) {
+        sendLocalAdvertisements();
+        deliverFrames(&sender, 0, frames.size());
+        frames.clear();
+        TNPTest::timestamp += SEGMENT_WINDOW_INTERVAL;
+        periodicTaskCtx(&sender);
+    }
+    
+    // Nothing was dropped, and a single round was enough
+    ASSERT_EQ(0, getAdvertisementQueueDrops(ADVERTISING_CLASS_LOCAL));
+    ASSERT_EQ(0, sender.segmentedTransfer.resentCount);
+    ASSERT_EQ(1, deliveries.size());
+    TNPTest::validateData(message, &deliveries[0][0], 200);
+    ASSERT_EQ(1, reports);
+    ASSERT_TRUE(reportedDelivered);
+}
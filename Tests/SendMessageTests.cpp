@@ -2,6 +2,7 @@
 #include <gtest/gtest.h>
 #include "mesh_transport_network_protocol.h"
 #include <iostream>
+#include <stddef.h>
 #define HEADER_SIZE sizeof(MessageHeader)
 using namespace std;
 
@@ -13,9 +14,7 @@ uint8 TNPTest::advertisingData[20][32] = {0}, TNPTest::messageData[20][23] = {0}
 TEST_F(TNPTest, BroadcastTest) {
     uint16 networkID = 0xFACB;
     uint16 nodeId = 0xC89A;
-    initializeMeshConnectionProtocol(networkID, nodeId, 
-            &TNPTest::advertiseCallback, &TNPTest::messageCallback,
-            &TNPTest::getTimestamp);
+    TNPTest::initializeProtocol(networkID, nodeId);
     int length = 5;
     uint8 data[5] = {0xB, 0xA, 0xB, 0xA, 0};
     broadcastMessage(data, length);
@@ -29,18 +28,16 @@ TEST_F(TNPTest, BroadcastTest) {
     ASSERT_EQ(nodeId, header->source);
     ASSERT_EQ(networkID, header->networkIdentifier);
     ASSERT_EQ(BROADCAST, header->type);
-    ASSERT_EQ(length, header->length);
+    ASSERT_EQ(MESSAGE_TTL_DEFAULT, header->ttl);
     
     // Check content
-    TNPTest::validateData(data, &advertisingData[0][6], length);
+    TNPTest::validateData(data, &advertisingData[0][BROADCAST_HEADER_SIZE], length);
 }
 
 TEST_F(TNPTest, GroupBroadcastTest) {
     uint16 networkID = 0xEB81;
     uint16 nodeId = 0x82AB, destination = 0x2EB1;
-    initializeMeshConnectionProtocol(networkID, nodeId, 
-            &TNPTest::advertiseCallback, &TNPTest::messageCallback,
-            &TNPTest::getTimestamp);
+    TNPTest::initializeProtocol(networkID, nodeId);
     int length = 5;
     uint8 data[5] = {0xB, 0xA, 0xB, 0xA, 0};
     
@@ -52,7 +49,7 @@ TEST_F(TNPTest, GroupBroadcastTest) {
     
     // Check header data
     TNPTest::validateHeaderData(networkID, nodeId, destination, GROUP_BROADCAST, 
-        length, advertisingData[0]);
+        advertisingData[0]);
     
     // Check content
     TNPTest::validateData(data, &advertisingData[0][HEADER_SIZE], length);
@@ -67,9 +64,7 @@ TEST_F(TNPTest, GroupBroadcastTest) {
 TEST_F(TNPTest, StatelessMessageTest) {
     uint16 networkID = 0x1BFA;
     uint16 nodeId = 0xB910, destination = 0x8271;
-    initializeMeshConnectionProtocol(networkID, nodeId, 
-            &TNPTest::advertiseCallback, &TNPTest::messageCallback,
-            &TNPTest::getTimestamp);
+    TNPTest::initializeProtocol(networkID, nodeId);
     int length = 5;
     uint8 data[5] = {0x1B, 0xAF, 0x89, 0x30, 0x59};
     
@@ -81,7 +76,7 @@ TEST_F(TNPTest, StatelessMessageTest) {
     
     // Check header data
     TNPTest::validateHeaderData(networkID, nodeId, destination, STATELESS_MESSAGE, 
-        length, advertisingData[0]);
+        advertisingData[0]);
     
     // Check content
     TNPTest::validateData(data, &advertisingData[0][HEADER_SIZE], length);
@@ -95,9 +90,7 @@ TEST_F(TNPTest, StatelessMessageTest) {
 TEST_F(TNPTest, StatefulMessageTest) {
     uint16 networkID = 0x8FA9;
     uint16 nodeId = 0x0918, destination = 0x8211;
-    initializeMeshConnectionProtocol(networkID, nodeId, 
-            &TNPTest::advertiseCallback, &TNPTest::messageCallback,
-            &TNPTest::getTimestamp);
+    TNPTest::initializeProtocol(networkID, nodeId);
     int length = 5;
     uint8 data[5] = {0x0B, 0x81, 0x89, 0x77, 0x88};
     
@@ -109,7 +102,7 @@ TEST_F(TNPTest, StatefulMessageTest) {
     
     // Check header data
     TNPTest::validateHeaderData(networkID, nodeId, destination, STATEFUL_MESSAGE, 
-        length, advertisingData[0]);
+        advertisingData[0]);
     
     // Check content
     TNPTest::validateData(data, &advertisingData[0][HEADER_SIZE], length);
@@ -120,3 +113,56 @@ TEST_F(TNPTest, StatefulMessageTest) {
     ASSERT_EQ(1, TNPTest::messageCallbacks);
 }
 
+
+static int deliveryReports;
+static uint8 deliveredSequenceID, delivered;
+
+static void recordDelivery(uint16 destination, uint8 sequenceID, uint8 isDelivered) {
+    deliveryReports++;
+    deliveredSequenceID = sequenceID;
+    delivered = isDelivered;
+}
+
+static void receiveFromPeer(uint16 peer, MessageType type, uint8 sequenceID, 
+        uint8 payload) {
+    uint8 message[HEADER_SIZE + 2] = {0};
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = TNPTest::networkID;
+    header->source = peer;
+    header->destination = TNPTest::nodeId;
+    header->type = type;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->sequenceID = sequenceID;
+    message[HEADER_SIZE] = payload;
+    processIncomingMessage(message, HEADER_SIZE + 2);
+}
+
+TEST_F(TNPTest, ResendAlongWithDeferredACK) {
+    uint16 peer = 0x0100;
+    uint8 data[3] = {1, 2, 3};
+    TNPTest::initializeProtocolWithDefaultParameters();
+    deliveryReports = 0;
+    setDeliveryReport(&recordDelivery);
+    uint8 sequenceID;
+    sendPrioritizedStatefulMessage(peer, data, 3, 0, &sequenceID);
+    
+    // The peer sends a message of its own before the resend, so that the 
+    // resend takes the ACK for it along, which gets the next sequence ID
+    TNPTest::timestamp += 4950;
+    receiveFromPeer(peer, STATEFUL_MESSAGE, 40, 0);
+    TNPTest::resetRecords();
+    TNPTest::timestamp += 51;
+    periodicTask();
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    uint8* aggregate = TNPTest::advertisingData[0];
+    ASSERT_EQ(AGGREGATE_SOURCE, ((MessageHeader*) aggregate)->source);
+    // The resent message comes first, without its network identifier
+    uint8 resentID = aggregate[AGGREGATE_HEADER_SIZE + 1 
+            + offsetof(MessageHeader, sequenceID) - sizeof(uint16)];
+    
+    // The ACK of the resent message clears it
+    receiveFromPeer(peer, STATEFUL_MESSAGE_ACK, 41, resentID);
+    ASSERT_EQ(1, deliveryReports);
+    ASSERT_EQ(sequenceID, deliveredSequenceID);
+    ASSERT_TRUE(delivered);
+}
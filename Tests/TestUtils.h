@@ -32,34 +32,47 @@ public:
         return timestamp;
     }
     
-    static void initializeProtocolWithDefaultParameters() {
-        initializeMeshConnectionProtocol(TNPTest::networkID, TNPTest::nodeId, 
+    static uint16 getRandom() {
+        return 0;
+    }
+    
+    static void cancelAdvertisementCallback(uint16 source, uint8 sequenceID) {
+    }
+    
+    static void initializeProtocol(uint16 networkID, uint16 nodeId) {
+        initializeMeshConnectionProtocol(networkID, nodeId, 
             &TNPTest::advertiseCallback, 
             &TNPTest::messageCallback,
-            &TNPTest::getTimestamp);
+            &TNPTest::getTimestamp,
+            &TNPTest::getRandom,
+            &TNPTest::cancelAdvertisementCallback);
     }
     
-    static void advertiseCallback(uint8* data, uint8 length) {
-        for(int i = 0; i < length; i++) {
+    static void initializeProtocolWithDefaultParameters() {
+        initializeProtocol(TNPTest::networkID, TNPTest::nodeId);
+    }
+    
+    static void advertiseCallback(uint8* data, uint8 length, uint16 delay) {
+        // Only the first calls are recorded, the rest are just counted
+        for(int i = 0; advertisingCalls < 20 && i < length; i++) {
             advertisingData[advertisingCalls][i] = data[i];
         }
         advertisingCalls++;
     }
     
-    static void messageCallback(uint8* message, uint8 length) {
-        for(int i = 0; i < length; i++) {
+    static void messageCallback(uint16 source, uint8* message, uint8 length) {
+        for(int i = 0; messageCallbacks < 20 && i < length; i++) {
             messageData[messageCallbacks][i] = message[i];
         }
         messageCallbacks++;
     }
     
     static void validateHeaderData(uint16 networkID, uint16 source, 
-            uint16 destination, MessageType type, uint8 length, uint8* rawData) {
+            uint16 destination, MessageType type, uint8* rawData) {
         MessageHeader* header = (MessageHeader*) rawData;
         ASSERT_EQ(source, header->source);
         ASSERT_EQ(networkID, header->networkIdentifier);
         ASSERT_EQ(type, header->type);
-        ASSERT_EQ(length, header->length);
         ASSERT_EQ(destination, header->destination);
     }
     
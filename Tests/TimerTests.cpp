@@ -0,0 +1,109 @@
+#include "TestUtils.h"
+#include "mesh_transport_network_protocol.h"
+#define HEADER_SIZE sizeof(MessageHeader)
+
+static void receiveStateless(uint16 source, uint8 sequenceID) {
+    uint8 message[HEADER_SIZE + 1] = {0};
+    MessageHeader* header = (MessageHeader*) message;
+    header->networkIdentifier = TNPTest::networkID;
+    header->source = source;
+    header->destination = TNPTest::nodeId;
+    header->type = STATELESS_MESSAGE;
+    header->ttl = MESSAGE_TTL_DEFAULT;
+    header->sequenceID = sequenceID;
+    processIncomingMessage(message, HEADER_SIZE + 1);
+}
+
+TEST_F(TNPTest, NextDeadlineIsEarliestTimer) {
+    uint8 message[3] = {1, 2, 3};
+    uint32 deadline;
+    TNPTest::timestamp = 1003;
+    TNPTest::initializeProtocolWithDefaultParameters();
+    ASSERT_FALSE(getNextDeadline(&deadline));
+    
+    sendStatefulMessage(0x0100, message, 3);
+    ASSERT_TRUE(getNextDeadline(&deadline));
+    ASSERT_EQ(6003, deadline);
+    
+    // Records of processed messages expire after 3000 ms, and are cleared 
+    // up to 500 ms later
+    TNPTest::timestamp = 2500;
+    receiveStateless(0x0200, 1);
+    ASSERT_TRUE(getNextDeadline(&deadline));
+    ASSERT_EQ(6001, deadline);
+    
+    TNPTest::timestamp = 6000;
+    periodicTask();
+    ASSERT_TRUE(getNextDeadline(&deadline));
+    ASSERT_EQ(6001, deadline);
+    TNPTest::timestamp = 6001;
+    periodicTask();
+    ASSERT_TRUE(getNextDeadline(&deadline));
+    ASSERT_EQ(6003, deadline);
+    
+    // The processed message is forgotten, so it is delivered again
+    receiveStateless(0x0200, 1);
+    ASSERT_EQ(2, TNPTest::messageCallbacks);
+}
+
+TEST_F(TNPTest, TimersRunAtTheirDeadlines) {
+    PendingACK buffer[64];
+    uint8 message[3] = {1, 2, 3};
+    uint32 deadlines[64];
+    uint16 timeouts[64];
+    TNPTest::timestamp = 100000;
+    TNPTest::initializeProtocolWithDefaultParameters();
+    setPendingACKBuffer(buffer, 64);
+    
+    // Deadlines over several turns of the first two levels
+    for(int i = 0; i < 64; i++) {
+        deadlines[i] = TNPTest::timestamp + 5000;
+        timeouts[i] = 5000;
+        sendStatefulMessage(0x0100 + i, message, 3);
+        TNPTest::timestamp += 37 + (i * 53) % 211;
+    }
+    TNPTest::resetRecords();
+    
+    // Each message is resent at the first call not before its deadline, 
+    // with the timeout doubling every time
+    int expected = 0;
+    uint32 end = TNPTest::timestamp + 16000;
+    while(TNPTest::timestamp < end) {
+        uint32 nextDeadline = 0xFFFFFFFF;
+        for(int i = 0; i < 64; i++) {
+            if(TNPTest::timestamp >= deadlines[i]) {
+                expected++;
+                timeouts[i] *= 2;
+                deadlines[i] = TNPTest::timestamp + timeouts[i];
+            }
+            if(deadlines[i] < nextDeadline) {
+                nextDeadline = deadlines[i];
+            }
+        }
+        periodicTask();
+        ASSERT_EQ(expected, TNPTest::advertisingCalls);
+        uint32 deadline;
+        ASSERT_TRUE(getNextDeadline(&deadline));
+        ASSERT_EQ(nextDeadline, deadline);
+        TNPTest::timestamp += 1 + (TNPTest::timestamp * 7) % 97;
+    }
+}
+
+TEST_F(TNPTest, TimersRunAfterLongPause) {
+    uint8 message[3] = {1, 2, 3};
+    TNPTest::timestamp = 0;
+    TNPTest::initializeProtocolWithDefaultParameters();
+    sendStatefulMessage(0x0100, message, 3);
+    TNPTest::resetRecords();
+    
+    // Far beyond the wheel, every resend falls due during the pause
+    TNPTest::timestamp = 3600000;
+    periodicTask();
+    ASSERT_EQ(1, TNPTest::advertisingCalls);
+    uint32 deadline;
+    ASSERT_TRUE(getNextDeadline(&deadline));
+    ASSERT_EQ(3610000, deadline);
+    TNPTest::timestamp = deadline;
+    periodicTask();
+    ASSERT_EQ(2, TNPTest::advertisingCalls);
+}